@@ -0,0 +1,231 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/** TLS PROFILES BENCHMARK (LINUX ONLY)
+
+	Measures, for each BriandIDFTlsContext profile, the handshake time and the bulk download throughput
+	against a local mbedtls server (loopback, mbedtls test certificates, INSECURE mode on the client side).
+
+	Build and run with the included Makefile:
+
+	$ make tls_benchmark
+	$ ./tls_benchmark_exe
+
+	Requires mbedtls built with MBEDTLS_CERTS_C (Debian libmbedtls-dev is).
+*/
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#if defined(__linux__)
+	#include "BriandEspLinuxPorting.hxx"
+#else
+	#error "LINUX ONLY BENCHMARK"
+#endif
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/certs.h>
+#include <mbedtls/pk.h>
+
+#include "BriandIDFSocketTlsClient.hxx"
+
+using namespace std;
+
+// Required for C++ use WITH IDF!
+extern "C" {
+	void app_main();
+}
+
+/** Handshakes for each profile */
+const int HANDSHAKES = 20;
+/** Bytes downloaded for each profile */
+const uint32_t BULK_BYTES = 8*1024*1024;
+/** Port of the local server (loopback) */
+const char* SERVER_PORT = "44330";
+
+/** Set when the server is listening */
+std::atomic<bool> serverReady(false);
+
+void tlsserver();		// Early declaration, local mbedtls server
+void benchmark(const string& profile);	// Early declaration, benchmarks one profile
+
+void app_main() {
+	std::thread server(tlsserver);
+	server.detach();
+
+	while (!serverReady) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	printf("%-26s %-48s %14s %14s\n", "PROFILE", "CIPHER SUITE", "HANDSHAKE ms", "BULK MB/s");
+	for (const string& profile : Briand::BriandIDFTlsContext::GetProfileNames())
+		benchmark(profile);
+
+	exit(0);
+}
+
+void benchmark(const string& profile) {
+	auto tls = make_shared<Briand::BriandIDFTlsContext>();
+	if (!tls->SetProfile(profile)) {
+		printf("%-26s not available in this mbedtls build\n", profile.c_str());
+		return;
+	}
+
+	auto client = make_unique<Briand::BriandIDFSocketTlsClient>();
+	client->SetTlsContext(tls);
+	client->SetTimeout(10, 10);
+
+	struct addrinfo address;
+	struct sockaddr_in ipv4;
+	bzero(&address, sizeof(address));
+	bzero(&ipv4, sizeof(ipv4));
+	ipv4.sin_family = AF_INET;
+	ipv4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.ai_family = AF_INET;
+	address.ai_socktype = SOCK_STREAM;
+	address.ai_addrlen = sizeof(ipv4);
+	address.ai_addr = reinterpret_cast<struct sockaddr*>(&ipv4);
+	short port = static_cast<short>(atoi(SERVER_PORT));
+
+	// Handshakes: full ones, no session resumption. Request 0 bytes, then close.
+	unsigned char request[4] = { 0, 0, 0, 0 };
+	string suite;
+	uint64_t handshakeTotal = 0;
+	for (int i = 0; i < HANDSHAKES; i++) {
+		uint64_t start = esp_timer_get_time();
+		if (!client->Connect(address, port, "localhost")) {
+			printf("%-26s handshake failed\n", profile.c_str());
+			return;
+		}
+		handshakeTotal += esp_timer_get_time() - start;
+		suite = client->GetCipherSuite();
+		client->WriteData(request, sizeof(request));
+		client->Disconnect();
+	}
+
+	// Bulk download
+	if (!client->Connect(address, port, "localhost")) {
+		printf("%-26s handshake failed\n", profile.c_str());
+		return;
+	}
+
+	request[0] = static_cast<unsigned char>((BULK_BYTES >> 24) & 0xFF);
+	request[1] = static_cast<unsigned char>((BULK_BYTES >> 16) & 0xFF);
+	request[2] = static_cast<unsigned char>((BULK_BYTES >> 8) & 0xFF);
+	request[3] = static_cast<unsigned char>(BULK_BYTES & 0xFF);
+
+	auto buffer = make_unique<unsigned char[]>(16384);
+	uint64_t received = 0;
+	uint64_t start = esp_timer_get_time();
+	client->WriteData(request, sizeof(request));
+	while (received < BULK_BYTES) {
+		int ret = client->ReadInto(buffer.get(), 16384);
+		if (ret <= 0) break;
+		received += ret;
+	}
+	uint64_t elapsed = esp_timer_get_time() - start;
+	client->Disconnect();
+
+	if (received < BULK_BYTES) {
+		printf("%-26s bulk download failed (%llu bytes)\n", profile.c_str(), static_cast<unsigned long long>(received));
+		return;
+	}
+
+	printf("%-26s %-48s %14.2f %14.2f\n", profile.c_str(), suite.c_str(),
+		static_cast<double>(handshakeTotal) / HANDSHAKES / 1000.0,
+		(static_cast<double>(received) / (1024.0*1024.0)) / (static_cast<double>(elapsed) / 1000000.0));
+}
+
+void tlsserver() {
+	mbedtls_net_context listenSocket, clientSocket;
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	mbedtls_ssl_config conf;
+	mbedtls_ssl_context ssl;
+	mbedtls_x509_crt rsaCert, ecCert;
+	mbedtls_pk_context rsaKey, ecKey;
+
+	mbedtls_net_init(&listenSocket);
+	mbedtls_net_init(&clientSocket);
+	mbedtls_entropy_init(&entropy);
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	mbedtls_ssl_config_init(&conf);
+	mbedtls_ssl_init(&ssl);
+	mbedtls_x509_crt_init(&rsaCert);
+	mbedtls_x509_crt_init(&ecCert);
+	mbedtls_pk_init(&rsaKey);
+	mbedtls_pk_init(&ecKey);
+
+	// RSA and EC certificates, so both ECDHE-RSA and ECDHE-ECDSA suites could be negotiated
+	if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0) != 0 ||
+		mbedtls_x509_crt_parse(&rsaCert, reinterpret_cast<const unsigned char*>(mbedtls_test_srv_crt_rsa), mbedtls_test_srv_crt_rsa_len) != 0 ||
+		mbedtls_pk_parse_key(&rsaKey, reinterpret_cast<const unsigned char*>(mbedtls_test_srv_key_rsa), mbedtls_test_srv_key_rsa_len, NULL, 0) != 0 ||
+		mbedtls_x509_crt_parse(&ecCert, reinterpret_cast<const unsigned char*>(mbedtls_test_srv_crt_ec), mbedtls_test_srv_crt_ec_len) != 0 ||
+		mbedtls_pk_parse_key(&ecKey, reinterpret_cast<const unsigned char*>(mbedtls_test_srv_key_ec), mbedtls_test_srv_key_ec_len, NULL, 0) != 0 ||
+		mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0 ||
+		mbedtls_ssl_conf_own_cert(&conf, &rsaCert, &rsaKey) != 0 ||
+		mbedtls_ssl_conf_own_cert(&conf, &ecCert, &ecKey) != 0) {
+		printf("[SERVER] Setup failed.\n");
+		exit(1);
+	}
+
+	mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
+
+	if (mbedtls_ssl_setup(&ssl, &conf) != 0 || mbedtls_net_bind(&listenSocket, "127.0.0.1", SERVER_PORT, MBEDTLS_NET_PROTO_TCP) != 0) {
+		printf("[SERVER] Bind failed.\n");
+		exit(1);
+	}
+
+	serverReady = true;
+
+	auto data = make_unique<unsigned char[]>(16384);
+	memset(data.get(), 0x5A, 16384);
+
+	// One connection at a time: read the requested size, send it, close
+	while (true) {
+		mbedtls_net_free(&clientSocket);
+		mbedtls_ssl_session_reset(&ssl);
+
+		if (mbedtls_net_accept(&listenSocket, &clientSocket, NULL, 0, NULL) != 0) continue;
+		mbedtls_ssl_set_bio(&ssl, &clientSocket, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+		int ret;
+		while ((ret = mbedtls_ssl_handshake(&ssl)) == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+		if (ret != 0) continue;
+
+		unsigned char request[4];
+		size_t got = 0;
+		while (got < sizeof(request)) {
+			ret = mbedtls_ssl_read(&ssl, request + got, sizeof(request) - got);
+			if (ret <= 0) break;
+			got += ret;
+		}
+		if (got < sizeof(request)) continue;
+
+		uint32_t toSend = (static_cast<uint32_t>(request[0]) << 24) | (static_cast<uint32_t>(request[1]) << 16) | (static_cast<uint32_t>(request[2]) << 8) | request[3];
+		while (toSend > 0) {
+			ret = mbedtls_ssl_write(&ssl, data.get(), (toSend < 16384 ? toSend : 16384));
+			if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+			if (ret <= 0) break;
+			toSend -= ret;
+		}
+
+		mbedtls_ssl_close_notify(&ssl);
+	}
+}
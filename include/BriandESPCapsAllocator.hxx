@@ -0,0 +1,106 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * STL allocator and buffer helpers built on heap_caps_malloc(), to choose where memory lives
+ * (MALLOC_CAP_SPIRAM for big buffers, MALLOC_CAP_INTERNAL for small hot ones, MALLOC_CAP_DMA...).
+*/
+
+#pragma once
+
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <new>
+
+#if defined(ESP_PLATFORM)
+    #include <esp_heap_caps.h>
+#elif defined(__linux__)
+    #include "BriandEspLinuxPorting.hxx"
+#else
+    #error "UNSUPPORTED PLATFORM (ESP32 OR LINUX REQUIRED)"
+#endif
+
+using namespace std;
+
+namespace Briand {
+
+    /**
+     * STL allocator using heap_caps_malloc() with the given capabilities.
+     * If memory with the requested capabilities is exhausted (or not present, e.g. no SPIRAM) the default heap is used.
+    */
+    template <class T, uint32_t CAPS>
+    class BriandESPCapsAllocator {
+        public:
+
+        typedef T value_type;
+
+        template <class U>
+        struct rebind { typedef BriandESPCapsAllocator<U, CAPS> other; };
+
+        BriandESPCapsAllocator() noexcept { }
+
+        template <class U>
+        BriandESPCapsAllocator(const BriandESPCapsAllocator<U, CAPS>&) noexcept { }
+
+        T* allocate(size_t n) {
+            void* p = heap_caps_malloc(n * sizeof(T), CAPS);
+            if (p == NULL) p = heap_caps_malloc(n * sizeof(T), MALLOC_CAP_DEFAULT);
+            if (p == NULL) throw std::bad_alloc();
+            return static_cast<T*>(p);
+        }
+
+        void deallocate(T* p, size_t n) noexcept {
+            heap_caps_free(p);
+        }
+    };
+
+    template <class T, class U, uint32_t CAPS>
+    bool operator==(const BriandESPCapsAllocator<T, CAPS>&, const BriandESPCapsAllocator<U, CAPS>&) { return true; }
+
+    template <class T, class U, uint32_t CAPS>
+    bool operator!=(const BriandESPCapsAllocator<T, CAPS>&, const BriandESPCapsAllocator<U, CAPS>&) { return false; }
+
+    /** Byte vector allocated with the given capabilities */
+    template <uint32_t CAPS>
+    using BriandCapsBytes = vector<unsigned char, BriandESPCapsAllocator<unsigned char, CAPS>>;
+
+    /** Byte vector in SPIRAM (PSRAM) if available */
+    typedef BriandCapsBytes<MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT> BriandSpiramBytes;
+    /** Byte vector in internal RAM */
+    typedef BriandCapsBytes<MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT> BriandInternalBytes;
+    /** Byte vector in DMA capable memory */
+    typedef BriandCapsBytes<MALLOC_CAP_DMA | MALLOC_CAP_8BIT> BriandDmaBytes;
+
+    /** Deleter for buffers allocated with heap_caps_malloc() */
+    struct BriandESPCapsDeleter {
+        void operator()(unsigned char* p) const { heap_caps_free(p); }
+    };
+
+    /** Byte buffer allocated with heap_caps_malloc() */
+    typedef unique_ptr<unsigned char[], BriandESPCapsDeleter> BriandESPCapsBuffer;
+
+    /**
+     * Allocates a byte buffer with the given capabilities (default heap if not available)
+     * @param size buffer size, in bytes
+     * @param caps capabilities (MALLOC_CAP_INTERNAL, MALLOC_CAP_SPIRAM...)
+     * @return the buffer, nullptr if out of memory
+    */
+    inline BriandESPCapsBuffer MakeCapsBuffer(const size_t& size, const uint32_t& caps) {
+        void* p = heap_caps_malloc(size, caps);
+        if (p == NULL) p = heap_caps_malloc(size, MALLOC_CAP_DEFAULT);
+        return BriandESPCapsBuffer(static_cast<unsigned char*>(p));
+    }
+}
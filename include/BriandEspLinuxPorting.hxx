@@ -74,6 +74,8 @@
 		#include <cstring>
 		#include <thread>
 		#include <chrono>
+		#include <mutex>
+		#include <condition_variable>
 		#include <algorithm>
 		#include <unistd.h>
 		#include <signal.h>
@@ -89,6 +91,9 @@
 		#include <sys/ioctl.h>
 		#include <arpa/inet.h>
 		#include <sys/select.h>
+		#include <sys/poll.h>
+		#include <sys/uio.h>
+		#include <fcntl.h>
 
 		// Sockets
 		#include <sys/socket.h>
@@ -184,6 +189,11 @@
 		#define ESP_ERR_NOT_FOUND -2
 		#define ESP_ERR_NVS_NO_FREE_PAGES -3
 		#define ESP_ERR_NVS_NEW_VERSION_FOUND -4
+		#define ESP_ERR_NVS_NOT_FOUND -5
+		#define ESP_ERR_NVS_INVALID_LENGTH -6
+		#define ESP_ERR_NVS_INVALID_HANDLE -7
+		#define ESP_ERR_WIFI_NOT_CONNECT -8
+		#define ESP_ERR_INVALID_ARG -9
 
 		typedef int esp_err_t;
 
@@ -269,6 +279,12 @@
 		#define esp_get_free_heap_size() 320000
 		size_t heap_caps_get_largest_free_block(uint32_t caps);
 
+		// Capabilities are ignored, standard heap is used
+		void* heap_caps_malloc(size_t size, uint32_t caps);
+		void* heap_caps_calloc(size_t n, size_t size, uint32_t caps);
+		void* heap_caps_realloc(void* ptr, size_t size, uint32_t caps);
+		void heap_caps_free(void* ptr);
+
 
 		// WIFI FUNCTIONS
 
@@ -375,19 +391,21 @@
 		esp_err_t esp_wifi_disconnect();
 
 		typedef void* esp_event_handler_instance_t;
-		typedef void* esp_event_handler_t;
+		typedef void (*esp_event_handler_t)(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 		typedef void wifi_event_ap_staconnected_t;
 		typedef void wifi_event_ap_stadisconnected_t;
 
-		#define WIFI_EVENT 0
-		#define IP_EVENT 1
-		#define IP_EVENT_STA_GOT_IP 2
-		#define IP_EVENT_STA_LOST_IP 3
-		#define WIFI_EVENT_STA_DISCONNECTED 4
-		#define WIFI_EVENT_STA_START 5
-		#define WIFI_EVENT_AP_STACONNECTED 6
-		#define WIFI_EVENT_AP_STADISCONNECTED 7
-		#define WIFI_EVENT_WIFI_READY 8
+		// Event bases are compared by address, like ESP_EVENT_DECLARE_BASE(). Ids are the ESP-IDF ones: they overlap between bases.
+		extern esp_event_base_t const WIFI_EVENT;
+		extern esp_event_base_t const IP_EVENT;
+		#define IP_EVENT_STA_GOT_IP 0
+		#define IP_EVENT_STA_LOST_IP 1
+		#define WIFI_EVENT_WIFI_READY 0
+		#define WIFI_EVENT_SCAN_DONE 1
+		#define WIFI_EVENT_STA_START 2
+		#define WIFI_EVENT_STA_DISCONNECTED 5
+		#define WIFI_EVENT_AP_STACONNECTED 14
+		#define WIFI_EVENT_AP_STADISCONNECTED 15
 
 		#define WIFI_AUTH_OPEN 1
 		#define WIFI_AUTH_WPA2_PSK 2
@@ -399,12 +417,56 @@
 			WIFI_PS_MAX_MODEM,   /**< Maximum modem power saving. In this mode, interval to receive beacons is determined by the listen_interval parameter in wifi_sta_config_t */
 		} wifi_ps_type_t;
 
-		// should throw expected events.....
+		// Events are dispatched synchronously, in the posting thread. Simulated events: 
+		// esp_wifi_start() throws WIFI_EVENT_STA_START (STA or APSTA mode), esp_wifi_connect() throws IP_EVENT_STA_GOT_IP,
+		// esp_wifi_disconnect() throws WIFI_EVENT_STA_DISCONNECTED.
 
 		esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler, void *event_handler_arg, esp_event_handler_instance_t *instance);
 		esp_err_t esp_event_handler_instance_unregister(esp_event_base_t event_base, int32_t event_id, esp_event_handler_instance_t instance);
 		esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf);
 		esp_err_t esp_wifi_set_ps(wifi_ps_type_t type);
+		esp_err_t esp_wifi_get_ps(wifi_ps_type_t *type);
+
+		/** Power save mode set with esp_wifi_set_ps() (no effect on the simulation) */
+		extern wifi_ps_type_t BRIAND_CURRENT_PS;
+
+		/** @brief Description of a WiFi AP (simplified) */
+		typedef struct {
+			uint8_t bssid[6];	/**< MAC address of AP */
+			uint8_t ssid[33];	/**< SSID of AP */
+			uint8_t primary;	/**< channel of AP */
+			int8_t  rssi;		/**< signal strength of AP */
+			uint8_t authmode;	/**< authmode of AP */
+		} wifi_ap_record_t;
+
+		/** 
+		 * The simulated APs, returned by scans. esp_wifi_connect() connects to the strongest AP with the configured ssid
+		 * (and bssid, if set), or fails. An AP with empty ssid is a hidden network accepting any ssid.
+		*/
+		extern vector<wifi_ap_record_t> BRIAND_SIMULATED_APS;
+		extern wifi_config_t BRIAND_CURRENT_STA_CONFIG;
+
+		esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info);
+
+		/** @brief Parameters for an SSID scan (simplified: filters are ignored) */
+		typedef struct {
+			uint8_t *ssid;		/**< SSID of AP */
+			uint8_t *bssid;		/**< MAC address of AP */
+			uint8_t channel;	/**< channel, scan the specific channel */
+			bool show_hidden;	/**< enable to scan AP whose SSID is hidden */
+		} wifi_scan_config_t;
+
+		/** Argument structure for WIFI_EVENT_SCAN_DONE event */
+		typedef struct {
+			uint32_t status;	/**< status of scanning APs: 0 — success, 1 - failure */
+			uint8_t number;		/**< number of scan results */
+			uint8_t scan_id;	/**< scan sequence number, used for block scan */
+		} wifi_event_sta_scan_done_t;
+
+		/** Throws WIFI_EVENT_SCAN_DONE (also if block is true) */
+		esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *config, bool block);
+		esp_err_t esp_wifi_scan_get_ap_num(uint16_t *number);
+		esp_err_t esp_wifi_scan_get_ap_records(uint16_t *number, wifi_ap_record_t *ap_records);
 
 		// NETWORKING
 
@@ -427,6 +489,31 @@
 		extern esp_netif_dhcp_status_t BRIAND_CURRENT_DHCPS_STATUS;
 		extern esp_netif_ip_info_t BRIAND_CURRENT_IP;
 
+		/** @brief IP address (simplified, IPv4 only) */
+		typedef struct {
+			union {
+				struct { uint32_t addr; } ip4;
+			} u_addr;
+			uint8_t type;
+		} esp_ip_addr_t;
+
+		/** @brief DNS server info */
+		typedef struct {
+			esp_ip_addr_t ip;
+		} esp_netif_dns_info_t;
+
+		typedef enum {
+			ESP_NETIF_DNS_MAIN= 0,
+			ESP_NETIF_DNS_BACKUP,
+			ESP_NETIF_DNS_FALLBACK,
+			ESP_NETIF_DNS_MAX
+		} esp_netif_dns_type_t;
+
+		extern esp_netif_dns_info_t BRIAND_CURRENT_DNS;
+
+		esp_err_t esp_netif_get_dns_info(esp_netif_t *esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t *dns);
+		esp_err_t esp_netif_set_dns_info(esp_netif_t *esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t *dns);
+
 		esp_err_t esp_netif_dhcpc_get_status(esp_netif_t *esp_netif, esp_netif_dhcp_status_t *status);
 		esp_err_t esp_netif_dhcps_get_status(esp_netif_t *esp_netif, esp_netif_dhcp_status_t *status);
 		esp_err_t esp_netif_dhcpc_stop(esp_netif_t *esp_netif);
@@ -476,6 +563,11 @@
 		typedef uint16_t UBaseType_t;
 		typedef void (*TaskFunction_t)( void * );
 
+		#define pdFALSE ( ( BaseType_t ) 0 )
+		#define pdTRUE ( ( BaseType_t ) 1 )
+		#define pdPASS ( pdTRUE )
+		#define pdFAIL ( pdFALSE )
+
 		/** Task states returned by eTaskGetState. */
 		typedef enum
 		{
@@ -529,6 +621,35 @@
 		UBaseType_t uxTaskGetNumberOfTasks();
 		UBaseType_t uxTaskGetSystemState( TaskStatus_t * const pxTaskStatusArray, const UBaseType_t uxArraySize, uint32_t * const pulTotalRunTime );
 
+		/** Posts an event to the handlers registered with esp_event_handler_instance_register (see above) */
+		esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void *event_data, size_t event_data_size, TickType_t ticks_to_wait);
+
+
+		// EVENT GROUPS
+
+		#define portMAX_DELAY ( ( TickType_t ) 0xffffffffffffffffULL )
+
+		typedef uint32_t EventBits_t;
+
+		/** Event group emulation: bits protected by a mutex, waiters on a condition variable */
+		class BriandIDFPortingEventGroup {
+			public:
+			std::mutex groupMutex;
+			std::condition_variable changed;
+			EventBits_t bits;
+
+			BriandIDFPortingEventGroup();
+		};
+
+		typedef BriandIDFPortingEventGroup* EventGroupHandle_t;
+
+		EventGroupHandle_t xEventGroupCreate();
+		void vEventGroupDelete(EventGroupHandle_t xEventGroup);
+		EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToSet);
+		EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToClear);
+		EventBits_t xEventGroupGetBits(EventGroupHandle_t xEventGroup);
+		EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToWaitFor, const BaseType_t xClearOnExit, const BaseType_t xWaitForAllBits, TickType_t xTicksToWait);
+
 
 		// ESP PTHREADS
 
@@ -551,6 +672,24 @@
 
 		esp_err_t nvs_flash_init(void);
 		esp_err_t nvs_flash_erase(void);
+
+		// NVS: blobs are kept in a file (BRIAND_NVS_FILE), written on nvs_commit()
+
+		extern const char* BRIAND_NVS_FILE;
+
+		typedef uint32_t nvs_handle_t;
+
+		typedef enum {
+			NVS_READONLY,	/*!< Read only */
+			NVS_READWRITE	/*!< Read and write */
+		} nvs_open_mode_t;
+
+		esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle);
+		void nvs_close(nvs_handle_t handle);
+		esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length);
+		esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length);
+		esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key);
+		esp_err_t nvs_commit(nvs_handle_t handle);
 		unsigned int esp_random();
 
 	#endif /* BRIAND_LINUX_PORTING_H */
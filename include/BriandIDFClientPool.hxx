@@ -0,0 +1,171 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <list>
+#include <mutex>
+#include <functional>
+
+#include "BriandESPHeapOptimize.hxx"
+#include "BriandESPDevice.hxx"
+#include "BriandIDFSocketClient.hxx"
+#include "BriandIDFSocketTlsClient.hxx"
+
+#if defined(ESP_PLATFORM)
+	#include <esp_timer.h>
+#elif defined(__linux__)
+	#include "BriandEspLinuxPorting.hxx"
+#else
+    #error "UNSUPPORTED PLATFORM (ESP32 OR LINUX REQUIRED)"
+#endif
+
+using namespace std;
+
+namespace Briand {
+
+	/**
+	 * Pool of connected clients keyed by (host, port, tls), to avoid a new connection (and TLS handshake) for each request.
+	 * Acquire() a client, use it, then Release() it to the pool: it will be handed out again if still alive and not idle for too long.
+	*/
+	class BriandIDFClientPool : public BriandESPHeapOptimize {
+		private:
+
+		protected:
+
+		/** Idle client */
+		typedef struct {
+			/** Key: host */
+			string host;
+			/** Key: port */
+			short port;
+			/** Key: TLS client */
+			bool tls;
+			/** The connected client */
+			unique_ptr<BriandIDFSocketClient> client;
+			/** Released at (esp_timer_get_time() microseconds) */
+			uint64_t idleSince;
+			/** Client size when released, in bytes */
+			size_t size;
+		} PoolEntry;
+
+		/** Flag */
+		bool VERBOSE;
+		/** Idle clients are closed after this time, in seconds */
+		unsigned long IDLE_TIMEOUT_S;
+		/** Maximum bytes held by idle clients (GetObjectSize()) */
+		size_t MAX_POOL_BYTES;
+		/** Clients are not kept if free heap (BriandESPDevice::GetFreeHeap()) is lower than this (0 = no check) */
+		size_t MIN_FREE_HEAP;
+		/** Idle clients, most recently released first */
+		list<PoolEntry> idle;
+		/** Bytes held by idle clients */
+		size_t idleBytes;
+		/** Protects idle list and statistics */
+		std::mutex poolMutex;
+		/** Optional setup of new clients (timeouts, certificates...), called before Connect() */
+		function<void(BriandIDFSocketClient*, const bool&)> clientSetup;
+		/** Statistics: clients reused */
+		unsigned long reusedCount;
+		/** Statistics: clients created */
+		unsigned long createdCount;
+
+		/**
+		 * Moves expired idle clients to the given list (to be closed out of lock). Call with poolMutex locked.
+		 * @param toClose destination list
+		*/
+		virtual void CollectExpired(vector<unique_ptr<BriandIDFSocketClient>>& toClose);
+
+		public:
+
+		/** Constructor */
+		BriandIDFClientPool();
+
+		/** Destructor: closes every idle client */
+		~BriandIDFClientPool();
+
+		/**
+		 * Set output to console (true) or not.
+		 * @param verbose (true/false)
+		*/
+		virtual void SetVerbose(const bool& verbose);
+
+		/**
+		 * Set the idle timeout (default 30 seconds)
+		 * @param idleTimeout_s idle clients are closed after this time, in seconds
+		*/
+		virtual void SetIdleTimeout(const unsigned long& idleTimeout_s);
+
+		/**
+		 * Set memory limits
+		 * @param maxPoolBytes maximum bytes held by idle clients, oldest are closed first. A TLS client holds its record buffers
+		 * (BriandIDFSocketTlsClient::GetMaxTlsBuffersSize()), a lower limit never pools it (default: two TLS clients)
+		 * @param minFreeHeap released clients are closed if free heap is lower than this (default 0, no check)
+		*/
+		virtual void SetMemoryLimits(const size_t& maxPoolBytes, const size_t& minFreeHeap);
+
+		/**
+		 * Set a function to configure new clients before they connect (timeouts, CA chain, ...).
+		 * @param setup function receiving the new client and true if it is a BriandIDFSocketTlsClient
+		*/
+		virtual void SetClientSetup(const function<void(BriandIDFSocketClient*, const bool&)>& setup);
+
+		/**
+		 * Returns a connected client: an idle one (liveness checked) if any, a new one otherwise.
+		 * @param host hostname
+		 * @param port port
+		 * @param tls true for a BriandIDFSocketTlsClient
+		 * @return connected client, nullptr if connection fails
+		*/
+		virtual unique_ptr<BriandIDFSocketClient> Acquire(const string& host, const short& port, const bool& tls);
+
+		/**
+		 * Gives back a client (will be nullptr after call). It is kept only if still alive and within memory limits.
+		 * @param host hostname used in Acquire()
+		 * @param port port used in Acquire()
+		 * @param tls tls flag used in Acquire()
+		 * @param client the client
+		*/
+		virtual void Release(const string& host, const short& port, const bool& tls, unique_ptr<BriandIDFSocketClient>& client);
+
+		/**
+		 * Closes idle clients expired or no more alive
+		*/
+		virtual void Purge();
+
+		/**
+		 * Closes every idle client
+		*/
+		virtual void Clear();
+
+		/** @return number of idle clients */
+		virtual size_t GetIdleCount();
+
+		/** @return number of clients handed out again */
+		virtual unsigned long GetReusedCount();
+
+		/** @return number of clients created */
+		virtual unsigned long GetCreatedCount();
+
+		/** Inherited from BriandESPHeapOptimize */
+		virtual void PrintObjectSizeInfo();
+		/** Inherited from BriandESPHeapOptimize */
+		virtual size_t GetObjectSize();
+	};
+}
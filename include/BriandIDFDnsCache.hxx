@@ -0,0 +1,184 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <list>
+#include <mutex>
+
+#include "BriandESPHeapOptimize.hxx"
+
+// Sockets
+#if defined(ESP_PLATFORM)
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/task.h>
+    #include <lwip/sys.h>
+	#include <lwip/sockets.h>
+	#include <lwip/netdb.h>
+	#include <esp_timer.h>
+#elif defined(__linux__)
+	#include "BriandEspLinuxPorting.hxx"
+#else
+    #error "UNSUPPORTED PLATFORM (ESP32 OR LINUX REQUIRED)"
+#endif
+
+using namespace std;
+
+namespace Briand {
+
+	/** A resolved address (port not set) */
+	typedef struct {
+		/** Address family (AF_INET or AF_INET6) */
+		int family;
+		/** Address length */
+		socklen_t length;
+		/** The address */
+		struct sockaddr_storage address;
+	} BriandIDFResolvedAddress;
+
+	/**
+	 * Process-wide DNS cache used by the socket clients (SINGLETON!).
+	 * getaddrinfo() does not expose record TTLs, so entries expire after a configurable time.
+	 * Failed lookups are cached too (negative caching) for a shorter time.
+	 * The number of entries is bounded, least recently used entries are evicted first.
+	*/
+	class BriandIDFDnsCache : public BriandESPHeapOptimize {
+		private:
+
+		static BriandIDFDnsCache* Instance;
+
+		/**
+		 * PRIVATE CONSTRUCTOR (Singleton PATTERN!)
+		*/
+		BriandIDFDnsCache();
+		~BriandIDFDnsCache();
+
+		protected:
+
+		/** Cache entry */
+		typedef struct {
+			/** Hostname (key) */
+			string host;
+			/** Resolved addresses, empty for a failed lookup */
+			vector<BriandIDFResolvedAddress> addresses;
+			/** Expiry time (esp_timer_get_time() microseconds) */
+			uint64_t expiresAt;
+		} CacheEntry;
+
+		/** Flag */
+		bool VERBOSE;
+		/** Positive entries time to live, in seconds */
+		unsigned long TTL_S;
+		/** Negative (failed lookup) entries time to live, in seconds */
+		unsigned long NEGATIVE_TTL_S;
+		/** Maximum number of entries */
+		unsigned short MAX_ENTRIES;
+		/** Cache entries, most recently used first */
+		list<CacheEntry> entries;
+		/** Protects entries and statistics */
+		std::mutex cacheMutex;
+		/** Statistics: lookups served from cache */
+		unsigned long hits;
+		/** Statistics: lookups that required a DNS request */
+		unsigned long misses;
+
+		/**
+		 * Performs the DNS request. Addresses are returned in happy eyeballs order (RFC 8305):
+		 * families are alternated, starting with the family of the first result.
+		 * @param host hostname
+		 * @return resolved addresses, empty if lookup fails
+		*/
+		virtual vector<BriandIDFResolvedAddress> Lookup(const string& host);
+
+		/**
+		 * Stores (or replaces) an entry, evicting the least recently used one if the cache is full. Call with cacheMutex locked.
+		 * @param host hostname
+		 * @param addresses resolved addresses, empty for a failed lookup
+		*/
+		virtual void Store(const string& host, const vector<BriandIDFResolvedAddress>& addresses);
+
+		/**
+		 * Prefetch task body
+		 * @param hostsPtr pointer to a heap-allocated vector<string>, deleted by the task
+		*/
+		static void PrefetchTask(void* hostsPtr);
+
+		public:
+
+		/**
+		 * Return the instance (SINGLETON!)
+		*/
+		static BriandIDFDnsCache* GetInstance();
+
+		/**
+		 * Set output to console (true) or not.
+		 * @param verbose (true/false)
+		*/
+		virtual void SetVerbose(const bool& verbose);
+
+		/**
+		 * Set entries time to live (default 300 seconds, negative 10 seconds).
+		 * @param ttl_s successful lookups time to live, in seconds. 0 disables caching.
+		 * @param negativeTtl_s failed lookups time to live, in seconds. 0 disables negative caching.
+		*/
+		virtual void SetTTL(const unsigned long& ttl_s, const unsigned long& negativeTtl_s);
+
+		/**
+		 * Set the maximum number of cached hostnames (default 16). Exceeding entries are evicted.
+		 * @param maxEntries maximum entries (at least 1)
+		*/
+		virtual void SetMaxEntries(const unsigned short& maxEntries);
+
+		/**
+		 * Resolves a hostname, from cache if a valid entry exists, with a DNS request otherwise.
+		 * @param host hostname (or numeric address)
+		 * @return resolved addresses in connection order (port not set), empty if lookup fails
+		*/
+		virtual vector<BriandIDFResolvedAddress> Resolve(const string& host);
+
+		/**
+		 * Resolves in background (one task) every hostname not already cached, so the first Connect() is fast too.
+		 * @param hosts hostnames to resolve
+		 * @return true if the task has been started (or nothing to do), false otherwise
+		*/
+		virtual bool Prefetch(const vector<string>& hosts);
+
+		/**
+		 * Removes a hostname from cache (for example after a connection failure).
+		 * @param host hostname
+		*/
+		virtual void Invalidate(const string& host);
+
+		/**
+		 * Removes every entry
+		*/
+		virtual void Clear();
+
+		/** @return number of lookups served from cache */
+		virtual unsigned long GetHits();
+
+		/** @return number of lookups that required a DNS request */
+		virtual unsigned long GetMisses();
+
+		/** Inherited from BriandESPHeapOptimize */
+		virtual void PrintObjectSizeInfo();
+		/** Inherited from BriandESPHeapOptimize */
+		virtual size_t GetObjectSize();
+	};
+}
@@ -18,8 +18,13 @@
 #include <iostream>
 #include <memory>
 #include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
 
 #include "BriandESPHeapOptimize.hxx"
+#include "BriandIDFDnsCache.hxx"
+#include "BriandESPCapsAllocator.hxx"
 
 // Sockets
 #if defined(ESP_PLATFORM)
@@ -27,7 +32,9 @@
 	#include <lwip/dns.h>
 	#include <lwip/sockets.h>
 	#include <lwip/netdb.h>
-	#include <sys/select.h>
+	#include <sys/poll.h>
+	#include <fcntl.h>
+	#include <esp_timer.h>
 #elif defined(__linux__)
 	#include "BriandEspLinuxPorting.hxx"
 #else
@@ -38,6 +45,14 @@ using namespace std;
 
 namespace Briand {
 
+	/**
+	 * Sink for ReadStream(): receives each chunk as soon as it is read (data is valid only during the call).
+	 * @param data received bytes
+	 * @param size number of received bytes
+	 * @return true to continue reading, false to pause (ReadStream() returns, call it again to resume)
+	*/
+	typedef function<bool(const unsigned char* data, const size_t& size)> BriandIDFStreamSink;
+
 	/** This class is a simple socket client (not SSL) */
 	class BriandIDFSocketClient : public BriandESPHeapOptimize {
 		private:
@@ -50,22 +65,108 @@ namespace Briand {
 		bool VERBOSE;
 		/* Flag */
 		bool CONNECTED;
-		/* Connection timeout */
-		unsigned short CONNECT_TIMEOUT_S;
-		/* Read/write timeout */
-		unsigned short IO_TIMEOUT_S;
+		/* Connection timeout, in milliseconds */
+		unsigned long CONNECT_TIMEOUT_MS;
+		/* Read/write timeout (for each wait on the socket), in milliseconds */
+		unsigned long IO_TIMEOUT_MS;
+		/* Absolute I/O deadline (esp_timer_get_time() microseconds), 0 if not set */
+		uint64_t ioDeadline;
 		/* Internal buffer size for read operation */
 		unsigned short RECV_BUF_SIZE;
 		/* Internal socket */
 		int _socket;
-		/* Poll/Select operations timeout in seconds (default: 10 seconds) */
-		const unsigned char poll_default_timeout_s = 10;
+		/* Persistent receiving buffer (RECV_BUF_SIZE bytes), allocated in internal RAM on first read and reused */
+		BriandESPCapsBuffer recvBuffer;
+		/* Read-ahead buffer (internal RAM), holds bytes received but not yet returned to the caller */
+		BriandESPCapsBuffer readAheadBuffer;
+		/* Read-ahead buffer capacity */
+		size_t readAheadSize;
+		/* Read-ahead buffer: index of the first unread byte */
+		size_t readAheadStart;
+		/* Read-ahead buffer: index after the last unread byte */
+		size_t readAheadEnd;
+		/* Poll operations timeout in milliseconds, when no timeout is set (default: 10 seconds) */
+		const unsigned long poll_default_timeout_ms = 10000;
+		/* Happy eyeballs: delay before starting the next connection attempt, in milliseconds (RFC 8305 suggests 250) */
+		const unsigned short connect_attempt_delay_ms = 250;
+		/* Address of the last successful connection */
+		string lastConnectAddress;
+		/* Time taken by the last successful connection, in milliseconds */
+		unsigned long lastConnectTimeMs;
+		/* Successful connections counter (a new connection could get the same socket descriptor) */
+		unsigned long connectGeneration;
+		/* Flag, notify socket traffic to the wifi manager (power save off during bursts) */
+		bool POWER_BURST;
+		/* Flag, report the TCP handshake time of each connection to the wifi manager RTT statistics */
+		bool RTT_REPORT;
+
+		/**
+		 * Notifies socket traffic to the wifi manager, if POWER_BURST is set
+		*/
+		virtual void NotifyTraffic();
 
 		/**
 		 * Method set default socket options (timeout, keepalive...)
 		*/
 		virtual void SetDefaultSocketOptions();
 
+		/**
+		 * Deadline of the TCP connection opened now: the connection timeout from now, never beyond the I/O deadline if set.
+		 * @param startTime connection start time (esp_timer_get_time() microseconds)
+		 * @return the deadline (esp_timer_get_time() microseconds)
+		*/
+		virtual uint64_t GetConnectDeadline(const uint64_t& startTime);
+
+		/**
+		 * Opens the TCP connection (sets _socket, does not set CONNECTED). Every candidate is tried with a non-blocking connect():
+		 * attempts are started connect_attempt_delay_ms apart (or immediately when the previous one fails) and raced, the first
+		 * established wins and the others are closed. The whole operation is limited by GetConnectDeadline().
+		 * @param candidates Addresses to try, in order of preference
+		 * @return true if connected, false otherwise
+		*/
+		virtual bool OpenSocket(const vector<const struct addrinfo*>& candidates);
+
+		/**
+		 * Resolves the host (through BriandIDFDnsCache) and opens the TCP connection with OpenSocket(candidates).
+		 * @param host hostname
+		 * @param port port to connect
+		 * @return true if connected, false otherwise
+		*/
+		virtual bool OpenSocket(const string& host, const short& port);
+
+		/**
+		 * Waits for the socket to be ready, at most the I/O timeout (default 10 seconds) and never beyond the deadline, if set.
+		 * @param events poll() events (POLLIN, POLLOUT)
+		 * @return 1 if ready, 0 on timeout or deadline reached, -1 on error
+		*/
+		virtual int WaitSocket(const short& events);
+
+		/**
+		 * Reads from the underlying connection (no read-ahead buffer involved). Waits for data at most the I/O timeout.
+		 * @param buffer destination buffer
+		 * @param size destination buffer capacity, in bytes
+		 * @return number of bytes read, 0 if nothing read (timeout, EOF or peer disconnected), -1 on error
+		*/
+		virtual int ReadRaw(unsigned char* buffer, const size_t& size);
+
+		/**
+		 * Writes to the underlying connection, just once (could be a short write).
+		 * @param buffer data to send
+		 * @param size data size, in bytes
+		 * @return number of bytes written, -1 on error
+		*/
+		virtual int WriteRaw(const unsigned char* buffer, const size_t& size);
+
+		/**
+		 * Returns the index of the first occourrence of sequence in data, using memchr() to skip to the candidates.
+		 * @param data the data to scan
+		 * @param dataLen data length
+		 * @param sequence the sequence to find
+		 * @param sequenceLen sequence length (must be > 0)
+		 * @return index of sequence start, dataLen if not found
+		*/
+		static size_t FindSequence(const unsigned char* data, const size_t& dataLen, const unsigned char* sequence, const size_t& sequenceLen);
+
 		public:
 
 		/** Constructor, initialize resources */
@@ -87,12 +188,60 @@ namespace Briand {
 		virtual void SetID(const int& id);
 
 		/**
-		 * Set timeout in seconds (default unlimited=0) for connect and for read/write (default unlimited=0)
-		 * @param connectTimeout_s Connection timeout in seconds (default unlimited = 0)
-		 * @param ioTimeout_s Read/write timeout in seconds (default unlimited = 5)
+		 * Set if socket traffic turns off the wifi power save until the burst ends (see BriandIDFWifiManager::NotifyTraffic()).
+		 * Disabled by default.
+		 * @param enabled true to enable
+		*/
+		virtual void SetPowerBurst(const bool& enabled);
+
+		/**
+		 * Set if the TCP handshake time of each connection (one round trip) is added to the wifi manager RTT statistics
+		 * of the power save profile in effect (see BriandIDFWifiManager::AddRttSample()). Disabled by default.
+		 * @param enabled true to enable
+		*/
+		virtual void SetRttReport(const bool& enabled);
+
+		/**
+		 * Set timeout in seconds for connect and for read/write (default unlimited=0)
+		 * @param connectTimeout_s Connection timeout in seconds, for all the attempts (0 = default 10 seconds)
+		 * @param ioTimeout_s Read/write timeout in seconds, for each wait on the socket (0 = default 10 seconds)
 		*/
 		virtual void SetTimeout(const unsigned short& connectTimeout_s, const unsigned short& ioTimeout_s);
 
+		/**
+		 * Set timeout in milliseconds for connect and for read/write
+		 * @param connectTimeout_ms Connection timeout in milliseconds, for all the attempts (0 = default 10 seconds)
+		 * @param ioTimeout_ms Read/write timeout in milliseconds, for each wait on the socket (0 = default 10 seconds)
+		*/
+		virtual void SetTimeoutMs(const unsigned long& connectTimeout_ms, const unsigned long& ioTimeout_ms);
+
+		/**
+		 * Set an absolute deadline for every following read/write: no operation will wait beyond it, whatever the
+		 * amount of data is trickling in. Stays active until ClearDeadline() or a new SetDeadline().
+		 * @param timeFromNow_ms deadline, in milliseconds from now
+		*/
+		virtual void SetDeadline(const unsigned long& timeFromNow_ms);
+
+		/**
+		 * Removes the deadline set with SetDeadline()
+		*/
+		virtual void ClearDeadline();
+
+		/**
+		 * Returns true if a deadline is set and has been reached
+		 * @return true if deadline expired
+		*/
+		virtual bool IsDeadlineExpired();
+
+		/**
+		 * Read data, like ReadData(), but the whole operation must finish within the given time.
+		 * Any previous deadline is restored after the call.
+		 * @param totalTime_ms maximum time for the whole read, in milliseconds
+		 * @param oneChunk limit the read bytes to ReceivingBufferSize()
+		 * @return Pointer to vector with read data (could be partial if time ran out), empty if fails.
+		*/
+		virtual unique_ptr<vector<unsigned char>> ReadDataWithin(const unsigned long& totalTime_ms, bool oneChunk = false);
+
 		/**
 		 * Set receiving buffer chunk size, in bytes. Default 64.
 		 * @param size Buffer chunk, in bytes (default 64)
@@ -100,15 +249,16 @@ namespace Briand {
 		virtual void SetReceivingBufferSize(const unsigned short& size);
 
 		/**
-		 * Opens a new clear connection with the host
-		 * @param host hostname (a DNS request will be made)
+		 * Opens a new clear connection with the host. Every IPv6/IPv4 address returned by DNS is tried, happy-eyeballs style
+		 * (alternating families, attempts raced), within the connection timeout.
+		 * @param host hostname (resolved through BriandIDFDnsCache, a DNS request is made only if not cached)
 		 * @param port port to connect
 		 * @return true if connected, false otherwise
 		*/
 		virtual bool Connect(const string& host, const short& port);
 
 		/**
-		 * Opens a new clear connection with given address
+		 * Opens a new clear connection with given address, within the connection timeout.
 		 * @param address Address info
 		 * @param port port to connect
 		 * @return true if connected, false otherwise
@@ -126,6 +276,17 @@ namespace Briand {
 		*/
 		virtual bool IsConnected();
 
+		/**
+		 * Cheap liveness probe, does not block and does not consume data: checks for socket errors and peer close.
+		 * @return true if connected and the connection looks usable, false otherwise
+		*/
+		virtual bool IsAlive();
+
+		/**
+		 * @return true if the bytes on the socket are not the application data (for example a TLS client)
+		*/
+		virtual bool IsEncrypted();
+
 		/**
 		 * Sends data
 		 * @param data Data to send
@@ -134,33 +295,140 @@ namespace Briand {
 		virtual bool WriteData(const unique_ptr<vector<unsigned char>>& data);
 
 		/**
-		 * Read data.
+		 * Sends data from a borrowed buffer (no copy). Loops until every byte has been sent.
+		 * @param data Data to send
+		 * @param size Data size, in bytes
+		 * @return true if all bytes have been sent, false otherwise
+		*/
+		virtual bool WriteData(const unsigned char* data, const size_t& size);
+
+		/**
+		 * Sends data from a borrowed string (no copy). Loops until every byte has been sent.
+		 * @param data Data to send
+		 * @return true if all bytes have been sent, false otherwise
+		*/
+		virtual bool WriteData(const string_view& data);
+
+		/**
+		 * Sends multiple buffers at once (scatter-gather, ex. header and body) with sendmsg(), no concatenation copy.
+		 * Loops until every byte of every buffer has been sent.
+		 * @param iov Array of buffers
+		 * @param iovcnt Number of buffers
+		 * @return true if all bytes have been sent, false otherwise
+		*/
+		virtual bool WriteV(const struct iovec* iov, const int& iovcnt);
+
+		/**
+		 * Read data into a caller-owned buffer, no heap allocation is made. Bytes left over by ReadDataUntil() are returned first,
+		 * otherwise waits for data at most the I/O timeout.
+		 * @param buffer destination buffer
+		 * @param size destination buffer capacity, in bytes
+		 * @return number of bytes read, 0 if nothing read (timeout, EOF or peer disconnected), -1 on error
+		*/
+		virtual int ReadInto(unsigned char* buffer, const size_t& size);
+
+		/**
+		 * Read data. Uses the internal receiving buffer, so only the returned vector is allocated.
 		 * @param oneChunk limit the read bytes to ReceivingBufferSize(), check HasMoreBytes() to iterate.
 		 * @return Pointer to vector with read data, empty if fails.
 		*/
 		virtual unique_ptr<vector<unsigned char>> ReadData(bool oneChunk = false);
 
 		/**
-		 * Read data.
+		 * Read data chunk by chunk into a sink, without accumulating it: each chunk (at most ReceivingBufferSize() bytes,
+		 * internal buffer reused) is passed to the sink as soon as received. Reading stops on timeout, deadline, peer close,
+		 * error, when maxBytes have been read or when the sink returns false (backpressure: unread data stays in the socket).
+		 * @param sink the sink
+		 * @param maxBytes maximum bytes to read (0 = no limit)
+		 * @return total bytes passed to the sink
+		*/
+		virtual size_t ReadStream(const BriandIDFStreamSink& sink, const size_t& maxBytes = 0);
+
+		/**
+		 * Read data, like ReadData(), into a vector allocated with the given capabilities (e.g. BriandSpiramBytes to keep
+		 * a big response in SPIRAM). Internal buffers stay in internal RAM.
+		 * @param oneChunk limit the read bytes to ReceivingBufferSize()
+		 * @param expectedSize capacity to reserve in advance, if known (avoids reallocation copies)
+		 * @return Pointer to vector with read data, empty if fails.
+		*/
+		template <uint32_t CAPS>
+		unique_ptr<BriandCapsBytes<CAPS>> ReadDataCaps(bool oneChunk = false, const size_t& expectedSize = 0) {
+			auto data = make_unique<BriandCapsBytes<CAPS>>();
+			if (expectedSize > 0) data->reserve(expectedSize);
+
+			this->ReadStream([&data, oneChunk](const unsigned char* chunk, const size_t& size) {
+				data->insert(data->end(), chunk, chunk + size);
+				return !oneChunk;
+			});
+
+			return std::move(data);
+		}
+
+		/**
+		 * Read data until the stop byte, using the internal read-ahead buffer.
 		 * @param stop The stop byte (ex. '\n')
 		 * @param limit Limit to this amount of bytes. If stop char not found, return (with empty data)
 		 * @param found Set to true if the stop byte is found, otherwise returns the data until limit reached
-		 * @return Pointer to vector with read data (NOT including stop byte!), empty if error occoured or EOF
+		 * @return Pointer to vector with read data (including stop byte), empty if error occoured or EOF
 		*/
 		virtual unique_ptr<vector<unsigned char>> ReadDataUntil(const unsigned char& stop, const size_t& limit, bool& found);
 
 		/**
-		 * Return number of available bytes that could be read. 
+		 * Read data until the delimiter sequence (ex. "\r\n\r\n"). Data is read in chunks into the internal read-ahead buffer,
+		 * bytes received after the delimiter are kept and returned by the following ReadInto()/ReadData()/ReadDataUntil() calls.
+		 * @param delimiter The delimiter bytes sequence (not empty)
+		 * @param limit Limit to this amount of bytes.
+		 * @param found Set to true if the delimiter is found, otherwise returns the data until limit reached
+		 * @return Pointer to vector with read data (including delimiter), empty if error occoured or EOF
+		*/
+		virtual unique_ptr<vector<unsigned char>> ReadDataUntil(const vector<unsigned char>& delimiter, const size_t& limit, bool& found);
+
+		/**
+		 * Read data until the delimiter sequence (ex. "\r\n\r\n"). See ReadDataUntil(vector, limit, found)
+		 * @param delimiter The delimiter string (not empty)
+		 * @param limit Limit to this amount of bytes.
+		 * @param found Set to true if the delimiter is found, otherwise returns the data until limit reached
+		 * @return Pointer to vector with read data (including delimiter), empty if error occoured or EOF
+		*/
+		virtual unique_ptr<vector<unsigned char>> ReadDataUntil(const string& delimiter, const size_t& limit, bool& found);
+
+		/**
+		 * Return number of available bytes that could be read (includes the read-ahead buffer). 
 		 * @return number of waiting bytes
 		*/
 		virtual size_t AvailableBytes();
 
+		/**
+		 * Return number of bytes already received and buffered by the client, that could be read without waiting on the socket.
+		 * @return number of buffered bytes
+		*/
+		virtual size_t BufferedBytes();
+
+		/**
+		 * Return the address that won the last successful connection
+		 * @return address in "ip:port" or "[ipv6]:port" format, empty if never connected
+		*/
+		virtual string GetLastConnectAddress();
+
+		/**
+		 * Return the time taken by the last successful connection (from the first attempt to established)
+		 * @return time in milliseconds
+		*/
+		virtual unsigned long GetLastConnectTimeMs();
+
 		/**
 		 * Return the internal socket file descriptor
 		 * @return internal socket fd
 		*/
 		virtual int GetSocketDescriptor();
 
+		/**
+		 * Return the connection generation, incremented on each successful connection: tells a reconnection even when
+		 * the new socket got the same descriptor number
+		 * @return connection generation
+		*/
+		virtual unsigned long GetConnectGeneration();
+
 		/** Inherited from BriandESPHeapOptimize */
 		virtual void PrintObjectSizeInfo();
 		/** Inherited from BriandESPHeapOptimize */
@@ -0,0 +1,194 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <functional>
+
+#include "BriandESPHeapOptimize.hxx"
+#include "BriandIDFSocketClient.hxx"
+
+// poll() over lwIP on ESP, epoll on Linux
+#if defined(ESP_PLATFORM)
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/task.h>
+	#include <sys/poll.h>
+	#include <esp_timer.h>
+#elif defined(__linux__)
+	#include "BriandEspLinuxPorting.hxx"
+	#include <sys/epoll.h>
+#else
+    #error "UNSUPPORTED PLATFORM (ESP32 OR LINUX REQUIRED)"
+#endif
+
+using namespace std;
+
+namespace Briand {
+
+	/** Reactor event: data could be read */
+	#define REACTOR_READABLE 0x01
+	/** Reactor event: data could be written */
+	#define REACTOR_WRITABLE 0x02
+	/** Reactor event: no activity within the client timeout */
+	#define REACTOR_TIMEOUT 0x04
+	/** Reactor event: socket error or peer closed */
+	#define REACTOR_ERROR 0x08
+
+	/**
+	 * Reactor callback.
+	 * @param client the client
+	 * @param events the occurred events (REACTOR_READABLE, REACTOR_WRITABLE, REACTOR_TIMEOUT, REACTOR_ERROR)
+	 * @return true to keep the client, false to remove and destroy it
+	*/
+	typedef function<bool(BriandIDFSocketClient* client, const unsigned char& events)> BriandIDFReactorCallback;
+
+	/**
+	 * Event loop driving many connected clients from a single task.
+	 * Clients are owned by the reactor, callbacks are called from the task running Run()/RunOnce().
+	 * Not thread safe: Add/Remove/SetInterest must be called from the loop task (for example inside callbacks), except Stop().
+	*/
+	class BriandIDFSocketReactor : public BriandESPHeapOptimize {
+		private:
+
+		protected:
+
+		/** Registered client */
+		typedef struct {
+			/** The client */
+			unique_ptr<BriandIDFSocketClient> client;
+			/** Callback */
+			BriandIDFReactorCallback callback;
+			/** Events of interest (REACTOR_READABLE, REACTOR_WRITABLE) */
+			unsigned char interest;
+			/** Socket descriptor currently registered */
+			int fd;
+			/** Client connection generation registered (see BriandIDFSocketClient::GetConnectGeneration()) */
+			unsigned long generation;
+			/** Inactivity timeout in milliseconds, 0 for none */
+			unsigned long timeoutMs;
+			/** Last activity (esp_timer_get_time() microseconds) */
+			uint64_t lastActivity;
+			/** Flag, set when removed during dispatch */
+			bool removed;
+		} ReactorEntry;
+
+		/** Flag */
+		bool VERBOSE;
+		/** Registered clients by id */
+		map<int, ReactorEntry> entries;
+		/** Next id */
+		int nextId;
+		/** Run() loop flag */
+		std::atomic<bool> running;
+		/** True while dispatching events (removals are deferred) */
+		bool dispatching;
+
+		#if defined(__linux__)
+		/** epoll instance */
+		int epollFd;
+		#endif
+
+		/**
+		 * Register/update the entry socket in the platform poller. A new connection of the client (same descriptor or not)
+		 * is added again: closing a socket removes it from epoll.
+		 * @param id entry id
+		 * @param entry the entry
+		*/
+		virtual void Register(const int& id, ReactorEntry& entry);
+
+		/**
+		 * Remove the entry socket from the platform poller
+		 * @param entry the entry
+		*/
+		virtual void Unregister(ReactorEntry& entry);
+
+		/**
+		 * Waits for socket events
+		 * @param waitMs maximum wait time, in milliseconds
+		 * @param events output: occurred events by id
+		 * @return false on poll error
+		*/
+		virtual bool Wait(const unsigned long& waitMs, map<int, unsigned char>& events);
+
+		public:
+
+		/** Constructor */
+		BriandIDFSocketReactor();
+
+		/** Destructor: every client is destroyed (disconnected) */
+		~BriandIDFSocketReactor();
+
+		/**
+		 * Set output to console (true) or not.
+		 * @param verbose (true/false)
+		*/
+		virtual void SetVerbose(const bool& verbose);
+
+		/**
+		 * Adds a connected client, the reactor takes ownership (client will be nullptr after call).
+		 * @param client the connected client
+		 * @param callback events callback
+		 * @param interest events of interest (REACTOR_READABLE and/or REACTOR_WRITABLE)
+		 * @param timeoutMs inactivity timeout in milliseconds (REACTOR_TIMEOUT event), 0 for none
+		 * @return client id (> 0), -1 if client is not connected
+		*/
+		virtual int Add(unique_ptr<BriandIDFSocketClient>& client, const BriandIDFReactorCallback& callback, const unsigned char& interest = REACTOR_READABLE, const unsigned long& timeoutMs = 0);
+
+		/**
+		 * Removes a client, ownership goes back to the caller.
+		 * @param id client id
+		 * @return the client, nullptr if not found (or already removed)
+		*/
+		virtual unique_ptr<BriandIDFSocketClient> Remove(const int& id);
+
+		/**
+		 * Changes the events of interest (for example enable REACTOR_WRITABLE only while there is data to send).
+		 * @param id client id
+		 * @param interest events of interest (REACTOR_READABLE and/or REACTOR_WRITABLE)
+		*/
+		virtual void SetInterest(const int& id, const unsigned char& interest);
+
+		/**
+		 * Waits for events and calls the callbacks, once. Data already buffered by a client is dispatched without waiting.
+		 * @param maxWaitMs maximum wait time, in milliseconds
+		 * @return number of dispatched callbacks, -1 on error
+		*/
+		virtual int RunOnce(const unsigned long& maxWaitMs);
+
+		/**
+		 * Runs the loop until Stop() is called or no client is left.
+		 * @param tickMs maximum wait for each iteration (Stop() latency), in milliseconds
+		*/
+		virtual void Run(const unsigned long& tickMs = 100);
+
+		/**
+		 * Stops Run() (could be called from any task or callback)
+		*/
+		virtual void Stop();
+
+		/** @return number of registered clients */
+		virtual size_t GetClientsCount();
+
+		/** Inherited from BriandESPHeapOptimize */
+		virtual void PrintObjectSizeInfo();
+		/** Inherited from BriandESPHeapOptimize */
+		virtual size_t GetObjectSize();
+	};
+}
@@ -27,7 +27,7 @@
 	#include <lwip/dns.h>
 	#include <lwip/sockets.h>
 	#include <lwip/netdb.h>
-	#include <sys/select.h>
+	#include <sys/poll.h>
 #elif defined(__linux__)
 	#include "BriandEspLinuxPorting.hxx"
 #else
@@ -41,8 +41,12 @@
 #include <mbedtls/ssl.h>
 #include <mbedtls/net_sockets.h>
 #include <mbedtls/error.h>
+#include <mbedtls/platform.h>
 
 #include <BriandIDFSocketClient.hxx>
+#include "BriandIDFTlsContext.hxx"
+#include "BriandIDFTlsSessionCache.hxx"
+#include "BriandIDFTlsTransport.hxx"
 
 using namespace std;
 
@@ -56,46 +60,137 @@ namespace Briand {
 
 		/** Error buffer size */
 		const unsigned char ERR_BUF_SIZE = 128;
-		/** A random personalization string */
-		unsigned char personalization_string[16];
 		/** The tls socket */
 		mbedtls_net_context tls_socket;
-		/** Mbedtls entropy */
-		mbedtls_entropy_context entropy;
-		/** Mbedtls RNG */
-		mbedtls_ctr_drbg_context ctr_drbg;
 		/** Mbedtls SSL context */
 		mbedtls_ssl_context ssl;
-		/** Mbedtls SSL configuration */
-		mbedtls_ssl_config conf;
-		/** Mbedtls certificate chain */
-		mbedtls_x509_crt cacert;
-		/** Minimum RSA key size in bits */
-		unsigned short min_rsa_key_size;
-		/** Flag */
-		bool caChainLoaded;
-		/** Flag */
-		bool caChainFailed;
+		/** TLS context (RNG, configuration, CA chain), shared or owned by this client */
+		shared_ptr<BriandIDFTlsContext> tlsContext;
+		/** Flag, the TLS context is owned by this client (created by the certificate setters or at connection) */
+		bool privateContext;
+		/** TLS context the SSL context has been set up with (reset instead of set up again if unchanged) */
+		shared_ptr<BriandIDFTlsContext> setupContext;
 		/** Flag */
 		bool resourcesReady;
+		/** Flag, offer/save sessions with BriandIDFTlsSessionCache */
+		bool SESSION_RESUMPTION;
+		/** Flag, free verification-only material (peer certificate, private CA chain) after the handshake */
+		bool RELEASE_AFTER_HANDSHAKE;
+		/** Duration of the last handshake, in milliseconds */
+		unsigned long lastHandshakeTimeMs;
+		/** Flag, handshake in progress (ConnectStart() called, ConnectStep() not completed) */
+		bool HANDSHAKING;
+		/** Flag, a cached session has been offered for the handshake in progress */
+		bool sessionOffered;
+		/** Connection deadline (esp_timer_get_time() microseconds) */
+		uint64_t handshakeDeadline;
+		/** Handshake start time (esp_timer_get_time() microseconds) */
+		uint64_t handshakeStart;
+		/** Socket events the handshake is waiting for (POLLIN/POLLOUT) */
+		short handshakeWaitEvents;
+		/** Host of the connection in progress (session cache key) */
+		string connectHost;
+		/** Port of the connection in progress (session cache key) */
+		short connectPort;
+		/** Transport the TLS connection runs over, nullptr for the client own socket */
+		unique_ptr<BriandIDFTlsTransport> transport;
 
 		/**
 		 * Method set default socket options (timeout, keepalive...)
 		*/
 		virtual void SetDefaultSocketOptions();
 
-		/** Free any resource (RNG, Entropy, context...) */
+		/**
+		 * The TCP connect shares the connection deadline set by PrepareConnect() with the handshake
+		 * @param startTime connection start time (esp_timer_get_time() microseconds)
+		 * @return the deadline (esp_timer_get_time() microseconds)
+		*/
+		virtual uint64_t GetConnectDeadline(const uint64_t& startTime);
+
+		/** Free any resource (SSL context, socket, private TLS context). Called by the destructor only, Disconnect() keeps them. */
 		virtual void ReleaseResources();
 
-		/** Perpare needed resource (RNG, Entropy, context...) */
+		/** Perpare needed resource (SSL context, socket) */
 		virtual void SetupResources();
 
+		/**
+		 * Returns the TLS context owned by this client, a new one is created if none, if a shared one was attached or if the
+		 * private one is locked (already used). A new context takes the whole configuration of the current one, so it is
+		 * never less secure (peer verification stays on).
+		 * @param keepCAChain false to start a new CA chain in the new context (the other settings are copied anyway)
+		 * @return the private TLS context
+		*/
+		virtual BriandIDFTlsContext* GetPrivateContext(const bool& keepCAChain = true);
+
+		/**
+		 * First connection step: closes any previous connection, checks the TLS context and sets the connection deadline.
+		 * @return true if the connection could go on, false otherwise
+		*/
+		virtual bool PrepareConnect();
+
+		/**
+		 * Sets up the SSL context over the connected socket and starts the non-blocking handshake.
+		 * @param host server name, for SNI and certificate verification
+		 * @param port port (session cache key)
+		 * @return true if the handshake has been started, false otherwise (disconnected)
+		*/
+		virtual bool StartHandshake(const string& host, const short& port);
+
+		/**
+		 * Drives the handshake started by ConnectStart() until completion, waiting on the socket.
+		 * @return true if connected, false otherwise
+		*/
+		virtual bool CompleteHandshake();
+
+		/**
+		 * Frees what is needed only to verify the server, once the handshake succeeded: the peer certificate chain kept in the session
+		 * (MBEDTLS_SSL_KEEP_PEER_CERTIFICATE, always kept before mbedtls 2.18) and the CA chain of the private TLS context (see BriandIDFTlsContext::ReleaseCAChain()).
+		*/
+		virtual void ReleaseVerificationMaterial();
+
+		/**
+		 * Waits on the socket, or on the transport if any (same I/O timeout and deadline).
+		 * @param events POLLIN and/or POLLOUT
+		 * @return 1 if ready, 0 on timeout or deadline reached, -1 on error
+		*/
+		virtual int WaitSocket(const short& events);
+
+		/**
+		 * mbedtls send callback: waits with poll() (I/O timeout and deadline) then writes to the socket or the transport.
+		 * @param ctx the client (this)
+		 * @return bytes sent, MBEDTLS_ERR_SSL_TIMEOUT or a mbedtls net error
+		*/
+		static int BioSend(void* ctx, const unsigned char* buf, size_t len);
+
+		/**
+		 * mbedtls receive callback: waits with poll() (I/O timeout and deadline) then reads from the socket or the transport.
+		 * @param ctx the client (this)
+		 * @return bytes received, MBEDTLS_ERR_SSL_TIMEOUT or a mbedtls net error
+		*/
+		static int BioRecv(void* ctx, unsigned char* buf, size_t len);
+
+		/**
+		 * Reads decrypted data from the TLS connection (no read-ahead buffer involved).
+		 * @param buffer destination buffer
+		 * @param size destination buffer capacity, in bytes
+		 * @return number of bytes read, 0 if nothing read (EOF, peer close notify or nothing more to read), -1 on error
+		*/
+		virtual int ReadRaw(unsigned char* buffer, const size_t& size);
+
+		/**
+		 * Writes data to the TLS connection, just once (mbedtls could write less bytes than requested).
+		 * @param buffer data to send
+		 * @param size data size, in bytes
+		 * @return number of bytes written, -1 on error
+		*/
+		virtual int WriteRaw(const unsigned char* buffer, const size_t& size);
+
 		public:
 
-		/** Constructor: initializes every resource (RNG, Entropy, context...) */
+		/** Constructor: initializes the SSL context (RNG and configuration come with the TLS context) */
 		BriandIDFSocketTlsClient();
 
-		/** Destructor: every resource will be released (RNG, Entropy, context...) */
+		/** Destructor: every resource will be released (the shared TLS context is released when no more used) */
 		~BriandIDFSocketTlsClient();
 
 		/** 
@@ -105,32 +200,99 @@ namespace Briand {
 		virtual void SetID(const int& id);
 
 		/**
-		 * Set timeout in seconds (default unlimited=0) for connect and for read/write (default unlimited=0)
-		 * @param connectTimeout_s Connection timeout in seconds (default unlimited = 0)
-		 * @param ioTimeout_s Read/write timeout in seconds (default unlimited = 5)
+		 * Set timeout in seconds for connect and for read/write
+		 * @param connectTimeout_s Connection timeout in seconds (0 = default 10 seconds)
+		 * @param ioTimeout_s Read/write timeout in seconds, for each wait on the socket (0 = default 10 seconds)
 		*/
 		virtual void SetTimeout(const unsigned short& connectTimeout_s, const unsigned short& ioTimeout_s);
 
 		/**
-		 * Set the minimum allowed RSA Key size (default 2048).
+		 * Attach a TLS context shared with other clients (RNG, configuration and CA chain are not duplicated).
+		 * The context is locked on the first connection. Certificate setters of this client will replace it with a private one.
+		 * Changing the context closes the connection, the SSL context will be set up again on next connection.
+		 * @param context the TLS context, nullptr to use a private one
+		*/
+		virtual void SetTlsContext(const shared_ptr<BriandIDFTlsContext>& context);
+
+		/**
+		 * @return the TLS context in use, nullptr if none yet
+		*/
+		virtual shared_ptr<BriandIDFTlsContext> GetTlsContext();
+
+		/**
+		 * Enable/disable TLS session resumption (default disabled). When enabled the session is saved in
+		 * BriandIDFTlsSessionCache after each handshake and offered on the next connection to the same host:port.
+		 * @param enable true to enable
+		*/
+		virtual void SetSessionResumption(const bool& enable);
+
+		/**
+		 * Set the cipher suite/curve profile of the private TLS context (see BriandIDFTlsContext::SetProfile()).
+		 * @param profile profile name ("default", "low-latency-ecdhe-x25519", "hw-aes", "chacha20")
+		*/
+		virtual void SetTlsProfile(const string& profile);
+
+		/**
+		 * @return the cipher suite negotiated for the current connection, empty if not connected
+		*/
+		virtual string GetCipherSuite();
+
+		/**
+		 * Enable/disable the release of verification-only material after each successful handshake (default disabled):
+		 * the peer certificate chain is freed and, with a private TLS context built with AddCACertificateToChainDERNoCopy(),
+		 * the parsed CA chain too (it is parsed again, from the same buffers, on the next connection).
+		 * A shared TLS context is never released by clients. mbedtls_ssl_get_peer_cert() returns NULL afterwards.
+		 * @param enable true to enable
+		*/
+		virtual void SetReleaseAfterHandshake(const bool& enable);
+
+		/**
+		 * @return duration of the last TLS handshake, in milliseconds (compare with/without session resumption)
+		*/
+		virtual unsigned long GetLastHandshakeTimeMs();
+
+		/**
+		 * Set the minimum allowed RSA Key size (default 2048) on the private TLS context.
 		 * @param keySize Key size, in bits (default 2048)
 		*/
 		virtual void SetMinRsaKeySize(const unsigned short& keySize);
 
 		/** 
-		 * Method set the Server's PEM CA certificate for the connection. Can be multiple, one following the other.
+		 * Method set the Server's PEM CA certificate for the connection (private TLS context). Can be multiple, one following the other.
+		 * The chain is kept across connections. Once connected, a new call starts a new chain (new private TLS context, the other settings are kept).
 		 * @param pemCAcertificate The CA certificate chain. (First CA, then Server peer). PEM format including BEGIN/END tags
 		*/
 		virtual void SetCACertificateChainPEM(const string& pemCAcertificate);
 
 		/** 
-		 * Method set the Server's DER CA certificate for the connection. Chain could be built with multiple method callings.
+		 * Method set the Server's DER CA certificate for the connection (private TLS context). Chain could be built with multiple method callings.
 		 * @param derCAcertificate The CA certificate (ONLY ONE). (First CA, then Server peer). DER bytes.
 		*/
 		virtual void AddCACertificateToChainDER(const vector<unsigned char>& derCAcertificate);
 
 		/**
-		 * Opens a new TLS connection with the host. If no certificate is set, mode will be INSECURE
+		 * Method adds the Server's DER CA certificate to the chain (private TLS context) without copying it.
+		 * @param derCAcertificate The CA certificate (ONLY ONE). DER bytes, must stay valid while the client exists (static or flash-resident data)
+		 * @param size size of the DER, in bytes
+		*/
+		virtual void AddCACertificateToChainDERNoCopy(const unsigned char* derCAcertificate, const size_t& size);
+
+		/**
+		 * Pins a server public key on the private TLS context (see BriandIDFTlsContext::AddPublicKeyPin()).
+		 * Without CA certificates a pin match is enough to trust the server.
+		 * @param spkiSha256 SHA-256 of the server SubjectPublicKeyInfo DER (32 bytes)
+		*/
+		virtual void AddPublicKeyPin(const vector<unsigned char>& spkiSha256);
+
+		/**
+		 * Pins a server public key on the private TLS context, base64 encoded (see BriandIDFTlsContext::AddPublicKeyPinBase64()).
+		 * @param spkiSha256Base64 SHA-256 of the server SubjectPublicKeyInfo DER, base64
+		*/
+		virtual void AddPublicKeyPinBase64(const string& spkiSha256Base64);
+
+		/**
+		 * Opens a new TLS connection with the host. If no certificate is set, mode will be INSECURE.
+		 * The whole connection (TCP and handshake) must complete within the connect timeout (or the deadline, if earlier).
 		 * @param host hostname (a DNS request will be made)
 		 * @param port port to connect
 		 * @return true if connected, false otherwise
@@ -138,47 +300,132 @@ namespace Briand {
 		virtual bool Connect(const string& host, const short& port);
 
 		/**
-		 * Opens a new TLS connection with given address
-		 * @param address Address info
+		 * Starts a new TLS connection with the host, without blocking on the handshake (for event loops driving many connections).
+		 * The TCP connection is opened (within the connect timeout), then the handshake must be driven with ConnectStep()
+		 * every time the socket (GetSocketDescriptor()) is ready for ConnectWaitEvents().
+		 * The whole connection must complete within the connect timeout (or the deadline, if earlier).
+		 * @param host hostname (a DNS request will be made)
+		 * @param port port to connect
+		 * @return true if the handshake has been started, false otherwise
+		*/
+		virtual bool ConnectStart(const string& host, const short& port);
+
+		/**
+		 * Starts a new TLS connection with the given address, without blocking on the handshake (see ConnectStart(host, port)).
+		 * @param address address info (AF_INET or AF_INET6), no name resolution is done
+		 * @param port port to connect
+		 * @param serverName hostname for SNI and certificate verification, empty to use the address itself
+		 * @return true if the handshake has been started, false otherwise
+		*/
+		virtual bool ConnectStart(const struct addrinfo& address, const short& port, const string& serverName);
+
+		/**
+		 * Starts a new TLS connection over the given transport, without blocking on the handshake (see ConnectStart(host, port)).
+		 * GetSocketDescriptor() returns the transport descriptor, -1 if none (in-memory pipe): ConnectStep() could be
+		 * called after the transport Wait() for ConnectWaitEvents().
+		 * @param transport the connected transport, ownership is taken (nullptr after call) and it is closed with Disconnect()
+		 * @param serverName hostname for SNI and certificate verification (also the session cache key, with port 0)
+		 * @return true if the handshake has been started, false otherwise
+		*/
+		virtual bool ConnectStart(unique_ptr<BriandIDFTlsTransport>& transport, const string& serverName);
+
+		/**
+		 * Performs the handshake as far as possible without blocking.
+		 * @return 1 if connected, 0 if in progress (wait for ConnectWaitEvents() and call again), -1 if failed or timed out (resources released)
+		*/
+		virtual int ConnectStep();
+
+		/** @return true if a handshake is in progress */
+		virtual bool IsConnecting();
+
+		/** @return socket events (POLLIN/POLLOUT) the handshake in progress is waiting for, 0 if none */
+		virtual short ConnectWaitEvents();
+
+		/**
+		 * Opens a new TLS connection with given address. The address itself is used for SNI and certificate verification.
+		 * @param address Address info (AF_INET or AF_INET6)
 		 * @param port port to connect
 		 * @return true if connected, false otherwise
 		*/
 		virtual bool Connect(const struct addrinfo& address, const short& port);
 
 		/**
-		 * Closes the socket connection
+		 * Opens a new TLS connection with given address (already resolved, no DNS request).
+		 * @param address Address info (AF_INET or AF_INET6)
+		 * @param port port to connect
+		 * @param serverName hostname for SNI and certificate verification, empty to use the address itself
+		 * @return true if connected, false otherwise
+		*/
+		virtual bool Connect(const struct addrinfo& address, const short& port, const string& serverName);
+
+		/**
+		 * Opens a new TLS connection over the given transport (a raw descriptor, another client, an in-memory pipe...).
+		 * @param transport the connected transport, ownership is taken (nullptr after call) and it is closed with Disconnect()
+		 * @param serverName hostname for SNI and certificate verification
+		 * @return true if connected, false otherwise
+		*/
+		virtual bool Connect(unique_ptr<BriandIDFTlsTransport>& transport, const string& serverName);
+
+		/**
+		 * Closes the socket connection (or the transport). The TLS context (RNG, CA chain) and the SSL context are kept:
+		 * the next Connect() only resets the SSL context (mbedtls_ssl_session_reset).
 		*/
 		virtual void Disconnect();
 
 		/**
-		 * Sends data
-		 * @param data Data to send
-		 * @return true on success, false otherwise
+		 * Sends multiple buffers. Over TLS every buffer is written with its own record(s), no concatenation copy.
+		 * Loops until every byte of every buffer has been sent.
+		 * @param iov Array of buffers
+		 * @param iovcnt Number of buffers
+		 * @return true if all bytes have been sent, false otherwise
 		*/
-		virtual bool WriteData(const unique_ptr<vector<unsigned char>>& data);
+		virtual bool WriteV(const struct iovec* iov, const int& iovcnt);
 
 		/**
-		 * Read data.
+		 * Read data. Uses the internal receiving buffer, so only the returned vector is allocated.
 		 * @param oneChunk limit the read bytes to ReceivingBufferSize(), check HasMoreBytes() to iterate.
 		 * @return Pointer to vector with read data, empty if fails.
 		*/
 		virtual unique_ptr<vector<unsigned char>> ReadData(bool oneChunk = false);
 
 		/**
-		 * Read data.
-		 * @param stop The stop byte (ex. '\n')
-		 * @param limit Limit to this amount of bytes. If stop char not found, return (with empty data)
-		 * @param found Set to true if the stop byte is found, otherwise returns the data until limit reached
-		 * @return Pointer to vector with read data (NOT including stop byte!), empty if error occoured or EOF
+		 * Cheap liveness probe, does not block and does not consume data. Unread bytes at socket level
+		 * on an idle connection are considered a closing alert, so the connection is reported as not alive.
+		 * @return true if connected and the connection looks usable, false otherwise
+		*/
+		virtual bool IsAlive();
+
+		/**
+		 * @return always true, the socket carries TLS records
 		*/
-		virtual unique_ptr<vector<unsigned char>> ReadDataUntil(const unsigned char& stop, const size_t& limit, bool& found);
+		virtual bool IsEncrypted();
 
 		/**
-		 * Return number of available bytes that could be read
+		 * Return number of available bytes that could be read (includes the read-ahead buffer)
 		 * @return number of waiting bytes
 		*/
 		virtual size_t AvailableBytes();
 
+		/**
+		 * Return number of bytes already received (read-ahead buffer and decrypted bytes held by mbedtls), that could be read without waiting on the socket.
+		 * @return number of buffered bytes
+		*/
+		virtual size_t BufferedBytes();
+
+		/**
+		 * Return the size of the TLS record buffers (in + out) held by this client, the main part of each connection footprint.
+		 * Depends on the build configuration and, with variable buffer length, on the negotiated maximum fragment length.
+		 * @return size in bytes, 0 if the SSL context has not been set up yet
+		*/
+		virtual size_t GetTlsBuffersSize();
+
+		/**
+		 * Return the size of the TLS record buffers (in + out, with record header, IV and MAC overhead) allocated by each
+		 * connection with this build configuration, before any reduction negotiated with the maximum fragment length.
+		 * @return size in bytes
+		*/
+		static size_t GetMaxTlsBuffersSize();
+
 		/** Inherited from BriandESPHeapOptimize */
 		virtual void PrintObjectSizeInfo();
 		/** Inherited from BriandESPHeapOptimize */
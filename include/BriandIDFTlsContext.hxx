@@ -0,0 +1,272 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <array>
+#include <mutex>
+
+#include "BriandESPHeapOptimize.hxx"
+
+#if defined(ESP_PLATFORM)
+	#include <esp_system.h>
+#elif defined(__linux__)
+	#include "BriandEspLinuxPorting.hxx"
+#else
+    #error "UNSUPPORTED PLATFORM (ESP32 OR LINUX REQUIRED)"
+#endif
+
+// TLS/SSL with mbedtls
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_ciphersuites.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/error.h>
+
+using namespace std;
+
+namespace Briand {
+
+	/**
+	 * TLS configuration shared by many BriandIDFSocketTlsClient instances (use with make_shared).
+	 * Holds the seeded RNG, the parsed CA certificate chain and the mbedtls_ssl_config, so each client
+	 * keeps only its own mbedtls_ssl_context.
+	 * Configure it first, then attach it to clients: once a client uses it, it is locked and cannot be changed anymore.
+	 * Clients of different tasks could use it at the same time, the first use (lock) is serialized.
+	*/
+	class BriandIDFTlsContext : public BriandESPHeapOptimize {
+		private:
+
+		protected:
+
+		/** Error buffer size */
+		const unsigned char ERR_BUF_SIZE = 128;
+		/** Flag */
+		bool VERBOSE;
+		/** A random personalization string */
+		unsigned char personalization_string[16];
+		/** Mbedtls entropy */
+		mbedtls_entropy_context entropy;
+		/** Mbedtls RNG */
+		mbedtls_ctr_drbg_context ctr_drbg;
+		/** Serializes the RNG, used by handshakes of different tasks */
+		std::mutex rngMutex;
+		/** Serializes the lock on first use (GetConfig()) of clients of different tasks, and the CA chain release */
+		std::mutex configMutex;
+		/** Mbedtls SSL configuration */
+		mbedtls_ssl_config conf;
+		/** Mbedtls certificate chain */
+		mbedtls_x509_crt cacert;
+		/** Certificate profile (minimum RSA key size) */
+		mbedtls_x509_crt_profile certProfile;
+		/** Cipher suite/curve profile name */
+		string profile;
+		/** Maximum fragment length requested to the server (bytes, 0 for none) */
+		unsigned short maxFragmentLength;
+		/** Flag */
+		bool caChainLoaded;
+		/** Flag */
+		bool caChainFailed;
+		/** Flag, at least one certificate has been copied while parsing (chain cannot be parsed again once released) */
+		bool caChainCopied;
+		/** Flag, parsed chain released after use (see ReleaseCAChain()) */
+		bool caChainReleased;
+		/** DER buffers parsed without copy (static/flash), to parse the chain again after ReleaseCAChain() */
+		vector<pair<const unsigned char*, size_t>> noCopyCertificates;
+		/** Pinned public keys: SHA-256 of the server SubjectPublicKeyInfo (DER) */
+		vector<array<unsigned char, 32>> publicKeyPins;
+		/** Flag, RNG seeded and configuration defaults applied */
+		bool ready;
+		/** Flag, set when the first client uses the context */
+		bool locked;
+		/** SHA-256 of the trust configuration (verification mode, CA chain, pins, minimum RSA key size), set when locked */
+		array<unsigned char, 32> trustId;
+
+		/**
+		 * Computes trustId from the current configuration (CA chain parsed)
+		*/
+		virtual void ComputeTrustId();
+
+		/**
+		 * RNG callback for mbedtls, thread safe.
+		 * @param ctx the context (this)
+		*/
+		static int Random(void* ctx, unsigned char* output, size_t len);
+
+		/**
+		 * Certificate verification callback for mbedtls (mbedtls_ssl_conf_verify), checks the server public key against the pins.
+		 * Without a CA chain a pin match on the server certificate is enough (hostname, validity dates and the other checks still apply),
+		 * with a CA chain the pin is required in addition to the chain verification.
+		 * @param ctx the context (this)
+		 * @param crt certificate being verified
+		 * @param depth 0 for the server certificate
+		 * @param flags verification flags of the certificate, updated
+		*/
+		static int VerifyPins(void* ctx, mbedtls_x509_crt* crt, int depth, uint32_t* flags);
+
+		/**
+		 * Checks if the context could still be changed
+		 * @return true if not locked
+		*/
+		virtual bool CheckUnlocked();
+
+		public:
+
+		/** Constructor: seeds the RNG and applies the client configuration defaults */
+		BriandIDFTlsContext();
+
+		/** Destructor */
+		~BriandIDFTlsContext();
+
+		/**
+		 * Set output to console (true) or not.
+		 * @param verbose (true/false)
+		*/
+		virtual void SetVerbose(const bool& verbose);
+
+		/**
+		 * Set the minimum allowed RSA Key size (default 2048).
+		 * @param keySize Key size, in bits (default 2048)
+		 * @return true if set, false if locked
+		*/
+		virtual bool SetMinRsaKeySize(const unsigned short& keySize);
+
+		/**
+		 * Requests a maximum fragment length to the server (MFL extension, RFC 6066): records are limited in both directions.
+		 * With MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH (CONFIG_MBEDTLS_DYNAMIC_BUFFER on ESP) the in/out record buffers of each connection
+		 * are shrunk to the negotiated length after the handshake, otherwise their size is fixed at build time
+		 * (MBEDTLS_SSL_IN_CONTENT_LEN/MBEDTLS_SSL_OUT_CONTENT_LEN, see menuconfig). Servers could ignore the extension.
+		 * @param length 512, 1024, 2048, 4096 or 0 for none (default)
+		 * @return true if set, false if invalid length, not supported or locked
+		*/
+		virtual bool SetMaxFragmentLength(const unsigned short& length);
+
+		/** @return the requested maximum fragment length, in bytes (0 for none) */
+		virtual unsigned short GetMaxFragmentLength();
+
+		/**
+		 * Restricts the cipher suites and curves offered to the server, in preference order:
+		 * - "default": everything enabled in the mbedtls build (MBEDTLS_SSL_PRESET_DEFAULT)
+		 * - "low-latency-ecdhe-x25519": ECDHE over X25519 (then P-256) with AES-128-GCM or ChaCha20-Poly1305, fastest key exchange
+		 * - "hw-aes": ECDHE with AES-GCM (then AES-CBC), for the ESP32 AES accelerator or AES-NI on Linux
+		 * - "chacha20": ECDHE with ChaCha20-Poly1305 only, for targets without AES acceleration
+		 * Suites not built into mbedtls are skipped. The server must support at least one suite of the profile,
+		 * and its certificate key (if EC) must use one of the profile curves.
+		 * @param profile profile name
+		 * @return true if set, false if unknown, not available in this build or locked
+		*/
+		virtual bool SetProfile(const string& profile);
+
+		/** @return the cipher suite/curve profile name */
+		virtual string GetProfile();
+
+		/** @return names of the available cipher suite/curve profiles */
+		static vector<string> GetProfileNames();
+
+		/**
+		 * Method set the Server's PEM CA certificate. Can be multiple, one following the other.
+		 * @param pemCAcertificate The CA certificate chain. (First CA, then Server peer). PEM format including BEGIN/END tags
+		 * @return true if parsed, false if parse failed or locked
+		*/
+		virtual bool SetCACertificateChainPEM(const string& pemCAcertificate);
+
+		/**
+		 * Method set the Server's DER CA certificate. Chain could be built with multiple method callings.
+		 * @param derCAcertificate The CA certificate (ONLY ONE). (First CA, then Server peer). DER bytes.
+		 * @return true if parsed, false if parse failed or locked
+		*/
+		virtual bool AddCACertificateToChainDER(const vector<unsigned char>& derCAcertificate);
+
+		/**
+		 * Method adds a Server's DER CA certificate to the chain without copying it (mbedtls_x509_crt_parse_der_nocopy):
+		 * the parsed certificate points to the given bytes, that must stay valid and unchanged for the whole life of the context
+		 * (static or flash-resident data, for example a file embedded in the firmware).
+		 * @param derCAcertificate The CA certificate (ONLY ONE). DER bytes.
+		 * @param size size of the DER, in bytes
+		 * @return true if parsed, false if parse failed or locked
+		*/
+		virtual bool AddCACertificateToChainDERNoCopy(const unsigned char* derCAcertificate, const size_t& size);
+
+		/**
+		 * Frees the parsed CA chain, once no handshake is in progress with this context. The chain is parsed again
+		 * (from the same buffers) on the next GetConfig(), so only chains made with AddCACertificateToChainDERNoCopy() can be released.
+		 * @return true if released (or nothing to release), false if not in use or a certificate has been copied
+		*/
+		virtual bool ReleaseCAChain();
+
+		/**
+		 * Pins a server public key. Without CA certificates the server is accepted if its public key matches a pin,
+		 * no CA chain is needed (nor parsed); with CA certificates the pin is an additional check.
+		 * Pin could be obtained with: openssl x509 -in cert.pem -pubkey -noout | openssl pkey -pubin -outform der | openssl dgst -sha256 -binary
+		 * @param spkiSha256 SHA-256 of the SubjectPublicKeyInfo DER (32 bytes)
+		 * @return true if added, false if not 32 bytes or locked
+		*/
+		virtual bool AddPublicKeyPin(const vector<unsigned char>& spkiSha256);
+
+		/**
+		 * Pins a server public key, see AddPublicKeyPin().
+		 * @param spkiSha256Base64 SHA-256 of the SubjectPublicKeyInfo DER, base64 encoded (as HPKP "pin-sha256")
+		 * @return true if added, false if invalid or locked
+		*/
+		virtual bool AddPublicKeyPinBase64(const string& spkiSha256Base64);
+
+		/**
+		 * Copies the configuration of another context into this one (not locked): RSA key size, profile, maximum fragment length,
+		 * pins and, if requested, the CA chain (certificates added without copy keep pointing to the same bytes).
+		 * @param source the context to copy
+		 * @param withCAChain true to copy the CA chain too
+		 * @return true if everything has been copied, false if locked or something failed (a failed CA chain makes the context unusable)
+		*/
+		virtual bool CopyConfiguration(BriandIDFTlsContext& source, const bool& withCAChain);
+
+		/** @return true if the RNG is ready and the CA chain (if any) has been parsed */
+		virtual bool IsUsable();
+
+		/** @return true if a CA chain has been loaded but parsing failed */
+		virtual bool IsCAChainFailed();
+
+		/** @return true if peer certificates are verified (valid CA chain loaded or public keys pinned), false for INSECURE mode */
+		virtual bool IsVerifying();
+
+		/** @return true if the context is in use and cannot be changed */
+		virtual bool IsLocked();
+
+		/**
+		 * Identifies the trust configuration (verification mode, CA chain, pins, minimum RSA key size): contexts that trust
+		 * the same servers have the same id. A resumed session skips the certificate checks, so sessions are resumed only
+		 * with the id they were established with (see BriandIDFTlsSessionCache).
+		 * @return SHA-256 of the trust configuration, valid once the context is locked (see GetConfig())
+		*/
+		virtual const array<unsigned char, 32>& GetTrustId();
+
+		/**
+		 * Locks the context and returns the configuration, for mbedtls_ssl_setup(). A released CA chain is parsed again.
+		 * @return the configuration, nullptr if not usable
+		*/
+		virtual const mbedtls_ssl_config* GetConfig();
+
+		/** Inherited from BriandESPHeapOptimize */
+		virtual void PrintObjectSizeInfo();
+		/** Inherited from BriandESPHeapOptimize */
+		virtual size_t GetObjectSize();
+	};
+}
@@ -0,0 +1,166 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <list>
+#include <array>
+#include <mutex>
+
+#include "BriandESPHeapOptimize.hxx"
+
+#if defined(ESP_PLATFORM)
+	#include <esp_timer.h>
+#elif defined(__linux__)
+	#include "BriandEspLinuxPorting.hxx"
+#else
+    #error "UNSUPPORTED PLATFORM (ESP32 OR LINUX REQUIRED)"
+#endif
+
+// TLS/SSL with mbedtls
+#include <mbedtls/ssl.h>
+
+using namespace std;
+
+namespace Briand {
+
+	/**
+	 * Process-wide TLS session cache used by the TLS clients for session resumption (SINGLETON!).
+	 * Sessions (session ID and ticket, if the server sent one) are keyed by host:port and by the trust configuration of the
+	 * TLS context (BriandIDFTlsContext::GetTrustId()), saved after a successful handshake, then offered to the server on the
+	 * next connection to skip the asymmetric operations. A resumed session skips the certificate checks: it is offered only
+	 * to connections that trust the server the same way (same CA chain and pins) as the one that verified it.
+	 * The number of entries is bounded, least recently used entries are evicted first.
+	*/
+	class BriandIDFTlsSessionCache : public BriandESPHeapOptimize {
+		private:
+
+		static BriandIDFTlsSessionCache* Instance;
+
+		/**
+		 * PRIVATE CONSTRUCTOR (Singleton PATTERN!)
+		*/
+		BriandIDFTlsSessionCache();
+		~BriandIDFTlsSessionCache();
+
+		protected:
+
+		/** Cache entry */
+		typedef struct {
+			/** host:port (key) */
+			string key;
+			/** The saved session (owned) */
+			shared_ptr<mbedtls_ssl_session> session;
+			/** Trust configuration of the context that established the session (key) */
+			array<unsigned char, 32> trustId;
+			/** Expiry time (esp_timer_get_time() microseconds) */
+			uint64_t expiresAt;
+		} CacheEntry;
+
+		/** Flag */
+		bool VERBOSE;
+		/** Entries time to live, in seconds */
+		unsigned long TTL_S;
+		/** Maximum number of entries */
+		unsigned short MAX_ENTRIES;
+		/** Cache entries, most recently used first */
+		list<CacheEntry> entries;
+		/** Protects entries and statistics */
+		std::mutex cacheMutex;
+		/** Statistics: connections that offered a cached session */
+		unsigned long hits;
+		/** Statistics: connections with no cached session (full handshake) */
+		unsigned long misses;
+
+		/**
+		 * Builds the cache key
+		 * @param host hostname
+		 * @param port port
+		 * @return host:port
+		*/
+		static string MakeKey(const string& host, const short& port);
+
+		public:
+
+		/**
+		 * Return the instance (SINGLETON!)
+		*/
+		static BriandIDFTlsSessionCache* GetInstance();
+
+		/**
+		 * Set output to console (true) or not.
+		 * @param verbose (true/false)
+		*/
+		virtual void SetVerbose(const bool& verbose);
+
+		/**
+		 * Set entries time to live (default 3600 seconds). Servers could forget sessions earlier: resumption is then refused and a full handshake is done.
+		 * @param ttl_s time to live, in seconds. 0 disables caching.
+		*/
+		virtual void SetTTL(const unsigned long& ttl_s);
+
+		/**
+		 * Set the maximum number of cached sessions (default 8). Exceeding entries are evicted.
+		 * @param maxEntries maximum entries (at least 1)
+		*/
+		virtual void SetMaxEntries(const unsigned short& maxEntries);
+
+		/**
+		 * Offers the cached session for host:port to a SSL context, before the handshake. Updates hit/miss counters.
+		 * @param host hostname
+		 * @param port port
+		 * @param ssl the SSL context (after mbedtls_ssl_setup())
+		 * @param trustId trust configuration of the connection (BriandIDFTlsContext::GetTrustId()): only sessions established with the same one are offered
+		 * @return true if a session has been set, false otherwise
+		*/
+		virtual bool Load(const string& host, const short& port, mbedtls_ssl_context* ssl, const array<unsigned char, 32>& trustId);
+
+		/**
+		 * Saves the session of a SSL context, after a successful handshake.
+		 * @param host hostname
+		 * @param port port
+		 * @param ssl the SSL context
+		 * @param trustId trust configuration of the connection (BriandIDFTlsContext::GetTrustId())
+		 * @return true if saved, false otherwise
+		*/
+		virtual bool Save(const string& host, const short& port, const mbedtls_ssl_context* ssl, const array<unsigned char, 32>& trustId);
+
+		/**
+		 * Removes the sessions of host:port, for any trust configuration (for example after a failed handshake).
+		 * @param host hostname
+		 * @param port port
+		*/
+		virtual void Invalidate(const string& host, const short& port);
+
+		/**
+		 * Removes every entry
+		*/
+		virtual void Clear();
+
+		/** @return number of connections that offered a cached session */
+		virtual unsigned long GetHits();
+
+		/** @return number of connections with no cached session */
+		virtual unsigned long GetMisses();
+
+		/** Inherited from BriandESPHeapOptimize */
+		virtual void PrintObjectSizeInfo();
+		/** Inherited from BriandESPHeapOptimize */
+		virtual size_t GetObjectSize();
+	};
+}
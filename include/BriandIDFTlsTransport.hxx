@@ -0,0 +1,215 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Byte stream transports for BriandIDFSocketTlsClient: TLS could run over a raw descriptor,
+ * over another (connected) socket client, for example a tunnel through a proxy, or over an in-memory pipe.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "BriandESPHeapOptimize.hxx"
+#include "BriandIDFSocketClient.hxx"
+
+#if defined(ESP_PLATFORM)
+	#include <lwip/sockets.h>
+	#include <sys/poll.h>
+#elif defined(__linux__)
+	#include "BriandEspLinuxPorting.hxx"
+#else
+    #error "UNSUPPORTED PLATFORM (ESP32 OR LINUX REQUIRED)"
+#endif
+
+using namespace std;
+
+namespace Briand {
+
+	/**
+	 * Transport interface. Send() and Recv() must never block, Wait() does.
+	*/
+	class BriandIDFTlsTransport : public BriandESPHeapOptimize {
+		public:
+
+		/** Send()/Recv() result: nothing could be done now, Wait() and retry */
+		static const int WOULD_BLOCK = -2;
+
+		virtual ~BriandIDFTlsTransport() { }
+
+		/**
+		 * Sends bytes, without blocking
+		 * @param buffer data
+		 * @param size data size, in bytes
+		 * @return bytes sent (could be less than size), WOULD_BLOCK or -1 on error
+		*/
+		virtual int Send(const unsigned char* buffer, const size_t& size) = 0;
+
+		/**
+		 * Receives bytes, without blocking
+		 * @param buffer destination buffer
+		 * @param size buffer capacity, in bytes
+		 * @return bytes received, 0 if the peer closed, WOULD_BLOCK or -1 on error
+		*/
+		virtual int Recv(unsigned char* buffer, const size_t& size) = 0;
+
+		/**
+		 * Waits until the transport is ready
+		 * @param events POLLIN and/or POLLOUT
+		 * @param timeoutMs maximum wait, in milliseconds
+		 * @return 1 if ready, 0 on timeout, -1 on error
+		*/
+		virtual int Wait(const short& events, const unsigned long& timeoutMs) = 0;
+
+		/** @return true if the transport could still be used */
+		virtual bool IsOpen() = 0;
+
+		/** Closes the transport */
+		virtual void Close() = 0;
+
+		/** @return the underlying descriptor for poll()/event loops, -1 if none */
+		virtual int GetDescriptor() { return -1; }
+	};
+
+	/**
+	 * Transport over a raw descriptor (socket or any other stream descriptor)
+	*/
+	class BriandIDFTlsFdTransport : public BriandIDFTlsTransport {
+		protected:
+
+		/** The descriptor */
+		int fd;
+		/** Flag, close the descriptor with Close() */
+		bool owned;
+
+		public:
+
+		/**
+		 * Constructor. The descriptor flags are not changed: a socket is used with MSG_DONTWAIT, other descriptors (pipes)
+		 * are written at most PIPE_BUF bytes at a time, so Send() does not block even if the descriptor is blocking.
+		 * @param fd the descriptor (connected)
+		 * @param owned true to close the descriptor with Close() or on destruction
+		*/
+		BriandIDFTlsFdTransport(const int& fd, const bool& owned = true);
+		~BriandIDFTlsFdTransport();
+
+		virtual int Send(const unsigned char* buffer, const size_t& size);
+		virtual int Recv(unsigned char* buffer, const size_t& size);
+		virtual int Wait(const short& events, const unsigned long& timeoutMs);
+		virtual bool IsOpen();
+		virtual void Close();
+		virtual int GetDescriptor();
+
+		/** Inherited from BriandESPHeapOptimize */
+		virtual void PrintObjectSizeInfo();
+		/** Inherited from BriandESPHeapOptimize */
+		virtual size_t GetObjectSize();
+	};
+
+	/**
+	 * Transport over a connected BriandIDFSocketClient (for example a clear-text client after a proxy CONNECT)
+	*/
+	class BriandIDFTlsClientTransport : public BriandIDFTlsTransport {
+		protected:
+
+		/** The client */
+		unique_ptr<BriandIDFSocketClient> client;
+
+		public:
+
+		/**
+		 * Constructor, takes ownership of the client (will be nullptr after call). Only plain clients could be wrapped:
+		 * an encrypted client (IsEncrypted(), for example a TLS client) is disconnected and the transport is not open.
+		 * @param client the connected client
+		*/
+		BriandIDFTlsClientTransport(unique_ptr<BriandIDFSocketClient>& client);
+		~BriandIDFTlsClientTransport();
+
+		virtual int Send(const unsigned char* buffer, const size_t& size);
+		virtual int Recv(unsigned char* buffer, const size_t& size);
+		virtual int Wait(const short& events, const unsigned long& timeoutMs);
+		virtual bool IsOpen();
+		virtual void Close();
+		virtual int GetDescriptor();
+
+		/** Inherited from BriandESPHeapOptimize */
+		virtual void PrintObjectSizeInfo();
+		/** Inherited from BriandESPHeapOptimize */
+		virtual size_t GetObjectSize();
+	};
+
+	/**
+	 * One end of an in-memory duplex pipe (see CreatePipe()), thread safe.
+	 * Useful to run TLS without sockets, for tests and benchmarks.
+	*/
+	class BriandIDFTlsPipeTransport : public BriandIDFTlsTransport {
+		protected:
+
+		/** State shared by the two ends */
+		typedef struct {
+			/** Protects everything */
+			std::mutex pipeMutex;
+			/** Signaled on every change */
+			std::condition_variable changed;
+			/** Bytes travelling from end 0 to end 1 and from end 1 to end 0 */
+			vector<unsigned char> queue[2];
+			/** Read position of each queue */
+			size_t readPos[2];
+			/** Maximum bytes in each queue */
+			size_t capacity;
+			/** Flag, end closed */
+			bool closed[2];
+		} PipeState;
+
+		/** Shared state */
+		shared_ptr<PipeState> state;
+		/** This end (0 or 1) */
+		unsigned char side;
+
+		/**
+		 * Constructor, use CreatePipe()
+		 * @param state shared state
+		 * @param side this end
+		*/
+		BriandIDFTlsPipeTransport(const shared_ptr<PipeState>& state, const unsigned char& side);
+
+		public:
+
+		~BriandIDFTlsPipeTransport();
+
+		/**
+		 * Creates the two ends of a pipe: bytes sent by one are received by the other
+		 * @param first output: first end
+		 * @param second output: second end
+		 * @param capacity maximum bytes waiting in each direction (Send() returns WOULD_BLOCK when full)
+		*/
+		static void CreatePipe(unique_ptr<BriandIDFTlsTransport>& first, unique_ptr<BriandIDFTlsTransport>& second, const size_t& capacity = 16384);
+
+		virtual int Send(const unsigned char* buffer, const size_t& size);
+		virtual int Recv(unsigned char* buffer, const size_t& size);
+		virtual int Wait(const short& events, const unsigned long& timeoutMs);
+		virtual bool IsOpen();
+		virtual void Close();
+
+		/** Inherited from BriandESPHeapOptimize */
+		virtual void PrintObjectSizeInfo();
+		/** Inherited from BriandESPHeapOptimize */
+		virtual size_t GetObjectSize();
+	};
+}
@@ -17,12 +17,22 @@
 
 #include <iostream>
 #include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
 
 #include "BriandESPHeapOptimize.hxx"
 
 // Esp specific
 #if defined(ESP_PLATFORM)
     #include <esp_wifi.h>
+	#include <esp_netif.h>
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/task.h>
+	#include <freertos/event_groups.h>
 #elif defined(__linux__)
 	#include "BriandEspLinuxPorting.hxx"
 #else
@@ -33,6 +43,80 @@ using namespace std;
 
 namespace Briand
 {
+	/**
+	 * Station state change callback, called from the event task (must not block).
+	 * @param connected true when the station got IP, false when the connection is lost
+	*/
+	typedef function<void(const bool& connected)> BriandIDFWifiStateCallback;
+
+	/** Station outages statistics (only outages while connection is wanted: not after DisconnectStation()) */
+	typedef struct {
+		/** Completed outages */
+		unsigned long outages;
+		/** Automatic reconnection attempts */
+		unsigned long attempts;
+		/** Total duration of completed outages, microseconds */
+		uint64_t totalUs;
+		/** Longest completed outage, microseconds */
+		uint64_t longestUs;
+		/** Last completed outage, microseconds */
+		uint64_t lastUs;
+		/** Current outage duration, microseconds (0 if none) */
+		uint64_t currentUs;
+	} BriandIDFWifiOutageStats;
+
+	/** Scan result (compact) */
+	typedef struct {
+		/** Essid (null terminated, empty for hidden networks) */
+		char ssid[33];
+		/** AP MAC address */
+		uint8_t bssid[6];
+		/** Channel */
+		uint8_t channel;
+		/** Signal strength, dBm */
+		int8_t rssi;
+		/** Authentication mode (WIFI_AUTH_*) */
+		uint8_t authmode;
+	} BriandIDFWifiScanResult;
+
+	/**
+	 * Scan callback, called from the event task (must not block).
+	 * @param results scan results, strongest signal first (empty if the scan failed)
+	*/
+	typedef function<void(const vector<BriandIDFWifiScanResult>& results)> BriandIDFWifiScanCallback;
+
+	/** Credentials of a network, for ConnectStation() with many networks */
+	typedef struct {
+		/** Essid */
+		string essid;
+		/** Password */
+		string password;
+	} BriandIDFWifiCredentials;
+
+	/** Report of the last successful ConnectStation() */
+	typedef struct {
+		/** Path that connected (one of BriandIDFWifiManager::CONNECT_PATH_*) */
+		unsigned char path;
+		/** Flag, the fast path (cached network) was tried and failed */
+		bool fastPathFailed;
+		/** From ConnectStation() start to GOT_IP, microseconds */
+		uint64_t totalUs;
+		/** From esp_wifi_connect() to GOT_IP, for the path that connected, microseconds */
+		uint64_t connectUs;
+	} BriandIDFWifiConnectReport;
+
+	/** Round trip times measured while a power save profile was in effect (see BriandIDFWifiManager::AddRttSample()) */
+	typedef struct {
+		/** Number of samples */
+		unsigned long samples;
+		/** Sum of the samples, microseconds */
+		uint64_t totalUs;
+		/** Shortest sample, microseconds */
+		uint64_t minUs;
+		/** Longest sample, microseconds */
+		uint64_t maxUs;
+	} BriandIDFWifiRttStats;
+
 	/**
 	 * This class is a simplified management for ESP IDF wifi interfaces
 	*/
@@ -51,10 +135,115 @@ namespace Briand
 
 		bool VERBOSE;
 		bool INITIALIZED;
-		bool STA_IF_READY;
-		bool STA_CONNECTED;
 		bool AP_READY;
 
+		/** Event group bit: STA interface started */
+		static const EventBits_t STA_STARTED_BIT = (1 << 0);
+		/** Event group bit: STA got IP */
+		static const EventBits_t STA_GOT_IP_BIT = (1 << 1);
+		/** Event group bit: STA disconnected (connection lost or failed) */
+		static const EventBits_t STA_DISCONNECTED_BIT = (1 << 2);
+		/** Event group bit: reconnection needed (for the reconnect task) */
+		static const EventBits_t STA_RECONNECT_BIT = (1 << 3);
+		/** Event group bit: reconnect task must exit */
+		static const EventBits_t RECONNECT_STOP_BIT = (1 << 4);
+		/** Event group bit: scan done */
+		static const EventBits_t STA_SCAN_DONE_BIT = (1 << 5);
+		/** Maximum scan results kept (strongest) */
+		static const uint16_t MAX_SCAN_RESULTS = 32;
+		/** Maximum wait for the result of a reconnection attempt, before aborting it */
+		static const unsigned long RECONNECT_ATTEMPT_TIMEOUT_MS = 30000;
+
+		/** Station state (one of STA_STATE_*), written by the event handler */
+		std::atomic<unsigned char> staState;
+		/** Station events (STA_*_BIT), set by the event handler */
+		EventGroupHandle_t staEvents;
+
+		/** Registered event handlers */
+		esp_event_handler_instance_t staStartEvent;
+		esp_event_handler_instance_t staDisconnectedEvent;
+		esp_event_handler_instance_t staGotIpEvent;
+		esp_event_handler_instance_t staLostIpEvent;
+		esp_event_handler_instance_t staScanDoneEvent;
+
+		/** Flag, a scan is running */
+		std::atomic<bool> scanning;
+		/** Last scan results, strongest first (protected by eventMutex) */
+		vector<BriandIDFWifiScanResult> scanResults;
+		/** Last successful scan (esp_timer_get_time() microseconds), 0 if none */
+		uint64_t scanTime;
+		/** Scan results validity, in milliseconds */
+		unsigned long scanCacheMs;
+		/** Callbacks waiting for the running scan (protected by eventMutex) */
+		vector<BriandIDFWifiScanCallback> scanCallbacks;
+
+		/** Flag, reconnect automatically when the connection is lost */
+		std::atomic<bool> AUTO_RECONNECT;
+		/** Flag, a connection is wanted (set by a successful ConnectStation(), reset by DisconnectStation()/StopWIFI()) */
+		std::atomic<bool> staWanted;
+		/** Reconnect task is running */
+		std::atomic<bool> reconnectTaskRunning;
+		/** Consecutive failed reconnection attempts (backoff exponent) */
+		std::atomic<unsigned long> reconnectAttempt;
+		/** Backoff first delay, in milliseconds */
+		unsigned long reconnectMinDelayMs;
+		/** Backoff maximum delay, in milliseconds */
+		unsigned long reconnectMaxDelayMs;
+
+		/** Protects callbacks and statistics */
+		std::mutex eventMutex;
+		/** State change callbacks by id */
+		map<int, BriandIDFWifiStateCallback> stateCallbacks;
+		/** Next callback id */
+		int nextCallbackId;
+		/** Outages statistics */
+		BriandIDFWifiOutageStats outageStats;
+		/** Current outage start (esp_timer_get_time() microseconds), 0 if none */
+		uint64_t outageStart;
+
+		/** Number of power save profiles (see GetPowerProfileNames()) */
+		static const unsigned char POWER_PROFILES = 3;
+
+		/** Power save profile (index in GetPowerProfileNames()) */
+		std::atomic<unsigned char> powerProfile;
+		/** Flag, traffic burst in progress: power save is off until burstHoldMs without traffic */
+		std::atomic<bool> powerBurst;
+		/** Last traffic notified (esp_timer_get_time() microseconds) */
+		std::atomic<uint64_t> lastTrafficTime;
+		/** Time without traffic that ends a burst, in milliseconds */
+		std::atomic<unsigned long> burstHoldMs;
+		/** Protects the power save mode and the RTT statistics */
+		std::mutex powerMutex;
+		/** RTT statistics, by power save profile */
+		BriandIDFWifiRttStats rttStats[POWER_PROFILES];
+
+		/** Last successful connection, saved in NVS (a file on Linux) */
+		typedef struct {
+			/** Format version */
+			uint8_t version;
+			/** Essid (null terminated) */
+			uint8_t ssid[33];
+			/** AP MAC address */
+			uint8_t bssid[6];
+			/** AP channel */
+			uint8_t channel;
+			/** Last IP lease */
+			esp_netif_ip_info_t lease;
+			/** Last DNS server */
+			esp_netif_dns_info_t dns;
+		} StaCache;
+
+		/** Flag, try the cached network first (fast path) */
+		bool FAST_RECONNECT;
+		/** Flag, on the fast path reuse the last IP lease as static configuration (no DHCP) */
+		bool REUSE_LEASE;
+		/** Fast path maximum time, then full path */
+		unsigned long fastPathTimeoutMs;
+		/** The DHCP client was stopped to apply the cached lease */
+		bool staticLeaseApplied;
+		/** Last connection report */
+		BriandIDFWifiConnectReport lastConnectReport;
+
 		/** The returned initialized STA interface */
 		esp_netif_obj* interfaceSTA;
 		/** The returned initialized AP interface */
@@ -69,6 +258,42 @@ namespace Briand
 		*/
 		static void WiFiEventHandler(void* evtArg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 
+		/**
+		 * Reconnect task: waits for STA_RECONNECT_BIT, then reconnects after the backoff delay
+		 * @param arg the BriandIDFWifiManager instance
+		*/
+		static void ReconnectTask(void* arg);
+
+		/**
+		 * Power burst task: restores the profile power save mode after burstHoldMs without traffic
+		 * @param arg the BriandIDFWifiManager instance
+		*/
+		static void PowerBurstTask(void* arg);
+
+		/**
+		 * Returns the profile whose power save mode is in effect: latency during bursts and with the AP active (AP must not sleep)
+		 * @return index in GetPowerProfileNames()
+		*/
+		unsigned char GetEffectivePowerProfile();
+
+		/**
+		 * Sets the power save mode in effect (see GetEffectivePowerProfile()), call with powerMutex locked
+		*/
+		void ApplyPowerSave();
+
+		/**
+		 * Updates outages statistics and calls the state callbacks, on up/down transitions
+		 * @param connected true if connected, false if connection lost
+		*/
+		void NotifyStateChange(const bool& connected);
+
+		/**
+		 * Backoff delay: exponential, with random jitter (half of the delay) so devices do not retry all together
+		 * @param attempt consecutive failed attempts
+		 * @return delay in milliseconds
+		*/
+		unsigned long GetReconnectDelay(const unsigned long& attempt);
+
 		/**
 		 * Set a random MAC address. MUST be called after esp_wifi_init and before any connection
 		 * @param if the interface (WIFI_IF_STA or WIFI_IF_AP)
@@ -86,8 +311,90 @@ namespace Briand
 		*/
 		void InitInterfaces();
 
+		/**
+		 * Waits for any of the given station event bits, bits are not cleared
+		 * @param bits STA_*_BIT to wait for
+		 * @param deadline esp_timer_get_time() value when the wait ends
+		 * @return the event group bits when the wait ended
+		*/
+		EventBits_t WaitBits(const EventBits_t& bits, const uint64_t& deadline);
+
+		/**
+		 * Prepares the station: wifi mode, MAC, interface start and hostname
+		 * @param ovverrideHostname hostname, empty for default
+		 * @param changeMacToRandom true to change MAC to a random one
+		 * @param deadline esp_timer_get_time() value when the wait for interface start ends
+		 * @return true if success
+		*/
+		bool StartStation(const string& ovverrideHostname, const bool& changeMacToRandom, const uint64_t& deadline);
+
+		/**
+		 * Connects the started station to a network: fast path (given AP or cached network) then, if no AP is given, full path
+		 * @param essid the essid
+		 * @param password the password
+		 * @param target the AP to connect to (from a scan), NULL to use the cached network
+		 * @param startTime ConnectStation() start (for the report)
+		 * @param deadline esp_timer_get_time() value when the connection times out
+		 * @return true if connected
+		*/
+		bool ConnectNetwork(const string& essid, const string& password, const BriandIDFWifiScanResult* target, const uint64_t& startTime, const uint64_t& deadline);
+
+		/**
+		 * Collects, sorts and caches the scan results, then calls the scan callbacks (WIFI_EVENT_SCAN_DONE)
+		 * @param failed true if the scan failed
+		*/
+		void OnScanDone(const bool& failed);
+
+		/**
+		 * Calls esp_wifi_connect() and waits for GOT_IP or DISCONNECTED
+		 * @param deadline esp_timer_get_time() value when the wait ends
+		 * @return the event group bits when the wait ended, 0 if esp_wifi_connect() fails
+		*/
+		EventBits_t StartConnection(const uint64_t& deadline);
+
+		/**
+		 * Removes the cached network (bssid/channel) from the STA configuration and restores DHCP if the cached lease was applied
+		*/
+		void ClearCachedNetwork();
+
+		/**
+		 * Reads the last network from NVS
+		 * @param cache output
+		 * @return true if found (and valid)
+		*/
+		bool LoadStaCache(StaCache& cache);
+
+		/**
+		 * Saves the current network to NVS (only if changed)
+		 * @param essid the essid
+		 * @param previous the cached network used to connect, NULL if none
+		*/
+		void SaveStaCache(const string& essid, const StaCache* previous);
+
 		public:
 
+		/** Station state: not started */
+		static const unsigned char STA_STATE_IDLE = 0;
+		/** Station state: interface started, not connected */
+		static const unsigned char STA_STATE_STARTED = 1;
+		/** Station state: connecting (association and DHCP) */
+		static const unsigned char STA_STATE_CONNECTING = 2;
+		/** Station state: connected, got IP */
+		static const unsigned char STA_STATE_CONNECTED = 3;
+		/** Station state: disconnected (connection lost or failed) */
+		static const unsigned char STA_STATE_DISCONNECTED = 4;
+
+		/** Connection path: not connected */
+		static const unsigned char CONNECT_PATH_NONE = 0;
+		/** Connection path: all-channel scan and DHCP */
+		static const unsigned char CONNECT_PATH_FULL = 1;
+		/** Connection path: cached BSSID and channel, DHCP */
+		static const unsigned char CONNECT_PATH_CACHED = 2;
+		/** Connection path: cached BSSID and channel, cached IP lease */
+		static const unsigned char CONNECT_PATH_CACHED_LEASE = 3;
+		/** Connection path: BSSID and channel from a scan, DHCP */
+		static const unsigned char CONNECT_PATH_SCAN = 4;
+
 		/**
 		 * Return the instance (SINGLETON!)
 		*/
@@ -123,11 +430,124 @@ namespace Briand
 		*/
 		bool ConnectStation(const string& essid, const string& password, const int& timeoutSeconds, const string& ovverrideHostname = "", const bool& changeMacToRandom = true);
 
+		/**
+		 * Connects to the best available network in STA mode, using DHCP. Networks are tried in priority order,
+		 * each one with its APs found by a scan (strongest first), then networks not found (hidden) the usual way.
+		 * @param networks the networks, by priority (first is preferred)
+		 * @param timeoutSeconds connection timeout (everything included)
+		 * @param ovverrideHostname populate to change the hostname (max 32 chars), empty for default.
+		 * @param changeMacToRandom set to true to change MAC to a random one
+		 * @return true if success, false if fails or timeout
+		*/
+		bool ConnectStation(const vector<BriandIDFWifiCredentials>& networks, const int& timeoutSeconds, const string& ovverrideHostname = "", const bool& changeMacToRandom = true);
+
 		/**
 		 * Method disconnects station
 		*/
 		void DisconnectStation();
 
+		/**
+		 * Starts a scan, without blocking. If the cached results are still valid the callback is called at once (from this task).
+		 * Do not scan while connecting.
+		 * @param callback called with the results (from the event task), could be nullptr
+		 * @return true if started (or cached results used), false on error
+		*/
+		bool StartScan(const BriandIDFWifiScanCallback& callback = nullptr);
+
+		/**
+		 * Scans and waits for the results (cached results are used if still valid, fresh ones are returned even with cache time 0)
+		 * @param results output: the results, strongest first
+		 * @param timeoutMs maximum wait, in milliseconds
+		 * @return true if success
+		*/
+		bool Scan(vector<BriandIDFWifiScanResult>& results, const unsigned long& timeoutMs);
+
+		/**
+		 * Method returns the cached scan results
+		 * @param results output: the results, strongest first
+		 * @return false if there are no valid results
+		*/
+		bool GetScanResults(vector<BriandIDFWifiScanResult>& results);
+
+		/**
+		 * Sets how long scan results are kept
+		 * @param cacheMs validity, in milliseconds (0 to scan always)
+		*/
+		void SetScanCacheTime(const unsigned long& cacheMs);
+
+		/**
+		 * Method returns if a scan is running
+		 * @return true if scanning
+		*/
+		bool IsScanning();
+
+		/**
+		 * Blocks until the station is connected (got IP) or disconnected, without polling.
+		 * With automatic reconnection (see SetAutoReconnect()) only the timeout ends the wait.
+		 * @param timeoutMs maximum wait, in milliseconds
+		 * @return true if connected, false if disconnected or timeout
+		*/
+		bool WaitForConnection(const unsigned long& timeoutMs);
+
+		/**
+		 * Method returns the station state
+		 * @return one of STA_STATE_*
+		*/
+		unsigned char GetStaState();
+
+		/**
+		 * Enables/disables automatic reconnection (with exponential backoff and jitter) when a connection made with ConnectStation() is lost
+		 * @param enabled true to enable
+		 * @param minDelayMs first reconnection delay, in milliseconds
+		 * @param maxDelayMs maximum reconnection delay, in milliseconds
+		 * @return false if the reconnect task could not be started
+		*/
+		bool SetAutoReconnect(const bool& enabled, const unsigned long& minDelayMs = 1000, const unsigned long& maxDelayMs = 60000);
+
+		/**
+		 * Sets the fast path of ConnectStation(): the last network (BSSID and channel) of the same essid is tried first,
+		 * falling back to a full scan. Enabled by default, the last network is saved in NVS (a file on Linux).
+		 * @param enabled true to enable
+		 * @param reuseLease true to reuse also the last IP lease as static configuration (no DHCP). Only for networks with stable leases!
+		 * @param fastPathTimeoutMs maximum time for the fast path, in milliseconds
+		*/
+		void SetFastReconnect(const bool& enabled, const bool& reuseLease = false, const unsigned long& fastPathTimeoutMs = 5000);
+
+		/**
+		 * Removes the last network from NVS
+		*/
+		void ClearConnectionCache();
+
+		/**
+		 * Method returns the report of the last ConnectStation() (path and timings, path is CONNECT_PATH_NONE if failed)
+		 * @return the report
+		*/
+		BriandIDFWifiConnectReport GetLastConnectReport();
+
+		/**
+		 * Adds a station state change callback (called from the event task, must not block)
+		 * @param callback the callback
+		 * @return callback id
+		*/
+		int AddStateCallback(const BriandIDFWifiStateCallback& callback);
+
+		/**
+		 * Removes a state change callback
+		 * @param id callback id
+		*/
+		void RemoveStateCallback(const int& id);
+
+		/**
+		 * Method returns outages statistics
+		 * @return statistics (currentUs is computed now)
+		*/
+		BriandIDFWifiOutageStats GetOutageStats();
+
+		/**
+		 * Method resets outages statistics
+		*/
+		void ResetOutageStats();
+
 		/**
 		 * Method starts AP interface with DHCP enabled
 		 * @param essid the essid
@@ -207,6 +627,65 @@ namespace Briand
 		*/
 		void SetStaIPv4DHCPClient(const bool& enabled);
 
+		/**
+		 * Method sets the power save profile: "latency" (no power save, default), "balanced" (modem sleep, wakes up every DTIM),
+		 * "battery" (modem sleep, wakes up every 10 beacons). The power save mode changes at once, the listen interval
+		 * from the next connection. With the AP active power save is always off.
+		 * @param profile the profile name (see GetPowerProfileNames())
+		 * @return false if the profile does not exist
+		*/
+		bool SetPowerProfile(const string& profile);
+
+		/**
+		 * Method returns the current power save profile
+		 * @return the profile name
+		*/
+		string GetPowerProfile();
+
+		/**
+		 * Method returns the power save profiles names
+		 * @return names, from the lowest latency to the lowest power
+		*/
+		static vector<string> GetPowerProfileNames();
+
+		/**
+		 * Sets how long power save stays off after the last traffic of a burst (see NotifyTraffic())
+		 * @param holdMs time without traffic, in milliseconds
+		*/
+		void SetBurstHoldTime(const unsigned long& holdMs);
+
+		/**
+		 * Notifies socket traffic: power save is turned off until the traffic stops for the burst hold time (default 500 ms),
+		 * then the profile power save mode is restored. Called by the socket clients (see BriandIDFSocketClient::SetPowerBurst()).
+		*/
+		void NotifyTraffic();
+
+		/**
+		 * Adds a round trip time sample to the statistics of the profile in effect (bursts count as latency).
+		 * Called by the socket clients (see BriandIDFSocketClient::SetRttReport()).
+		 * @param rttUs round trip time, microseconds
+		*/
+		void AddRttSample(const uint64_t& rttUs);
+
+		/**
+		 * Method returns the round trip times measured with a profile
+		 * @param profile the profile name
+		 * @return statistics (all zero if none or profile not found)
+		*/
+		BriandIDFWifiRttStats GetRttStats(const string& profile);
+
+		/**
+		 * Method returns the RTT penalty of a profile: its average RTT less the "latency" profile average RTT
+		 * @param profile the profile name
+		 * @return penalty in microseconds (could be negative), 0 if any of the two has no samples
+		*/
+		int64_t GetRttPenaltyUs(const string& profile);
+
+		/**
+		 * Method resets the RTT statistics of all profiles
+		*/
+		void ResetRttStats();
+
 		/** Inherited from BriandESPHeapOptimize */
 		virtual void PrintObjectSizeInfo();
 		/** Inherited from BriandESPHeapOptimize */
@@ -106,6 +106,11 @@
 
 	size_t heap_caps_get_largest_free_block(uint32_t caps) { return 0; }
 
+	void* heap_caps_malloc(size_t size, uint32_t caps) { return malloc(size); }
+	void* heap_caps_calloc(size_t n, size_t size, uint32_t caps) { return calloc(n, size); }
+	void* heap_caps_realloc(void* ptr, size_t size, uint32_t caps) { return realloc(ptr, size); }
+	void heap_caps_free(void* ptr) { free(ptr); }
+
 	wifi_mode_t BRIAND_CURRENT_WIFIMODE = WIFI_MODE_NULL;
 	const char* BRIAND_HOST = "localhost";
 
@@ -136,29 +141,178 @@
 	}
 
 	esp_err_t esp_netif_set_hostname(esp_netif_t *esp_netif, const char *hostname) { return ESP_OK; }
-	esp_err_t esp_wifi_start() { return ESP_OK; }
+
+	vector<wifi_ap_record_t> BRIAND_SIMULATED_APS = {
+		{ { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 }, "", 6, -50, WIFI_AUTH_WPA2_PSK },
+		{ { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 }, "BriandNet", 1, -67, WIFI_AUTH_WPA2_PSK },
+		{ { 0x02, 0x00, 0x00, 0x00, 0x00, 0x03 }, "BriandNet", 11, -45, WIFI_AUTH_WPA2_PSK },
+		{ { 0x02, 0x00, 0x00, 0x00, 0x00, 0x04 }, "BriandGuest", 6, -80, WIFI_AUTH_OPEN }
+	};
+	wifi_config_t BRIAND_CURRENT_STA_CONFIG;
+	/** Index of the connected simulated AP, -1 if none */
+	int BRIAND_CONNECTED_AP = -1;
+	/** Last scan results */
+	vector<wifi_ap_record_t> BRIAND_SCAN_RESULTS;
+
+	esp_err_t esp_wifi_start() { 
+		// Station interface start (the event is thrown by the ESP also if the STA was already started)
+		if (BRIAND_CURRENT_WIFIMODE == WIFI_MODE_STA || BRIAND_CURRENT_WIFIMODE == WIFI_MODE_APSTA)
+			esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0, 0);
+		return ESP_OK; 
+	}
 	esp_err_t esp_wifi_stop() { return ESP_OK; }
-	esp_err_t esp_wifi_connect() { return ESP_OK; }
-	esp_err_t esp_wifi_disconnect() { return ESP_OK; }
-	esp_err_t esp_wifi_set_ps(wifi_ps_type_t type) { return ESP_OK; }
+	esp_err_t esp_wifi_connect() { 
+		// Strongest AP with the configured ssid (and bssid), hidden networks last
+		const char* ssid = reinterpret_cast<const char*>(BRIAND_CURRENT_STA_CONFIG.sta.ssid);
+		int found = -1;
+		for (size_t i = 0; i < BRIAND_SIMULATED_APS.size(); i++) {
+			const wifi_ap_record_t& ap = BRIAND_SIMULATED_APS[i];
+			bool hidden = (ap.ssid[0] == 0);
+			if (!hidden && strncmp(reinterpret_cast<const char*>(ap.ssid), ssid, 32) != 0) continue;
+			if (BRIAND_CURRENT_STA_CONFIG.sta.bssid_set && memcmp(BRIAND_CURRENT_STA_CONFIG.sta.bssid, ap.bssid, 6) != 0) continue;
+			if (found < 0 || (BRIAND_SIMULATED_APS[found].ssid[0] == 0 && !hidden) || 
+				((BRIAND_SIMULATED_APS[found].ssid[0] == 0) == hidden && ap.rssi > BRIAND_SIMULATED_APS[found].rssi)) found = static_cast<int>(i);
+		}
+
+		if (found < 0) {
+			BRIAND_CONNECTED_AP = -1;
+			esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, NULL, 0, 0);
+			return ESP_OK;
+		}
+
+		BRIAND_CONNECTED_AP = found;
+
+		// DHCP always succeeds (with DHCP client stopped the static configuration is kept)
+		if (BRIAND_CURRENT_DHCPC_STATUS != ESP_NETIF_DHCP_STOPPED) {
+			BRIAND_CURRENT_IP.ip = inet_addr("192.168.1.100");
+			BRIAND_CURRENT_IP.netmask = inet_addr("255.255.255.0");
+			BRIAND_CURRENT_IP.gw = inet_addr("192.168.1.1");
+			BRIAND_CURRENT_DNS.ip.u_addr.ip4.addr = inet_addr("192.168.1.1");
+		}
+
+		esp_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, NULL, 0, 0);
+		return ESP_OK; 
+	}
+	esp_err_t esp_wifi_disconnect() { 
+		BRIAND_CONNECTED_AP = -1;
+		esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, NULL, 0, 0);
+		return ESP_OK; 
+	}
+	wifi_ps_type_t BRIAND_CURRENT_PS = WIFI_PS_MIN_MODEM;
+	esp_err_t esp_wifi_set_ps(wifi_ps_type_t type) { 
+		BRIAND_CURRENT_PS = type;
+		return ESP_OK; 
+	}
+	esp_err_t esp_wifi_get_ps(wifi_ps_type_t *type) {
+		if (type == NULL) return ESP_ERR_INVALID_ARG;
+		*type = BRIAND_CURRENT_PS;
+		return ESP_OK;
+	}
 
-	// should throw expected events.....
+	/** A registered event handler */
+	typedef struct {
+		string base;
+		int32_t id;
+		esp_event_handler_t handler;
+		void* arg;
+	} BriandIDFPortingEventHandler;
+
+	esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+	esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+	std::mutex BRIAND_EVENT_HANDLERS_MUTEX;
+	vector<unique_ptr<BriandIDFPortingEventHandler>> BRIAND_EVENT_HANDLERS;
 
 	esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler, void *event_handler_arg, esp_event_handler_instance_t *instance) { 
+		if (event_base == NULL || event_handler == NULL) return ESP_FAIL;
+
+		auto entry = make_unique<BriandIDFPortingEventHandler>();
+		entry->base = string(event_base);
+		entry->id = event_id;
+		entry->handler = event_handler;
+		entry->arg = event_handler_arg;
+
+		// The instance is the entry address
+		if (instance != NULL) *instance = entry.get();
+
+		std::lock_guard<std::mutex> lock(BRIAND_EVENT_HANDLERS_MUTEX);
+		BRIAND_EVENT_HANDLERS.push_back(std::move(entry));
+
 		return ESP_OK;
 	}
 
 	esp_err_t esp_event_handler_instance_unregister(esp_event_base_t event_base, int32_t event_id, esp_event_handler_instance_t instance) {
+		std::lock_guard<std::mutex> lock(BRIAND_EVENT_HANDLERS_MUTEX);
+		for (auto it = BRIAND_EVENT_HANDLERS.begin(); it != BRIAND_EVENT_HANDLERS.end(); it++) {
+			if (it->get() == instance) {
+				BRIAND_EVENT_HANDLERS.erase(it);
+				return ESP_OK;
+			}
+		}
+
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void *event_data, size_t event_data_size, TickType_t ticks_to_wait) {
+		if (event_base == NULL) return ESP_FAIL;
+
+		// Copy the matching handlers, so they could (un)register handlers or post events
+		vector<BriandIDFPortingEventHandler> matching;
+		{
+			std::lock_guard<std::mutex> lock(BRIAND_EVENT_HANDLERS_MUTEX);
+			for (auto& entry : BRIAND_EVENT_HANDLERS) {
+				if (entry->id == event_id && entry->base.compare(event_base) == 0) matching.push_back(*entry);
+			}
+		}
+
+		for (auto& entry : matching) {
+			entry.handler(entry.arg, event_base, event_id, const_cast<void*>(event_data));
+		}
+
 		return ESP_OK;
 	}
 
+
 	esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf) {
+		if (interface == WIFI_IF_STA && conf != NULL) memcpy(&BRIAND_CURRENT_STA_CONFIG, conf, sizeof(wifi_config_t));
+		return ESP_OK;
+	}
+
+	esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info) {
+		if (BRIAND_CONNECTED_AP < 0 || static_cast<size_t>(BRIAND_CONNECTED_AP) >= BRIAND_SIMULATED_APS.size()) return ESP_ERR_WIFI_NOT_CONNECT;
+
+		// The connected AP, with the configured ssid (hidden networks)
+		memcpy(ap_info, &BRIAND_SIMULATED_APS[BRIAND_CONNECTED_AP], sizeof(wifi_ap_record_t));
+		memcpy(ap_info->ssid, BRIAND_CURRENT_STA_CONFIG.sta.ssid, sizeof(BRIAND_CURRENT_STA_CONFIG.sta.ssid));
+		ap_info->ssid[32] = 0;
+		return ESP_OK;
+	}
+
+	esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *config, bool block) {
+		// Hidden networks are returned with empty ssid, like the ESP with show_hidden
+		BRIAND_SCAN_RESULTS = BRIAND_SIMULATED_APS;
+		esp_event_post(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, NULL, 0, 0);
+		return ESP_OK;
+	}
+
+	esp_err_t esp_wifi_scan_get_ap_num(uint16_t *number) {
+		*number = static_cast<uint16_t>(BRIAND_SCAN_RESULTS.size());
+		return ESP_OK;
+	}
+
+	esp_err_t esp_wifi_scan_get_ap_records(uint16_t *number, wifi_ap_record_t *ap_records) {
+		// Like the ESP, results are freed after the call
+		if (*number > BRIAND_SCAN_RESULTS.size()) *number = static_cast<uint16_t>(BRIAND_SCAN_RESULTS.size());
+		for (uint16_t i = 0; i < *number; i++) ap_records[i] = BRIAND_SCAN_RESULTS[i];
+		BRIAND_SCAN_RESULTS.clear();
 		return ESP_OK;
 	}
 
 	esp_netif_dhcp_status_t BRIAND_CURRENT_DHCPC_STATUS = ESP_NETIF_DHCP_STARTED;
 	esp_netif_dhcp_status_t BRIAND_CURRENT_DHCPS_STATUS = ESP_NETIF_DHCP_STARTED;
 	esp_netif_ip_info_t BRIAND_CURRENT_IP;
+	esp_netif_ip_info_t BRIAND_CURRENT_AP_IP = { inet_addr("192.168.4.1"), inet_addr("255.255.255.0"), inet_addr("192.168.4.1") };
+	esp_netif_dns_info_t BRIAND_CURRENT_DNS;
 
 	esp_err_t esp_netif_dhcpc_get_status(esp_netif_t *esp_netif, esp_netif_dhcp_status_t *status) {
 		*status = BRIAND_CURRENT_DHCPC_STATUS;
@@ -191,14 +345,34 @@
 	}
 
 	esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info) {
+		*ip_info = (esp_netif == &BRIAND_AP ? BRIAND_CURRENT_AP_IP : BRIAND_CURRENT_IP);
 		return ESP_OK;
 	}
 
-	esp_err_t esp_netif_set_ip_info(esp_netif_t *esp_netif, const esp_netif_ip_info_t *ip_info) { return ESP_OK; }
+	esp_err_t esp_netif_set_ip_info(esp_netif_t *esp_netif, const esp_netif_ip_info_t *ip_info) { 
+		if (esp_netif == &BRIAND_AP) BRIAND_CURRENT_AP_IP = *ip_info;
+		else BRIAND_CURRENT_IP = *ip_info;
+		return ESP_OK; 
+	}
+
+	esp_err_t esp_netif_get_dns_info(esp_netif_t *esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t *dns) {
+		*dns = BRIAND_CURRENT_DNS;
+		return ESP_OK;
+	}
 
-	void esp_netif_set_ip4_addr(esp_ip4_addr_t *addr, uint8_t a, uint8_t b, uint8_t c, uint8_t d) { /* do nothing */ }
+	esp_err_t esp_netif_set_dns_info(esp_netif_t *esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t *dns) {
+		if (type == ESP_NETIF_DNS_MAIN) BRIAND_CURRENT_DNS = *dns;
+		return ESP_OK;
+	}
 
-	char *esp_ip4addr_ntoa(const esp_ip4_addr_t *addr, char *buf, int buflen) { if (buflen < 9) return NULL; strcpy(buf, "0.0.0.0"); return buf; }
+	void esp_netif_set_ip4_addr(esp_ip4_addr_t *addr, uint8_t a, uint8_t b, uint8_t c, uint8_t d) { 
+		// Network byte order, like the ESP
+		*addr = htonl( (static_cast<uint32_t>(a) << 24) | (static_cast<uint32_t>(b) << 16) | (static_cast<uint32_t>(c) << 8) | d );
+	}
+
+	char *esp_ip4addr_ntoa(const esp_ip4_addr_t *addr, char *buf, int buflen) { 
+		return (inet_ntop(AF_INET, addr, buf, buflen) != NULL ? buf : NULL); 
+	}
 
 	BriandIDFPortingTaskHandle::BriandIDFPortingTaskHandle(const std::thread::native_handle_type& h, const char* name, const std::thread::id& tid) {
 		this->handle = h;
@@ -249,7 +423,7 @@
 
 		t.detach(); // this will create daemon-like threads
 
-		return static_cast<BaseType_t>(BRIAND_TASK_POOL->size()-1); // task index
+		return pdPASS;
 	}
 
 	void vTaskDelete(TaskHandle_t handle) {
@@ -297,8 +471,178 @@
 		return max;
 	}
 
+	BriandIDFPortingEventGroup::BriandIDFPortingEventGroup() {
+		this->bits = 0;
+	}
+
+	EventGroupHandle_t xEventGroupCreate() {
+		return new BriandIDFPortingEventGroup();
+	}
+
+	void vEventGroupDelete(EventGroupHandle_t xEventGroup) {
+		if (xEventGroup != NULL) delete xEventGroup;
+	}
+
+	EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToSet) {
+		EventBits_t current;
+		{
+			std::lock_guard<std::mutex> lock(xEventGroup->groupMutex);
+			xEventGroup->bits |= uxBitsToSet;
+			current = xEventGroup->bits;
+		}
+		xEventGroup->changed.notify_all();
+		return current;
+	}
+
+	EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToClear) {
+		// Like FreeRTOS, returns the bits BEFORE clearing
+		std::lock_guard<std::mutex> lock(xEventGroup->groupMutex);
+		EventBits_t previous = xEventGroup->bits;
+		xEventGroup->bits &= ~uxBitsToClear;
+		return previous;
+	}
+
+	EventBits_t xEventGroupGetBits(EventGroupHandle_t xEventGroup) {
+		std::lock_guard<std::mutex> lock(xEventGroup->groupMutex);
+		return xEventGroup->bits;
+	}
+
+	EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToWaitFor, const BaseType_t xClearOnExit, const BaseType_t xWaitForAllBits, TickType_t xTicksToWait) {
+		std::unique_lock<std::mutex> lock(xEventGroup->groupMutex);
+
+		auto satisfied = [&xEventGroup, &uxBitsToWaitFor, &xWaitForAllBits]() {
+			if (xWaitForAllBits) return (xEventGroup->bits & uxBitsToWaitFor) == uxBitsToWaitFor;
+			return (xEventGroup->bits & uxBitsToWaitFor) != 0;
+		};
+
+		bool ok;
+		if (xTicksToWait == portMAX_DELAY) {
+			xEventGroup->changed.wait(lock, satisfied);
+			ok = true;
+		}
+		else {
+			ok = xEventGroup->changed.wait_for(lock, std::chrono::milliseconds(xTicksToWait*portTICK_PERIOD_MS), satisfied);
+		}
+
+		// Like FreeRTOS, returns the bits at the time the wait ended (before clearing)
+		EventBits_t current = xEventGroup->bits;
+		if (ok && xClearOnExit) xEventGroup->bits &= ~uxBitsToWaitFor;
+
+		return current;
+	}
+
 	esp_err_t nvs_flash_init(void) { return ESP_OK; }
-	esp_err_t nvs_flash_erase(void) { return ESP_OK; }
+	esp_err_t nvs_flash_erase(void) { remove(BRIAND_NVS_FILE); return ESP_OK; }
+
+	const char* BRIAND_NVS_FILE = "briand_nvs.dat";
+
+	/** NVS contents ("namespace/key" => blob), loaded from file on first nvs_open() */
+	map<string, vector<uint8_t>> BRIAND_NVS_DATA;
+	/** Open handles (handle => namespace) */
+	map<nvs_handle_t, string> BRIAND_NVS_HANDLES;
+	bool BRIAND_NVS_LOADED = false;
+	nvs_handle_t BRIAND_NVS_NEXT_HANDLE = 1;
+	std::mutex BRIAND_NVS_MUTEX;
+
+	/* File format: for each entry, key length (4 bytes), key, blob length (4 bytes), blob. Host byte order. */
+
+	esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+		if (name == NULL || out_handle == NULL) return ESP_FAIL;
+
+		std::lock_guard<std::mutex> lock(BRIAND_NVS_MUTEX);
+
+		if (!BRIAND_NVS_LOADED) {
+			BRIAND_NVS_LOADED = true;
+			FILE* f = fopen(BRIAND_NVS_FILE, "rb");
+			if (f != NULL) {
+				uint32_t len;
+				while (fread(&len, sizeof(len), 1, f) == 1) {
+					string key(len, '\0');
+					if (len > 0 && fread(&key[0], 1, len, f) != len) break;
+					if (fread(&len, sizeof(len), 1, f) != 1) break;
+					vector<uint8_t> blob(len);
+					if (len > 0 && fread(blob.data(), 1, len, f) != len) break;
+					BRIAND_NVS_DATA[key] = std::move(blob);
+				}
+				fclose(f);
+			}
+		}
+
+		*out_handle = BRIAND_NVS_NEXT_HANDLE++;
+		BRIAND_NVS_HANDLES[*out_handle] = string(name);
+
+		return ESP_OK;
+	}
+
+	void nvs_close(nvs_handle_t handle) {
+		std::lock_guard<std::mutex> lock(BRIAND_NVS_MUTEX);
+		BRIAND_NVS_HANDLES.erase(handle);
+	}
+
+	esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length) {
+		std::lock_guard<std::mutex> lock(BRIAND_NVS_MUTEX);
+
+		auto h = BRIAND_NVS_HANDLES.find(handle);
+		if (h == BRIAND_NVS_HANDLES.end()) return ESP_ERR_NVS_INVALID_HANDLE;
+		auto entry = BRIAND_NVS_DATA.find(h->second + "/" + string(key));
+		if (entry == BRIAND_NVS_DATA.end()) return ESP_ERR_NVS_NOT_FOUND;
+
+		// Like the ESP: NULL output returns the required length
+		if (out_value == NULL) {
+			*length = entry->second.size();
+			return ESP_OK;
+		}
+		if (*length < entry->second.size()) {
+			*length = entry->second.size();
+			return ESP_ERR_NVS_INVALID_LENGTH;
+		}
+
+		memcpy(out_value, entry->second.data(), entry->second.size());
+		*length = entry->second.size();
+
+		return ESP_OK;
+	}
+
+	esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+		std::lock_guard<std::mutex> lock(BRIAND_NVS_MUTEX);
+
+		auto h = BRIAND_NVS_HANDLES.find(handle);
+		if (h == BRIAND_NVS_HANDLES.end()) return ESP_ERR_NVS_INVALID_HANDLE;
+
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(value);
+		BRIAND_NVS_DATA[h->second + "/" + string(key)] = vector<uint8_t>(bytes, bytes + length);
+
+		return ESP_OK;
+	}
+
+	esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+		std::lock_guard<std::mutex> lock(BRIAND_NVS_MUTEX);
+
+		auto h = BRIAND_NVS_HANDLES.find(handle);
+		if (h == BRIAND_NVS_HANDLES.end()) return ESP_ERR_NVS_INVALID_HANDLE;
+
+		return (BRIAND_NVS_DATA.erase(h->second + "/" + string(key)) > 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND);
+	}
+
+	esp_err_t nvs_commit(nvs_handle_t handle) {
+		std::lock_guard<std::mutex> lock(BRIAND_NVS_MUTEX);
+
+		if (BRIAND_NVS_HANDLES.find(handle) == BRIAND_NVS_HANDLES.end()) return ESP_ERR_NVS_INVALID_HANDLE;
+
+		FILE* f = fopen(BRIAND_NVS_FILE, "wb");
+		if (f == NULL) return ESP_FAIL;
+
+		for (auto& entry : BRIAND_NVS_DATA) {
+			uint32_t len = static_cast<uint32_t>(entry.first.size());
+			fwrite(&len, sizeof(len), 1, f);
+			fwrite(entry.first.data(), 1, len, f);
+			len = static_cast<uint32_t>(entry.second.size());
+			fwrite(&len, sizeof(len), 1, f);
+			if (len > 0) fwrite(entry.second.data(), 1, len, f);
+		}
+
+		return (fclose(f) == 0 ? ESP_OK : ESP_FAIL);
+	}
 	unsigned int esp_random() {
 		return static_cast<unsigned int>(rand());
 	}
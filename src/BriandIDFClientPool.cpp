@@ -0,0 +1,241 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "BriandIDFClientPool.hxx"
+
+#include <iostream>
+#include <memory>
+
+using namespace std;
+
+namespace Briand {
+
+	BriandIDFClientPool::BriandIDFClientPool() {
+		this->VERBOSE = false;
+		this->IDLE_TIMEOUT_S = 30;
+		// Two TLS clients (record buffers and a few KB for the client itself), plain clients are much smaller
+		this->MAX_POOL_BYTES = 2 * (BriandIDFSocketTlsClient::GetMaxTlsBuffersSize() + 4096);
+		this->MIN_FREE_HEAP = 0;
+		this->idleBytes = 0;
+		this->clientSetup = nullptr;
+		this->reusedCount = 0;
+		this->createdCount = 0;
+	}
+
+	BriandIDFClientPool::~BriandIDFClientPool() {
+		this->Clear();
+	}
+
+	void BriandIDFClientPool::SetVerbose(const bool& verbose) {
+		this->VERBOSE = verbose;
+	}
+
+	void BriandIDFClientPool::SetIdleTimeout(const unsigned long& idleTimeout_s) {
+		this->IDLE_TIMEOUT_S = idleTimeout_s;
+	}
+
+	void BriandIDFClientPool::SetMemoryLimits(const size_t& maxPoolBytes, const size_t& minFreeHeap) {
+		this->MAX_POOL_BYTES = maxPoolBytes;
+		this->MIN_FREE_HEAP = minFreeHeap;
+	}
+
+	void BriandIDFClientPool::SetClientSetup(const function<void(BriandIDFSocketClient*, const bool&)>& setup) {
+		this->clientSetup = setup;
+	}
+
+	void BriandIDFClientPool::CollectExpired(vector<unique_ptr<BriandIDFSocketClient>>& toClose) {
+		uint64_t now = esp_timer_get_time();
+		uint64_t timeout = static_cast<uint64_t>(this->IDLE_TIMEOUT_S) * 1000000;
+
+		for (auto it = this->idle.begin(); it != this->idle.end(); ) {
+			if (now - it->idleSince >= timeout) {
+				this->idleBytes -= it->size;
+				toClose.push_back(std::move(it->client));
+				it = this->idle.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	unique_ptr<BriandIDFSocketClient> BriandIDFClientPool::Acquire(const string& host, const short& port, const bool& tls) {
+		// Clients to be closed, destroyed out of lock (closing a TLS client writes to the network)
+		vector<unique_ptr<BriandIDFSocketClient>> toClose;
+		unique_ptr<BriandIDFSocketClient> client = nullptr;
+
+		{
+			std::lock_guard<std::mutex> lock(this->poolMutex);
+
+			this->CollectExpired(toClose);
+
+			// Most recently released first: the most likely to be still open
+			for (auto it = this->idle.begin(); it != this->idle.end() && client == nullptr; ) {
+				if (it->port != port || it->tls != tls || it->host.compare(host) != 0) {
+					++it;
+					continue;
+				}
+
+				this->idleBytes -= it->size;
+				if (it->client->IsAlive()) {
+					client = std::move(it->client);
+					this->reusedCount++;
+				}
+				else {
+					if (this->VERBOSE) printf("[CLIENT POOL] Idle client to %s:%d closed by peer.\n", host.c_str(), port);
+					toClose.push_back(std::move(it->client));
+				}
+				it = this->idle.erase(it);
+			}
+		}
+
+		if (client != nullptr) {
+			if (this->VERBOSE) printf("[CLIENT POOL] Reusing client to %s:%d.\n", host.c_str(), port);
+			return std::move(client);
+		}
+
+		// New client
+		if (tls) client = make_unique<BriandIDFSocketTlsClient>();
+		else client = make_unique<BriandIDFSocketClient>();
+
+		if (this->clientSetup != nullptr) this->clientSetup(client.get(), tls);
+
+		if (!client->Connect(host, port)) {
+			if (this->VERBOSE) printf("[CLIENT POOL] Connection to %s:%d failed.\n", host.c_str(), port);
+			return nullptr;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(this->poolMutex);
+			this->createdCount++;
+		}
+
+		if (this->VERBOSE) printf("[CLIENT POOL] New client connected to %s:%d.\n", host.c_str(), port);
+
+		return std::move(client);
+	}
+
+	void BriandIDFClientPool::Release(const string& host, const short& port, const bool& tls, unique_ptr<BriandIDFSocketClient>& client) {
+		if (client == nullptr) return;
+
+		vector<unique_ptr<BriandIDFSocketClient>> toClose;
+
+		if (!client->IsAlive()) {
+			if (this->VERBOSE) printf("[CLIENT POOL] Released client to %s:%d is not alive, closing.\n", host.c_str(), port);
+			client.reset();
+			return;
+		}
+
+		if (this->MIN_FREE_HEAP > 0 && BriandESPDevice::GetFreeHeap() < this->MIN_FREE_HEAP) {
+			if (this->VERBOSE) printf("[CLIENT POOL] Low free heap, closing client to %s:%d.\n", host.c_str(), port);
+			client.reset();
+			return;
+		}
+
+		size_t size = client->GetObjectSize();
+
+		if (size > this->MAX_POOL_BYTES && this->VERBOSE)
+			printf("[CLIENT POOL] Warning! Client to %s:%d needs %zu bytes, pool limit is %zu: never pooled, raise it with SetMemoryLimits().\n", host.c_str(), port, size, this->MAX_POOL_BYTES);
+
+		{
+			std::lock_guard<std::mutex> lock(this->poolMutex);
+
+			this->CollectExpired(toClose);
+
+			// Make room by closing the oldest idle clients
+			while (this->idle.size() > 0 && this->idleBytes + size > this->MAX_POOL_BYTES) {
+				this->idleBytes -= this->idle.back().size;
+				toClose.push_back(std::move(this->idle.back().client));
+				this->idle.pop_back();
+			}
+
+			if (this->idleBytes + size <= this->MAX_POOL_BYTES) {
+				PoolEntry entry;
+				entry.host = host;
+				entry.port = port;
+				entry.tls = tls;
+				entry.client = std::move(client);
+				entry.idleSince = esp_timer_get_time();
+				entry.size = size;
+				this->idle.push_front(std::move(entry));
+				this->idleBytes += size;
+			}
+		}
+
+		if (client != nullptr) {
+			if (this->VERBOSE) printf("[CLIENT POOL] Client to %s:%d exceeds pool memory limit, closing.\n", host.c_str(), port);
+			client.reset();
+		}
+	}
+
+	void BriandIDFClientPool::Purge() {
+		vector<unique_ptr<BriandIDFSocketClient>> toClose;
+
+		std::lock_guard<std::mutex> lock(this->poolMutex);
+
+		this->CollectExpired(toClose);
+
+		for (auto it = this->idle.begin(); it != this->idle.end(); ) {
+			if (!it->client->IsAlive()) {
+				this->idleBytes -= it->size;
+				toClose.push_back(std::move(it->client));
+				it = this->idle.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	void BriandIDFClientPool::Clear() {
+		list<PoolEntry> toClose;
+
+		std::lock_guard<std::mutex> lock(this->poolMutex);
+		toClose.swap(this->idle);
+		this->idleBytes = 0;
+	}
+
+	size_t BriandIDFClientPool::GetIdleCount() {
+		std::lock_guard<std::mutex> lock(this->poolMutex);
+		return this->idle.size();
+	}
+
+	unsigned long BriandIDFClientPool::GetReusedCount() {
+		return this->reusedCount;
+	}
+
+	unsigned long BriandIDFClientPool::GetCreatedCount() {
+		return this->createdCount;
+	}
+
+	size_t BriandIDFClientPool::GetObjectSize() {
+		size_t oSize = 0;
+
+		oSize += sizeof(*this);
+		for (const PoolEntry& entry : this->idle) {
+			oSize += sizeof(entry) + sizeof(char)*entry.host.size();
+		}
+		oSize += this->idleBytes;
+
+		return oSize;
+	}
+
+	void BriandIDFClientPool::PrintObjectSizeInfo() {
+		printf("sizeof(*this) = %zu\n", sizeof(*this));
+		printf("this->idle (%zu clients) = %zu\n", this->idle.size(), this->GetObjectSize() - sizeof(*this));
+
+		printf("TOTAL = %zu\n", this->GetObjectSize());
+	}
+}
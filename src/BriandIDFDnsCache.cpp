@@ -0,0 +1,258 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "BriandIDFDnsCache.hxx"
+
+#include <iostream>
+#include <memory>
+#include <cstring>
+
+using namespace std;
+
+namespace Briand {
+
+	// Define so it can be initialized with first call to GetInstance()
+	BriandIDFDnsCache* BriandIDFDnsCache::Instance = NULL;
+
+	BriandIDFDnsCache* BriandIDFDnsCache::GetInstance() {
+		// Singleton pattern
+		if (BriandIDFDnsCache::Instance == NULL) {
+			BriandIDFDnsCache::Instance = new BriandIDFDnsCache();
+		}
+
+		return Instance;
+	}
+
+	BriandIDFDnsCache::BriandIDFDnsCache() {
+		this->VERBOSE = false;
+		this->TTL_S = 300;
+		this->NEGATIVE_TTL_S = 10;
+		this->MAX_ENTRIES = 16;
+		this->hits = 0;
+		this->misses = 0;
+	}
+
+	BriandIDFDnsCache::~BriandIDFDnsCache() {
+		this->Clear();
+	}
+
+	void BriandIDFDnsCache::SetVerbose(const bool& verbose) {
+		this->VERBOSE = verbose;
+	}
+
+	void BriandIDFDnsCache::SetTTL(const unsigned long& ttl_s, const unsigned long& negativeTtl_s) {
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		this->TTL_S = ttl_s;
+		this->NEGATIVE_TTL_S = negativeTtl_s;
+	}
+
+	void BriandIDFDnsCache::SetMaxEntries(const unsigned short& maxEntries) {
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		this->MAX_ENTRIES = (maxEntries > 0 ? maxEntries : 1);
+		while (this->entries.size() > this->MAX_ENTRIES) this->entries.pop_back();
+	}
+
+	vector<BriandIDFResolvedAddress> BriandIDFDnsCache::Lookup(const string& host) {
+		vector<BriandIDFResolvedAddress> ipv6, ipv4, addresses;
+
+		struct addrinfo hints {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		struct addrinfo* res = NULL;
+
+		int err = getaddrinfo(host.c_str(), NULL, &hints, &res);
+
+		if(err != 0 || res == NULL) {
+			if (this->VERBOSE) printf("[DNS CACHE] DNS lookup of %s failed err=%d res=%p\n", host.c_str(), err, res);
+			if (res != NULL) freeaddrinfo(res);
+			return addresses;
+		}
+
+		for (const struct addrinfo* p = res; p != NULL; p = p->ai_next) {
+			if (p->ai_family != AF_INET && p->ai_family != AF_INET6) continue;
+			if (p->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+
+			BriandIDFResolvedAddress address {};
+			address.family = p->ai_family;
+			address.length = p->ai_addrlen;
+			memcpy(&address.address, p->ai_addr, p->ai_addrlen);
+
+			if (p->ai_family == AF_INET6) ipv6.push_back(address);
+			else ipv4.push_back(address);
+		}
+
+		// Happy eyeballs order (RFC 8305): alternate address families, starting with the family of the first result
+		auto& first = (res->ai_family == AF_INET6 ? ipv6 : ipv4);
+		auto& second = (res->ai_family == AF_INET6 ? ipv4 : ipv6);
+		for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+			if (i < first.size()) addresses.push_back(first[i]);
+			if (i < second.size()) addresses.push_back(second[i]);
+		}
+
+		freeaddrinfo(res);
+
+		return addresses;
+	}
+
+	void BriandIDFDnsCache::Store(const string& host, const vector<BriandIDFResolvedAddress>& addresses) {
+		unsigned long ttl = (addresses.size() > 0 ? this->TTL_S : this->NEGATIVE_TTL_S);
+
+		// Remove any previous entry
+		for (auto it = this->entries.begin(); it != this->entries.end(); ++it) {
+			if (it->host.compare(host) == 0) {
+				this->entries.erase(it);
+				break;
+			}
+		}
+
+		if (ttl == 0) return;
+
+		// Evict the least recently used
+		while (this->entries.size() >= this->MAX_ENTRIES) this->entries.pop_back();
+
+		CacheEntry entry;
+		entry.host = host;
+		entry.addresses = addresses;
+		entry.expiresAt = esp_timer_get_time() + static_cast<uint64_t>(ttl) * 1000000;
+		this->entries.push_front(std::move(entry));
+	}
+
+	vector<BriandIDFResolvedAddress> BriandIDFDnsCache::Resolve(const string& host) {
+		{
+			std::lock_guard<std::mutex> lock(this->cacheMutex);
+			uint64_t now = esp_timer_get_time();
+
+			for (auto it = this->entries.begin(); it != this->entries.end(); ++it) {
+				if (it->host.compare(host) != 0) continue;
+
+				if (it->expiresAt <= now) {
+					this->entries.erase(it);
+					break;
+				}
+
+				// Most recently used goes first
+				this->entries.splice(this->entries.begin(), this->entries, it);
+				this->hits++;
+				if (this->VERBOSE) printf("[DNS CACHE] %s found in cache (%zu addresses).\n", host.c_str(), this->entries.front().addresses.size());
+				return this->entries.front().addresses;
+			}
+
+			this->misses++;
+		}
+
+		// Do not hold the lock during the DNS request
+		auto addresses = this->Lookup(host);
+
+		if (this->VERBOSE) printf("[DNS CACHE] %s resolved (%zu addresses).\n", host.c_str(), addresses.size());
+
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		this->Store(host, addresses);
+
+		return addresses;
+	}
+
+	void BriandIDFDnsCache::PrefetchTask(void* hostsPtr) {
+		auto hosts = reinterpret_cast<vector<string>*>(hostsPtr);
+		auto cache = BriandIDFDnsCache::GetInstance();
+
+		for (const string& host : *hosts) {
+			auto addresses = cache->Lookup(host);
+			if (cache->VERBOSE) printf("[DNS CACHE] %s prefetched (%zu addresses).\n", host.c_str(), addresses.size());
+			std::lock_guard<std::mutex> lock(cache->cacheMutex);
+			cache->Store(host, addresses);
+		}
+
+		delete hosts;
+
+		vTaskDelete(NULL);
+	}
+
+	bool BriandIDFDnsCache::Prefetch(const vector<string>& hosts) {
+		auto toResolve = new vector<string>();
+
+		{
+			std::lock_guard<std::mutex> lock(this->cacheMutex);
+			uint64_t now = esp_timer_get_time();
+
+			for (const string& host : hosts) {
+				bool cached = false;
+				for (const CacheEntry& entry : this->entries) {
+					if (entry.host.compare(host) == 0 && entry.expiresAt > now) {
+						cached = true;
+						break;
+					}
+				}
+				if (!cached) toResolve->push_back(host);
+			}
+		}
+
+		if (toResolve->size() == 0) {
+			delete toResolve;
+			return true;
+		}
+
+		// Stack: getaddrinfo over lwIP needs some room
+		if (xTaskCreate(BriandIDFDnsCache::PrefetchTask, "DnsPrefetch", 3072, toResolve, 5, NULL) != pdPASS) {
+			if (this->VERBOSE) printf("[DNS CACHE] Failed to start prefetch task.\n");
+			delete toResolve;
+			return false;
+		}
+
+		return true;
+	}
+
+	void BriandIDFDnsCache::Invalidate(const string& host) {
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		for (auto it = this->entries.begin(); it != this->entries.end(); ++it) {
+			if (it->host.compare(host) == 0) {
+				this->entries.erase(it);
+				break;
+			}
+		}
+	}
+
+	void BriandIDFDnsCache::Clear() {
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		this->entries.clear();
+	}
+
+	unsigned long BriandIDFDnsCache::GetHits() {
+		return this->hits;
+	}
+
+	unsigned long BriandIDFDnsCache::GetMisses() {
+		return this->misses;
+	}
+
+	size_t BriandIDFDnsCache::GetObjectSize() {
+		size_t oSize = 0;
+
+		oSize += sizeof(*this);
+		for (const CacheEntry& entry : this->entries) {
+			oSize += sizeof(entry) + sizeof(char)*entry.host.size();
+			oSize += sizeof(BriandIDFResolvedAddress)*entry.addresses.size();
+		}
+
+		return oSize;
+	}
+
+	void BriandIDFDnsCache::PrintObjectSizeInfo() {
+		printf("sizeof(*this) = %zu\n", sizeof(*this));
+		printf("this->entries (%zu entries) = %zu\n", this->entries.size(), this->GetObjectSize() - sizeof(*this));
+
+		printf("TOTAL = %zu\n", this->GetObjectSize());
+	}
+}
@@ -14,9 +14,11 @@
 */
 
 #include "BriandIDFSocketClient.hxx"
+#include "BriandIDFWifiManager.hxx"
 
 #include <iostream>
 #include <memory>
+#include <cstring>
 
 using namespace std;
 
@@ -26,10 +28,21 @@ namespace Briand {
 		this->CLIENT_NAME = string("BriandIDFSocketClient");
 		this->CONNECTED = false;
 		this->VERBOSE = false;
-		this->CONNECT_TIMEOUT_S = 0;
-		this->IO_TIMEOUT_S = 0;
+		this->CONNECT_TIMEOUT_MS = 0;
+		this->IO_TIMEOUT_MS = 0;
+		this->ioDeadline = 0;
 		this->RECV_BUF_SIZE = 512;
 		this->_socket = -1;
+		this->recvBuffer = nullptr;
+		this->readAheadBuffer = nullptr;
+		this->readAheadSize = 0;
+		this->readAheadStart = 0;
+		this->readAheadEnd = 0;
+		this->lastConnectAddress = string("");
+		this->lastConnectTimeMs = 0;
+		this->connectGeneration = 0;
+		this->POWER_BURST = false;
+		this->RTT_REPORT = false;
 	}
 	
 	BriandIDFSocketClient::~BriandIDFSocketClient() {
@@ -39,10 +52,10 @@ namespace Briand {
 	void BriandIDFSocketClient::SetDefaultSocketOptions() {
 		if (this->CONNECTED) {
 			// Set read and write timeout if requested
-			if (this->IO_TIMEOUT_S > 0) {
+			if (this->IO_TIMEOUT_MS > 0) {
 				struct timeval receiving_timeout;
-				receiving_timeout.tv_sec = this->IO_TIMEOUT_S;
-				receiving_timeout.tv_usec = 0;
+				receiving_timeout.tv_sec = this->IO_TIMEOUT_MS / 1000;
+				receiving_timeout.tv_usec = (this->IO_TIMEOUT_MS % 1000) * 1000;
 				
 				// Set timeout for socket read
 				if (setsockopt(this->_socket, SOL_SOCKET, SO_RCVTIMEO, &receiving_timeout, sizeof(receiving_timeout)) < 0) {
@@ -78,38 +91,264 @@ namespace Briand {
 		this->CLIENT_NAME = "BriandIDFSocketClient#" + std::to_string(id);
 	}
 
+	void BriandIDFSocketClient::SetPowerBurst(const bool& enabled) {
+		this->POWER_BURST = enabled;
+	}
+
+	void BriandIDFSocketClient::SetRttReport(const bool& enabled) {
+		this->RTT_REPORT = enabled;
+	}
+
+	void BriandIDFSocketClient::NotifyTraffic() {
+		if (this->POWER_BURST) BriandIDFWifiManager::GetInstance()->NotifyTraffic();
+	}
+
+	uint64_t BriandIDFSocketClient::GetConnectDeadline(const uint64_t& startTime) {
+		uint64_t deadline = startTime + static_cast<uint64_t>(this->CONNECT_TIMEOUT_MS > 0 ? this->CONNECT_TIMEOUT_MS : this->poll_default_timeout_ms) * 1000;
+		if (this->ioDeadline > 0 && this->ioDeadline < deadline) deadline = this->ioDeadline;
+		return deadline;
+	}
+
 	void BriandIDFSocketClient::SetTimeout(const unsigned short& connectTimeout_s, const unsigned short& ioTimeout_s) {
-		this->CONNECT_TIMEOUT_S = connectTimeout_s;
-		this->IO_TIMEOUT_S = ioTimeout_s;
+		this->SetTimeoutMs(static_cast<unsigned long>(connectTimeout_s) * 1000, static_cast<unsigned long>(ioTimeout_s) * 1000);
+	}
+
+	void BriandIDFSocketClient::SetTimeoutMs(const unsigned long& connectTimeout_ms, const unsigned long& ioTimeout_ms) {
+		this->CONNECT_TIMEOUT_MS = connectTimeout_ms;
+		this->IO_TIMEOUT_MS = ioTimeout_ms;
+	}
+
+	void BriandIDFSocketClient::SetDeadline(const unsigned long& timeFromNow_ms) {
+		this->ioDeadline = esp_timer_get_time() + static_cast<uint64_t>(timeFromNow_ms) * 1000;
+		// 0 means no deadline
+		if (this->ioDeadline == 0) this->ioDeadline = 1;
+	}
+
+	void BriandIDFSocketClient::ClearDeadline() {
+		this->ioDeadline = 0;
+	}
+
+	bool BriandIDFSocketClient::IsDeadlineExpired() {
+		return this->ioDeadline > 0 && esp_timer_get_time() >= this->ioDeadline;
+	}
+
+	int BriandIDFSocketClient::WaitSocket(const short& events) {
+		if (this->_socket < 0) return -1;
+
+		struct pollfd pfd;
+		pfd.fd = this->_socket;
+		pfd.events = events;
+
+		// Retry if interrupted, with the remaining time
+		while (true) {
+			uint64_t waitMs = (this->IO_TIMEOUT_MS > 0 ? this->IO_TIMEOUT_MS : this->poll_default_timeout_ms);
+
+			if (this->ioDeadline > 0) {
+				uint64_t now = esp_timer_get_time();
+				if (now >= this->ioDeadline) {
+					if (this->VERBOSE) printf("[%s] Deadline reached.\n", this->CLIENT_NAME.c_str());
+					return 0;
+				}
+				// Round up, so the deadline is really reached
+				uint64_t remainingMs = (this->ioDeadline - now + 999) / 1000;
+				if (remainingMs < waitMs) waitMs = remainingMs;
+			}
+
+			pfd.revents = 0;
+			int pollResult = poll(&pfd, 1, static_cast<int>(waitMs));
+
+			if (pollResult < 0) {
+				if (errno == EINTR) continue;
+				if (this->VERBOSE) printf("[%s] poll() failed, errno = %d\n", this->CLIENT_NAME.c_str(), errno);
+				return -1;
+			}
+			else if (pollResult == 0) {
+				if (this->VERBOSE) printf("[%s] poll() timed out.\n", this->CLIENT_NAME.c_str());
+				return 0;
+			}
+
+			// POLLHUP/POLLERR: let the following recv()/send() report the condition
+			return 1;
+		}
 	}
 
 	void BriandIDFSocketClient::SetReceivingBufferSize(const unsigned short& size) {
+		// Buffers will be re-allocated with the new size on next read (read-ahead only if empty)
+		if (size != this->RECV_BUF_SIZE) {
+			this->recvBuffer.reset();
+			if (this->readAheadStart == this->readAheadEnd) {
+				this->readAheadBuffer.reset();
+				this->readAheadSize = 0;
+				this->readAheadStart = 0;
+				this->readAheadEnd = 0;
+			}
+		}
 		this->RECV_BUF_SIZE = size;
 	}
 
-	bool BriandIDFSocketClient::Connect(const struct addrinfo& address, const short& port) {
-		// If previous connection is in progress, close it.
-		if (this->CONNECTED) {
-			this->Disconnect();
+	bool BriandIDFSocketClient::OpenSocket(const vector<const struct addrinfo*>& candidates) {
+		if (candidates.size() == 0) {
+			if (this->VERBOSE) printf("[%s] No address to connect to.\n", this->CLIENT_NAME.c_str());
+			return false;
 		}
 
-		this->_socket = socket(address.ai_family, address.ai_socktype, 0);
+		// Discard any byte left from a previous connection
+		this->readAheadStart = 0;
+		this->readAheadEnd = 0;
+		this->_socket = -1;
 
-		if (this->_socket < 0) {
-			if (this->VERBOSE) printf("[%s] Failed to allocate socket.\n", this->CLIENT_NAME.c_str());
-			return false;
+		// All times in microseconds
+		const uint64_t startTime = esp_timer_get_time();
+		const uint64_t deadline = this->GetConnectDeadline(startTime);
+		uint64_t nextAttemptTime = startTime;
+
+		// Power save off before the SYN, the SYN-ACK must not wait for a beacon
+		this->NotifyTraffic();
+
+		// Pending (in progress) sockets, -1 if not started or failed
+		vector<int> pending(candidates.size(), -1);
+		// Start time of each attempt (the winner's one gives the handshake round trip)
+		vector<uint64_t> attemptStart(candidates.size(), 0);
+		size_t pendingCount = 0;
+		size_t next = 0;
+		int winner = -1;
+		size_t winnerIndex = 0;
+
+		while (winner < 0) {
+			uint64_t now = esp_timer_get_time();
+
+			if (now >= deadline) {
+				if (this->VERBOSE) printf("[%s] Connection timed out.\n", this->CLIENT_NAME.c_str());
+				break;
+			}
+
+			// Start the next attempt if its time has come or nothing else is in progress
+			if (next < candidates.size() && (now >= nextAttemptTime || pendingCount == 0)) {
+				const struct addrinfo* address = candidates[next];
+				size_t index = next;
+				next++;
+				nextAttemptTime = now + static_cast<uint64_t>(this->connect_attempt_delay_ms) * 1000;
+				attemptStart[index] = now;
+
+				int s = socket(address->ai_family, address->ai_socktype, 0);
+				if (s < 0) {
+					if (this->VERBOSE) printf("[%s] Failed to allocate socket.\n", this->CLIENT_NAME.c_str());
+					continue;
+				}
+
+				fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+
+				if (connect(s, address->ai_addr, address->ai_addrlen) == 0) {
+					winner = s;
+					winnerIndex = index;
+				}
+				else if (errno == EINPROGRESS) {
+					pending[index] = s;
+					pendingCount++;
+				}
+				else {
+					if (this->VERBOSE) printf("[%s] Socket connection failed, errno = %d\n", this->CLIENT_NAME.c_str(), errno);
+					close(s);
+				}
+
+				continue;
+			}
+
+			// Every attempt failed
+			if (pendingCount == 0) break;
+
+			// Wait for any pending socket to become writable (connected or failed), until deadline or next attempt time
+			uint64_t waitUntil = deadline;
+			if (next < candidates.size() && nextAttemptTime < waitUntil) waitUntil = nextAttemptTime;
+
+			vector<struct pollfd> fds;
+			vector<size_t> indexes;
+			for (size_t i = 0; i < pending.size(); i++) {
+				if (pending[i] < 0) continue;
+				struct pollfd pfd;
+				pfd.fd = pending[i];
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				fds.push_back(pfd);
+				indexes.push_back(i);
+			}
+
+			// Round up to the next millisecond
+			uint64_t waitTime = (waitUntil > now ? waitUntil - now : 0);
+			int pollResult = poll(fds.data(), fds.size(), static_cast<int>((waitTime + 999) / 1000));
+
+			if (pollResult < 0) {
+				if (errno == EINTR) continue;
+				if (this->VERBOSE) printf("[%s] poll() failed.\n", this->CLIENT_NAME.c_str());
+				break;
+			}
+
+			for (size_t j = 0; j < fds.size() && winner < 0; j++) {
+				if (fds[j].revents == 0) continue;
+				size_t i = indexes[j];
+
+				int socketError = 0;
+				socklen_t len = sizeof(socketError);
+				if (getsockopt(pending[i], SOL_SOCKET, SO_ERROR, &socketError, &len) == 0 && socketError == 0) {
+					winner = pending[i];
+					winnerIndex = i;
+				}
+				else {
+					if (this->VERBOSE) printf("[%s] Socket connection failed, error = %d\n", this->CLIENT_NAME.c_str(), socketError);
+					close(pending[i]);
+				}
+
+				pending[i] = -1;
+				pendingCount--;
+			}
 		}
-		
-		if (this->VERBOSE) printf("[%s] Socket allocated.\n", this->CLIENT_NAME.c_str());
 
-		if(connect(this->_socket, address.ai_addr, address.ai_addrlen) != 0) {
-			if (this->VERBOSE) printf("[%s] Socket connection failed, errno = %d\n", this->CLIENT_NAME.c_str(), errno);
-			shutdown(this->_socket, SHUT_RDWR);
-			close(this->_socket);
+		// Close the losers
+		for (size_t i = 0; i < pending.size(); i++) {
+			if (pending[i] >= 0) close(pending[i]);
+		}
+
+		if (winner < 0) {
+			if (this->VERBOSE) printf("[%s] Connection failed.\n", this->CLIENT_NAME.c_str());
 			return false;
 		}
 
-		if (this->VERBOSE) printf("[%s] Socket connected.\n", this->CLIENT_NAME.c_str());
+		// Back to blocking mode
+		fcntl(winner, F_SETFL, fcntl(winner, F_GETFL, 0) & ~O_NONBLOCK);
+		this->_socket = winner;
+		this->connectGeneration++;
+
+		// Save statistics
+		uint64_t established = esp_timer_get_time();
+		this->lastConnectTimeMs = static_cast<unsigned long>((established - startTime) / 1000);
+		if (this->RTT_REPORT) BriandIDFWifiManager::GetInstance()->AddRttSample(established - attemptStart[winnerIndex]);
+		char ipBuf[INET6_ADDRSTRLEN] = { 0 };
+		const struct addrinfo* address = candidates[winnerIndex];
+		if (address->ai_family == AF_INET6) {
+			auto in6 = reinterpret_cast<const struct sockaddr_in6*>(address->ai_addr);
+			inet_ntop(AF_INET6, &in6->sin6_addr, ipBuf, INET6_ADDRSTRLEN);
+			this->lastConnectAddress = "[" + string(ipBuf) + "]:" + std::to_string(ntohs(in6->sin6_port));
+		}
+		else {
+			auto in4 = reinterpret_cast<const struct sockaddr_in*>(address->ai_addr);
+			inet_ntop(AF_INET, &in4->sin_addr, ipBuf, INET6_ADDRSTRLEN);
+			this->lastConnectAddress = string(ipBuf) + ":" + std::to_string(ntohs(in4->sin_port));
+		}
+
+		if (this->VERBOSE) printf("[%s] Socket connected to %s in %lu ms.\n", this->CLIENT_NAME.c_str(), this->lastConnectAddress.c_str(), this->lastConnectTimeMs);
+
+		return true;
+	}
+
+	bool BriandIDFSocketClient::Connect(const struct addrinfo& address, const short& port) {
+		// If previous connection is in progress, close it.
+		if (this->CONNECTED) {
+			this->Disconnect();
+		}
+
+		if (!this->OpenSocket(vector<const struct addrinfo*>(1, &address))) {
+			return false;
+		}
 
 		// Now connected!
 		this->CONNECTED = true;
@@ -120,51 +359,117 @@ namespace Briand {
 		return true;
 	}
 
+	bool BriandIDFSocketClient::OpenSocket(const string& host, const short& port) {
+		auto resolved = BriandIDFDnsCache::GetInstance()->Resolve(host);
+
+		if (resolved.size() == 0) {
+			if (this->VERBOSE) printf("[%s] DNS lookup of %s failed.\n", this->CLIENT_NAME.c_str(), host.c_str());
+			return false;
+		}
+
+		// Build the candidates list, setting the port
+		vector<struct addrinfo> infos(resolved.size());
+		vector<const struct addrinfo*> candidates;
+		for (size_t i = 0; i < resolved.size(); i++) {
+			if (resolved[i].family == AF_INET6)
+				reinterpret_cast<struct sockaddr_in6*>(&resolved[i].address)->sin6_port = htons(port);
+			else
+				reinterpret_cast<struct sockaddr_in*>(&resolved[i].address)->sin_port = htons(port);
+
+			bzero(&infos[i], sizeof(struct addrinfo));
+			infos[i].ai_family = resolved[i].family;
+			infos[i].ai_socktype = SOCK_STREAM;
+			infos[i].ai_addrlen = resolved[i].length;
+			infos[i].ai_addr = reinterpret_cast<struct sockaddr*>(&resolved[i].address);
+			candidates.push_back(&infos[i]);
+		}
+
+		return this->OpenSocket(candidates);
+	}
+
 	bool BriandIDFSocketClient::Connect(const string& host, const short& port) {
 		// If previous connection is in progress, close it.
 		if (this->CONNECTED) {
 			this->Disconnect();
 		}
 
-		// Make a DNS request, then call the main Connect.
-
-		// TODO : IPv6 support
-		
-		struct addrinfo hints {};
-		hints.ai_family = AF_INET;
-		hints.ai_socktype = SOCK_STREAM;
-
-		struct addrinfo* res;
-
-		int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
-
-		if(err != 0 || res == NULL) {
-			if (this->VERBOSE) printf("[%s] DNS lookup failed err=%d res=%p\n", this->CLIENT_NAME.c_str(), err, res);
-			if (res != NULL) freeaddrinfo(res);
+		if (!this->OpenSocket(host, port)) {
 			return false;
 		}
 
-		bool connected = this->Connect(*res, port);
+		// Now connected!
+		this->CONNECTED = true;
 
-		// Free resources
-		freeaddrinfo(res);
+		// Set socket options
+		this->SetDefaultSocketOptions();
 
-		return connected;
+		return true;
 	}
 
 	bool BriandIDFSocketClient::IsConnected() {
 		return this->CONNECTED;
 	}
 
+	bool BriandIDFSocketClient::IsAlive() {
+		if (!this->CONNECTED || this->_socket < 0) return false;
+
+		// Bytes already buffered
+		if (this->readAheadStart < this->readAheadEnd) return true;
+
+		// Pending socket error
+		int socketError = 0;
+		socklen_t len = sizeof(socketError);
+		if (getsockopt(this->_socket, SOL_SOCKET, SO_ERROR, &socketError, &len) != 0 || socketError != 0) return false;
+
+		// Peek one byte without waiting: 0 means peer closed, EAGAIN means idle and open
+		unsigned char b;
+		int received = recv(this->_socket, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (received == 0) return false;
+		if (received < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+
+		return true;
+	}
+
+	bool BriandIDFSocketClient::IsEncrypted() {
+		return false;
+	}
+
 	void BriandIDFSocketClient::Disconnect() {
 		if (this->CONNECTED) {
 			shutdown(this->_socket, SHUT_RDWR);
 			close(this->_socket);
 			this->CONNECTED = false;
+			this->readAheadStart = 0;
+			this->readAheadEnd = 0;
 			if (this->VERBOSE) printf("[%s] Disconnected.\n", this->CLIENT_NAME.c_str());
 		}
 	}
 
+	int BriandIDFSocketClient::WriteRaw(const unsigned char* buffer, const size_t& size) {
+		int ret;
+
+		this->NotifyTraffic();
+
+		// With a deadline, do not block in send() beyond it
+		if (this->ioDeadline > 0) {
+			ret = this->WaitSocket(POLLOUT);
+			if (ret <= 0) {
+				if (this->VERBOSE) printf("[%s] Socket not writable before deadline.\n", this->CLIENT_NAME.c_str());
+				return -1;
+			}
+		}
+
+		do {
+			ret = send(this->_socket, buffer, size, MSG_NOSIGNAL);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			if (this->VERBOSE) printf("[%s] Error on send(), errno = %d\n", this->CLIENT_NAME.c_str(), errno);
+		}
+
+		return ret;
+	}
+
 	bool BriandIDFSocketClient::WriteData(const unique_ptr<vector<unsigned char>>& data) {
 		if (!this->CONNECTED) return false;
 
@@ -173,160 +478,292 @@ namespace Briand {
 			return false;
 		}
 
-		if (send(this->_socket, data->data(), data->size(), 0) < 0) {
-			if (this->VERBOSE) printf("[%s] Error on send().\n", this->CLIENT_NAME.c_str());
+		return this->WriteData(data->data(), data->size());
+	}
+
+	bool BriandIDFSocketClient::WriteData(const string_view& data) {
+		return this->WriteData(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+	}
+
+	bool BriandIDFSocketClient::WriteData(const unsigned char* data, const size_t& size) {
+		if (!this->CONNECTED) return false;
+
+		if (data == nullptr || size == 0) {
+			if (this->VERBOSE) printf("[%s] WriteData: no bytes! (nullptr or zero size!).\n", this->CLIENT_NAME.c_str());
 			return false;
 		}
+
+		// Loop until everything is sent, send() could write less bytes than requested
+		size_t sent = 0;
+		while (sent < size) {
+			int ret = this->WriteRaw(data + sent, size - sent);
+			if (ret <= 0) {
+				if (this->VERBOSE) printf("[%s] Write failed after %zu of %zu bytes.\n", this->CLIENT_NAME.c_str(), sent, size);
+				return false;
+			}
+			sent += static_cast<size_t>(ret);
+		}
 		
-		if (this->VERBOSE) printf("[%s] %d bytes written.\n", this->CLIENT_NAME.c_str(), data->size());
+		if (this->VERBOSE) printf("[%s] %zu bytes written.\n", this->CLIENT_NAME.c_str(), sent);
 
 		return true;
 	}
 
-	unique_ptr<vector<unsigned char>> BriandIDFSocketClient::ReadData(bool oneChunk /* = false*/) {
-		auto data = make_unique<vector<unsigned char>>();
+	bool BriandIDFSocketClient::WriteV(const struct iovec* iov, const int& iovcnt) {
+		if (!this->CONNECTED) return false;
 
-		if (!this->CONNECTED) return std::move(data);
+		if (iov == nullptr || iovcnt <= 0) {
+			if (this->VERBOSE) printf("[%s] WriteV: no buffers! (nullptr or zero count!).\n", this->CLIENT_NAME.c_str());
+			return false;
+		}
 
-		// Error management
-		//int ret;
-
-		// Poll the connection for reading
-		// if (this->VERBOSE) printf("[%s] Polling for read\n", this->CLIENT_NAME.c_str()); 
-		// gives linker undefined reference error
-		// ret = mbedtls_net_poll(&this->tls_socket, MBEDTLS_NET_POLL_READ, this->IO_TIMEOUT_S*1000);
-		// polling not solving problem for long delays
-		// pollfd fds;
-		// memset(&fds, 0, sizeof(fds));
-		// fds.fd = this->_socket;
-		// fds.events = POLLRDNORM;
-		// ret = poll(&fds, 1, this->poll_timeout_s*1000);
-		// if (this->VERBOSE) printf("[%s] Poll result: %d flags: %d Bytes avail: %d\n", this->CLIENT_NAME.c_str(), ret, fds.revents, this->AvailableBytes());
+		this->NotifyTraffic();
+
+		// Current position: buffer index and offset inside it.
+		// The buffers are passed to sendmsg() in batches built on the stack, first one adjusted after a short write.
+		const unsigned char IOV_BATCH = 16;
+		struct iovec batch[IOV_BATCH];
+		int index = 0;
+		size_t offset = 0;
+		size_t sent = 0;
+
+		while (index < iovcnt) {
+			int count = 0;
+			for (int i = index; i < iovcnt && count < IOV_BATCH; i++) {
+				size_t skip = (i == index ? offset : 0);
+				if (iov[i].iov_len <= skip) continue;
+				batch[count].iov_base = static_cast<unsigned char*>(iov[i].iov_base) + skip;
+				batch[count].iov_len = iov[i].iov_len - skip;
+				count++;
+			}
 
-		// Read until bytes received or just one chunk requested
-		int receivedBytes;
-		do {
-			// The following seems to resolve the long delay. 
-			// The blocking request for always RECV_BUF_SIZE seems to keep socket blocked until exactly recv_buf_size at most is read.
-
-			size_t remainingBytes = this->AvailableBytes();
-			int READ_SIZE = this->RECV_BUF_SIZE;
-			if (remainingBytes > 0 && remainingBytes < READ_SIZE)
-				READ_SIZE = remainingBytes;
-
-			auto recvBuffer = make_unique<unsigned char[]>(READ_SIZE);
-
-			// Before blocking socket, perform a select(), if timeout is not specified, a default 10 seconds will be used.
-			fd_set filter;
-			FD_ZERO(&filter);
-			FD_SET(this->_socket, &filter);
-			struct timeval timeout;
-			bzero(&timeout, sizeof(timeout));
-			timeout.tv_usec = 0;
-			timeout.tv_sec = ( this->IO_TIMEOUT_S > 0 ? this->IO_TIMEOUT_S : this->poll_default_timeout_s);
-			int selectResult = select(this->_socket+1, &filter, NULL, NULL, &timeout);
-
-			if (selectResult < 0) {
-				// An error occoured, select() failed.
-				if (this->VERBOSE) printf("[%s] select() failed.\n", this->CLIENT_NAME.c_str());
-				break;
+			// Nothing left (only empty buffers)
+			if (count == 0) break;
+
+			struct msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = batch;
+			message.msg_iovlen = count;
+
+			// With a deadline, do not block in sendmsg() beyond it
+			if (this->ioDeadline > 0 && this->WaitSocket(POLLOUT) <= 0) {
+				if (this->VERBOSE) printf("[%s] Socket not writable before deadline, %zu bytes sent.\n", this->CLIENT_NAME.c_str(), sent);
+				return false;
 			}
-			else if (selectResult == 0 && !FD_ISSET(this->_socket, &filter)) {
-				// An timeout occoured
-				if (this->VERBOSE) printf("[%s] select() timed out.\n", this->CLIENT_NAME.c_str());
-				break;
+
+			int ret;
+			do {
+				ret = sendmsg(this->_socket, &message, MSG_NOSIGNAL);
+			} while (ret < 0 && errno == EINTR);
+
+			if (ret <= 0) {
+				if (this->VERBOSE) printf("[%s] Error on sendmsg() after %zu bytes, errno = %d\n", this->CLIENT_NAME.c_str(), sent, errno);
+				return false;
 			}
-			else if (!FD_ISSET(this->_socket, &filter)) {
-				// No socket on the results!
-				if (this->VERBOSE) printf("[%s] select() error: no timeout but socket not ready.\n", this->CLIENT_NAME.c_str());
-				break;
+
+			sent += static_cast<size_t>(ret);
+
+			// Advance the position by the written bytes
+			size_t advance = static_cast<size_t>(ret);
+			while (index < iovcnt && advance >= iov[index].iov_len - offset) {
+				advance -= iov[index].iov_len - offset;
+				index++;
+				offset = 0;
 			}
+			offset += advance;
+		}
 
-			if (this->VERBOSE) printf("[%s] select() succeded.\n", this->CLIENT_NAME.c_str());
+		if (this->VERBOSE) printf("[%s] %zu bytes written.\n", this->CLIENT_NAME.c_str(), sent);
 
-			receivedBytes = recv(this->_socket, recvBuffer.get(), READ_SIZE, 0);
+		return true;
+	}
+
+	int BriandIDFSocketClient::ReadRaw(unsigned char* buffer, const size_t& size) {
+		if (!this->CONNECTED || buffer == nullptr || size == 0) return 0;
+
+		this->NotifyTraffic();
+
+		// Before blocking socket, perform a poll(), if timeout is not specified, a default 10 seconds will be used.
+		int pollResult = this->WaitSocket(POLLIN);
+
+		if (pollResult <= 0) {
+			return pollResult;
+		}
 
-			if (receivedBytes == 0) {
-				// If select() succeded but zero bytes are received, then exit / peer disconnected.
-				if (this->VERBOSE) printf("[%s] select() succeded, but zero bytes received. Peer disconnected.\n", this->CLIENT_NAME.c_str());
+		if (this->VERBOSE) printf("[%s] poll() succeded.\n", this->CLIENT_NAME.c_str());
+
+		int receivedBytes = recv(this->_socket, buffer, size, 0);
+
+		if (receivedBytes == 0) {
+			// If poll() succeded but zero bytes are received, then exit / peer disconnected.
+			if (this->VERBOSE) printf("[%s] poll() succeded, but zero bytes received. Peer disconnected.\n", this->CLIENT_NAME.c_str());
+		}
+		else if (receivedBytes < 0) {
+			if (this->VERBOSE) printf("[%s] recv() failed, errno = %d\n", this->CLIENT_NAME.c_str(), errno);
+			return -1;
+		}
+
+		return receivedBytes;
+	}
+
+	int BriandIDFSocketClient::ReadInto(unsigned char* buffer, const size_t& size) {
+		if (buffer == nullptr || size == 0) return 0;
+
+		// Bytes already in the read-ahead buffer come first
+		size_t buffered = this->readAheadEnd - this->readAheadStart;
+		if (buffered > 0) {
+			size_t n = (buffered < size ? buffered : size);
+			memcpy(buffer, this->readAheadBuffer.get() + this->readAheadStart, n);
+			this->readAheadStart += n;
+			return static_cast<int>(n);
+		}
+
+		return this->ReadRaw(buffer, size);
+	}
+
+	unique_ptr<vector<unsigned char>> BriandIDFSocketClient::ReadData(bool oneChunk /* = false*/) {
+		auto data = make_unique<vector<unsigned char>>();
+
+		if (!this->CONNECTED) return std::move(data);
+
+		// Read until bytes received or just one chunk requested
+		this->ReadStream([&data, oneChunk](const unsigned char* chunk, const size_t& size) {
+			data->insert(data->end(), chunk, chunk + size);
+			return !oneChunk;
+		});
+
+		if (this->VERBOSE) printf("[%s] Received %d bytes. %s\n", this->CLIENT_NAME.c_str(), data->size(), ((this->AvailableBytes() > 0) ? "More bytes are available." : "No more bytes available."));
+
+		return std::move(data);
+	}
+
+	size_t BriandIDFSocketClient::ReadStream(const BriandIDFStreamSink& sink, const size_t& maxBytes /* = 0 */) {
+		size_t total = 0;
+
+		if (!this->CONNECTED || sink == nullptr) return total;
+
+		// The receiving buffer is allocated once and then reused
+		if (this->recvBuffer == nullptr) this->recvBuffer = MakeCapsBuffer(this->RECV_BUF_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+		if (this->recvBuffer == nullptr) {
+			if (this->VERBOSE) printf("[%s] Out of memory for receiving buffer.\n", this->CLIENT_NAME.c_str());
+			return total;
+		}
+
+		while (maxBytes == 0 || total < maxBytes) {
+			size_t READ_SIZE = this->RECV_BUF_SIZE;
+			if (maxBytes > 0 && maxBytes - total < READ_SIZE)
+				READ_SIZE = maxBytes - total;
+
+			// Waits (poll) then returns what is available, up to READ_SIZE
+			int receivedBytes = this->ReadInto(this->recvBuffer.get(), READ_SIZE);
+			if (receivedBytes <= 0) break;
+
+			total += static_cast<size_t>(receivedBytes);
+
+			if (!sink(this->recvBuffer.get(), static_cast<size_t>(receivedBytes))) {
+				if (this->VERBOSE) printf("[%s] Stream paused by sink after %zu bytes.\n", this->CLIENT_NAME.c_str(), total);
 				break;
 			}
+		}
 
-			if (receivedBytes > 0) {
-				data->insert(data->end(), recvBuffer.get(), recvBuffer.get() + receivedBytes);
-			}
+		return total;
+	}
 
-			// Check if the remainingBytes were less  than or equal the receiving buffer size. If so, we finished.
-			// Removed: truncated response risk!
-			// if (remainingBytes > 0 && remainingBytes <= this->RECV_BUF_SIZE)
-			// 	break;
+	unique_ptr<vector<unsigned char>> BriandIDFSocketClient::ReadDataWithin(const unsigned long& totalTime_ms, bool oneChunk /* = false*/) {
+		uint64_t previousDeadline = this->ioDeadline;
 
-		} while(receivedBytes > 0 && !oneChunk);
+		this->SetDeadline(totalTime_ms);
 
-		if (this->VERBOSE) printf("[%s] Received %d bytes. %s\n", this->CLIENT_NAME.c_str(), data->size(), ((this->AvailableBytes() > 0) ? "More bytes are available." : "No more bytes available."));
+		// Keep the nearest one
+		if (previousDeadline > 0 && previousDeadline < this->ioDeadline) this->ioDeadline = previousDeadline;
+
+		auto data = this->ReadData(oneChunk);
+
+		this->ioDeadline = previousDeadline;
 
 		return std::move(data);
 	}
 
+	size_t BriandIDFSocketClient::FindSequence(const unsigned char* data, const size_t& dataLen, const unsigned char* sequence, const size_t& sequenceLen) {
+		if (sequenceLen == 0 || dataLen < sequenceLen) return dataLen;
+
+		const unsigned char* p = data;
+		const unsigned char* last = data + (dataLen - sequenceLen);
+
+		// memchr() is word/vector optimized by the C library, use it to jump to the next candidate
+		while (p <= last) {
+			p = static_cast<const unsigned char*>(memchr(p, sequence[0], static_cast<size_t>(last - p) + 1));
+			if (p == NULL) break;
+			if (sequenceLen == 1 || memcmp(p + 1, sequence + 1, sequenceLen - 1) == 0) return static_cast<size_t>(p - data);
+			p++;
+		}
+
+		return dataLen;
+	}
+
 	unique_ptr<vector<unsigned char>> BriandIDFSocketClient::ReadDataUntil(const unsigned char& stop, const size_t& limit, bool& found) {
-		auto data = make_unique<vector<unsigned char>>();
+		return this->ReadDataUntil(vector<unsigned char>(1, stop), limit, found);
+	}
 
-		if (!this->CONNECTED) return std::move(data);
+	unique_ptr<vector<unsigned char>> BriandIDFSocketClient::ReadDataUntil(const string& delimiter, const size_t& limit, bool& found) {
+		return this->ReadDataUntil(vector<unsigned char>(delimiter.begin(), delimiter.end()), limit, found);
+	}
 
-		// Read until bytes received or stop char is found, 1 byte per cycle.
-		int receivedBytes;
+	unique_ptr<vector<unsigned char>> BriandIDFSocketClient::ReadDataUntil(const vector<unsigned char>& delimiter, const size_t& limit, bool& found) {
+		auto data = make_unique<vector<unsigned char>>();
 		found = false;
 
-		do {
-			//size_t remainingBytes = this->AvailableBytes();
-
-			// Before blocking socket, perform a select(), if timeout is not specified, a default 10 seconds will be used.
-			fd_set filter;
-			FD_ZERO(&filter);
-			FD_SET(this->_socket, &filter);
-			struct timeval timeout;
-			bzero(&timeout, sizeof(timeout));
-			timeout.tv_usec = 0;
-			timeout.tv_sec = ( this->IO_TIMEOUT_S > 0 ? this->IO_TIMEOUT_S : this->poll_default_timeout_s);
-			int selectResult = select(this->_socket+1, &filter, NULL, NULL, &timeout);
-
-			if (selectResult < 0) {
-				// An error occoured, select() failed.
-				if (this->VERBOSE) printf("[%s] select() failed.\n", this->CLIENT_NAME.c_str());
-				break;
-			}
-			else if (selectResult == 0 && !FD_ISSET(this->_socket, &filter)) {
-				// An timeout occoured
-				if (this->VERBOSE) printf("[%s] select() timed out.\n", this->CLIENT_NAME.c_str());
-				break;
+		if (delimiter.size() == 0) {
+			if (this->VERBOSE) printf("[%s] ReadDataUntil: empty delimiter!\n", this->CLIENT_NAME.c_str());
+			return std::move(data);
+		}
+
+		// The read-ahead buffer is allocated once and then reused
+		if (this->readAheadBuffer == nullptr) {
+			this->readAheadSize = (this->RECV_BUF_SIZE > 0 ? this->RECV_BUF_SIZE : 1);
+			this->readAheadBuffer = MakeCapsBuffer(this->readAheadSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+			this->readAheadStart = 0;
+			this->readAheadEnd = 0;
+			if (this->readAheadBuffer == nullptr) {
+				if (this->VERBOSE) printf("[%s] Out of memory for read-ahead buffer.\n", this->CLIENT_NAME.c_str());
+				this->readAheadSize = 0;
+				return std::move(data);
 			}
-			else if (!FD_ISSET(this->_socket, &filter)) {
-				// No socket on the results!
-				if (this->VERBOSE) printf("[%s] select() error: no timeout but socket not ready.\n", this->CLIENT_NAME.c_str());
-				break;
+		}
+
+		// Read chunks into the read-ahead buffer, move them to data and scan until delimiter found or limit reached.
+		while (data->size() < limit) {
+			if (this->readAheadStart == this->readAheadEnd) {
+				// Refill: one wait and one read for a whole chunk
+				this->readAheadStart = 0;
+				this->readAheadEnd = 0;
+				int receivedBytes = this->ReadRaw(this->readAheadBuffer.get(), this->readAheadSize);
+				if (receivedBytes <= 0) break;
+				this->readAheadEnd = static_cast<size_t>(receivedBytes);
 			}
 
-			if (this->VERBOSE) printf("[%s] select() succeded.\n", this->CLIENT_NAME.c_str());
+			size_t chunk = this->readAheadEnd - this->readAheadStart;
+			if (chunk > limit - data->size()) chunk = limit - data->size();
 
-			unsigned char buffer = 0x00;
-			receivedBytes = recv(this->_socket, &buffer, 1, 0);
+			size_t previousSize = data->size();
+			data->insert(data->end(), this->readAheadBuffer.get() + this->readAheadStart, this->readAheadBuffer.get() + this->readAheadStart + chunk);
 
-			if (receivedBytes == 0) {
-				// If select() succeded but zero bytes are received, then exit / peer disconnected.
-				if (this->VERBOSE) printf("[%s] select() succeded, but zero bytes received. Peer disconnected.\n", this->CLIENT_NAME.c_str());
-				break;
-			}
+			// The delimiter could start in the previous chunk, so scan from delimiter.size()-1 bytes before
+			size_t scanFrom = (previousSize >= delimiter.size() - 1 ? previousSize - (delimiter.size() - 1) : 0);
+			size_t scanLen = data->size() - scanFrom;
+			size_t pos = FindSequence(data->data() + scanFrom, scanLen, delimiter.data(), delimiter.size());
 
-			// If stop char found, stop.
-			if (buffer == stop) {
+			if (pos < scanLen) {
+				// Found: keep data up to delimiter end, leave the following bytes in the read-ahead buffer.
+				size_t keep = scanFrom + pos + delimiter.size();
+				this->readAheadStart += keep - previousSize;
+				data->resize(keep);
 				found = true;
+				break;
 			}
 
-			if (receivedBytes > 0) {
-				data->push_back(buffer);
-			}
-			
-		} while(receivedBytes > 0 && !found && data->size() < limit);
+			this->readAheadStart += chunk;
+		}
 
 		return std::move(data);
 	}
@@ -335,24 +772,43 @@ namespace Briand {
 		size_t bytes_avail = 0;
 
 		if (this->CONNECTED) {
-			// Call a read without buffer (does not download data)
+			// Call a read without buffer (does not download data), without blocking
 			char temp;
-			recv(this->_socket, &temp, 0, 0);
+			recv(this->_socket, &temp, 0, MSG_DONTWAIT);
 			ioctl(this->_socket, FIONREAD, &bytes_avail);
 		}
 			
-		return bytes_avail;
+		return bytes_avail + (this->readAheadEnd - this->readAheadStart);
+	}
+
+	size_t BriandIDFSocketClient::BufferedBytes() {
+		return this->readAheadEnd - this->readAheadStart;
+	}
+
+	string BriandIDFSocketClient::GetLastConnectAddress() {
+		return this->lastConnectAddress;
+	}
+
+	unsigned long BriandIDFSocketClient::GetLastConnectTimeMs() {
+		return this->lastConnectTimeMs;
 	}
 
 	int BriandIDFSocketClient::GetSocketDescriptor() {
 		return this->_socket;
 	}
+
+	unsigned long BriandIDFSocketClient::GetConnectGeneration() {
+		return this->connectGeneration;
+	}
 	
 	size_t BriandIDFSocketClient::GetObjectSize() {
 		size_t oSize = 0;
 
 		oSize += sizeof(*this);
 		oSize += sizeof(this->CLIENT_NAME) + sizeof(char)*this->CLIENT_NAME.size();
+		oSize += (this->recvBuffer != nullptr ? sizeof(unsigned char)*this->RECV_BUF_SIZE : 0);
+		oSize += sizeof(unsigned char)*this->readAheadSize;
+		oSize += sizeof(char)*this->lastConnectAddress.size();
 
 		return oSize;
 	}
@@ -360,6 +816,9 @@ namespace Briand {
 	void BriandIDFSocketClient::PrintObjectSizeInfo() {
 		printf("sizeof(*this) = %zu\n", sizeof(*this));
 		printf("sizeof(this->CLIENT_NAME) + sizeof(char)*this->CLIENT_NAME.size() = %zu\n", sizeof(this->CLIENT_NAME) + sizeof(char)*this->CLIENT_NAME.size());
+		printf("sizeof(unsigned char)*this->RECV_BUF_SIZE (if allocated) = %zu\n", (this->recvBuffer != nullptr ? sizeof(unsigned char)*this->RECV_BUF_SIZE : 0));
+		printf("sizeof(unsigned char)*this->readAheadSize = %zu\n", sizeof(unsigned char)*this->readAheadSize);
+		printf("sizeof(char)*this->lastConnectAddress.size() = %zu\n", sizeof(char)*this->lastConnectAddress.size());
 
 		printf("TOTAL = %zu\n", this->GetObjectSize());
 	}
@@ -0,0 +1,324 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "BriandIDFSocketReactor.hxx"
+
+#include <iostream>
+#include <memory>
+
+using namespace std;
+
+namespace Briand {
+
+	BriandIDFSocketReactor::BriandIDFSocketReactor() {
+		this->VERBOSE = false;
+		this->nextId = 1;
+		this->running = false;
+		this->dispatching = false;
+
+		#if defined(__linux__)
+		this->epollFd = epoll_create1(0);
+		#endif
+	}
+
+	BriandIDFSocketReactor::~BriandIDFSocketReactor() {
+		this->entries.clear();
+
+		#if defined(__linux__)
+		if (this->epollFd >= 0) close(this->epollFd);
+		#endif
+	}
+
+	void BriandIDFSocketReactor::SetVerbose(const bool& verbose) {
+		this->VERBOSE = verbose;
+	}
+
+	void BriandIDFSocketReactor::Register(const int& id, ReactorEntry& entry) {
+		int fd = entry.client->GetSocketDescriptor();
+
+		unsigned long generation = entry.client->GetConnectGeneration();
+
+		#if defined(ESP_PLATFORM)
+		// poll() set is built on each wait
+		entry.fd = fd;
+		entry.generation = generation;
+		#elif defined(__linux__)
+		struct epoll_event ev {};
+		ev.events = 0;
+		if (entry.interest & REACTOR_READABLE) ev.events |= EPOLLIN;
+		if (entry.interest & REACTOR_WRITABLE) ev.events |= EPOLLOUT;
+		ev.data.fd = id;
+
+		// Same connection: interest change only (if the socket has been closed meanwhile, add it again)
+		if (entry.fd >= 0 && entry.fd == fd && entry.generation == generation) {
+			if (epoll_ctl(this->epollFd, EPOLL_CTL_MOD, fd, &ev) == 0) return;
+			if (errno != ENOENT) {
+				if (this->VERBOSE) printf("[REACTOR] Failed to update client #%d, errno = %d\n", id, errno);
+				return;
+			}
+		}
+
+		// New connection (the descriptor number could be the same) or not registered yet
+		this->Unregister(entry);
+
+		if (fd >= 0) {
+			int ret = epoll_ctl(this->epollFd, EPOLL_CTL_ADD, fd, &ev);
+			// Still registered (descriptor reused before the old one has been removed)
+			if (ret != 0 && errno == EEXIST) ret = epoll_ctl(this->epollFd, EPOLL_CTL_MOD, fd, &ev);
+
+			if (ret == 0) {
+				entry.fd = fd;
+				entry.generation = generation;
+			}
+			else {
+				if (this->VERBOSE) printf("[REACTOR] Failed to register client #%d, errno = %d\n", id, errno);
+			}
+		}
+		#endif
+	}
+
+	void BriandIDFSocketReactor::Unregister(ReactorEntry& entry) {
+		#if defined(__linux__)
+		// Fails if socket already closed (automatically removed), no matter.
+		// The descriptor number could already belong to another client's new socket: leave it.
+		bool inUse = false;
+		for (auto& it : this->entries) {
+			if (&it.second != &entry && !it.second.removed && it.second.fd == entry.fd) inUse = true;
+		}
+		if (entry.fd >= 0 && !inUse) epoll_ctl(this->epollFd, EPOLL_CTL_DEL, entry.fd, NULL);
+		#endif
+		entry.fd = -1;
+	}
+
+	bool BriandIDFSocketReactor::Wait(const unsigned long& waitMs, map<int, unsigned char>& events) {
+		#if defined(ESP_PLATFORM)
+		vector<struct pollfd> fds;
+		vector<int> ids;
+
+		for (auto& it : this->entries) {
+			if (it.second.removed || it.second.fd < 0) continue;
+			struct pollfd pfd;
+			pfd.fd = it.second.fd;
+			pfd.events = 0;
+			pfd.revents = 0;
+			if (it.second.interest & REACTOR_READABLE) pfd.events |= POLLIN;
+			if (it.second.interest & REACTOR_WRITABLE) pfd.events |= POLLOUT;
+			fds.push_back(pfd);
+			ids.push_back(it.first);
+		}
+
+		if (fds.size() == 0) {
+			vTaskDelay(waitMs / portTICK_PERIOD_MS);
+			return true;
+		}
+
+		int ready = poll(fds.data(), fds.size(), waitMs);
+		if (ready < 0) {
+			if (errno == EINTR) return true;
+			if (this->VERBOSE) printf("[REACTOR] poll() failed, errno = %d\n", errno);
+			return false;
+		}
+
+		for (size_t i = 0; i < fds.size() && ready > 0; i++) {
+			if (fds[i].revents == 0) continue;
+			unsigned char ev = 0;
+			if (fds[i].revents & POLLIN) ev |= REACTOR_READABLE;
+			if (fds[i].revents & POLLOUT) ev |= REACTOR_WRITABLE;
+			if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) ev |= REACTOR_ERROR;
+			events[ids[i]] |= ev;
+			ready--;
+		}
+		#elif defined(__linux__)
+		const int MAX_EVENTS = 32;
+		struct epoll_event evs[MAX_EVENTS];
+
+		int ready = epoll_wait(this->epollFd, evs, MAX_EVENTS, static_cast<int>(waitMs));
+		if (ready < 0) {
+			if (errno == EINTR) return true;
+			if (this->VERBOSE) printf("[REACTOR] epoll_wait() failed, errno = %d\n", errno);
+			return false;
+		}
+
+		for (int i = 0; i < ready; i++) {
+			unsigned char ev = 0;
+			if (evs[i].events & EPOLLIN) ev |= REACTOR_READABLE;
+			if (evs[i].events & EPOLLOUT) ev |= REACTOR_WRITABLE;
+			if (evs[i].events & (EPOLLERR | EPOLLHUP)) ev |= REACTOR_ERROR;
+			events[evs[i].data.fd] |= ev;
+		}
+		#endif
+
+		return true;
+	}
+
+	int BriandIDFSocketReactor::Add(unique_ptr<BriandIDFSocketClient>& client, const BriandIDFReactorCallback& callback, const unsigned char& interest /* = REACTOR_READABLE */, const unsigned long& timeoutMs /* = 0 */) {
+		if (client == nullptr || !client->IsConnected()) {
+			if (this->VERBOSE) printf("[REACTOR] Client not connected, not added.\n");
+			return -1;
+		}
+
+		int id = this->nextId++;
+
+		ReactorEntry entry;
+		entry.client = std::move(client);
+		entry.callback = callback;
+		entry.interest = interest & (REACTOR_READABLE | REACTOR_WRITABLE);
+		entry.fd = -1;
+		entry.generation = 0;
+		entry.timeoutMs = timeoutMs;
+		entry.lastActivity = esp_timer_get_time();
+		entry.removed = false;
+
+		auto inserted = this->entries.emplace(id, std::move(entry));
+		this->Register(id, inserted.first->second);
+
+		if (this->VERBOSE) printf("[REACTOR] Client #%d added.\n", id);
+
+		return id;
+	}
+
+	unique_ptr<BriandIDFSocketClient> BriandIDFSocketReactor::Remove(const int& id) {
+		auto it = this->entries.find(id);
+		if (it == this->entries.end() || it->second.removed) return nullptr;
+
+		this->Unregister(it->second);
+		auto client = std::move(it->second.client);
+
+		// The callback could be running, erase later
+		if (this->dispatching) it->second.removed = true;
+		else this->entries.erase(it);
+
+		if (this->VERBOSE) printf("[REACTOR] Client #%d removed.\n", id);
+
+		return std::move(client);
+	}
+
+	void BriandIDFSocketReactor::SetInterest(const int& id, const unsigned char& interest) {
+		auto it = this->entries.find(id);
+		if (it == this->entries.end() || it->second.removed) return;
+
+		it->second.interest = interest & (REACTOR_READABLE | REACTOR_WRITABLE);
+		this->Register(id, it->second);
+	}
+
+	int BriandIDFSocketReactor::RunOnce(const unsigned long& maxWaitMs) {
+		map<int, unsigned char> ready;
+		unsigned long waitMs = maxWaitMs;
+		uint64_t now = esp_timer_get_time();
+
+		for (auto& it : this->entries) {
+			ReactorEntry& entry = it.second;
+
+			if (!entry.client->IsConnected()) {
+				ready[it.first] |= REACTOR_ERROR;
+				continue;
+			}
+
+			// Client reconnected: new socket, even with the same descriptor number
+			if (entry.client->GetSocketDescriptor() != entry.fd || entry.client->GetConnectGeneration() != entry.generation) this->Register(it.first, entry);
+
+			// Bytes buffered by the client (read-ahead, TLS records) will not wake up the poller
+			if ((entry.interest & REACTOR_READABLE) && entry.client->BufferedBytes() > 0) {
+				ready[it.first] |= REACTOR_READABLE;
+				waitMs = 0;
+			}
+
+			// Do not wait beyond the nearest timeout
+			if (entry.timeoutMs > 0) {
+				uint64_t expiry = entry.lastActivity + static_cast<uint64_t>(entry.timeoutMs) * 1000;
+				if (expiry <= now) waitMs = 0;
+				else if ((expiry - now) / 1000 + 1 < waitMs) waitMs = (expiry - now) / 1000 + 1;
+			}
+		}
+
+		if (!this->Wait(waitMs, ready)) return -1;
+
+		now = esp_timer_get_time();
+
+		for (auto& it : this->entries) {
+			ReactorEntry& entry = it.second;
+			if (entry.timeoutMs == 0 || ready.find(it.first) != ready.end()) continue;
+			if (now - entry.lastActivity >= static_cast<uint64_t>(entry.timeoutMs) * 1000) ready[it.first] |= REACTOR_TIMEOUT;
+		}
+
+		int dispatched = 0;
+		this->dispatching = true;
+
+		for (auto& ev : ready) {
+			// Callbacks could have removed clients
+			auto it = this->entries.find(ev.first);
+			if (it == this->entries.end() || it->second.removed || ev.second == 0) continue;
+
+			it->second.lastActivity = now;
+			dispatched++;
+
+			if (!it->second.callback(it->second.client.get(), ev.second)) {
+				this->Unregister(it->second);
+				it->second.removed = true;
+				if (this->VERBOSE) printf("[REACTOR] Client #%d released by callback.\n", ev.first);
+			}
+		}
+
+		this->dispatching = false;
+
+		// Cleanup (destroys clients released by callbacks)
+		for (auto it = this->entries.begin(); it != this->entries.end(); ) {
+			if (it->second.removed) it = this->entries.erase(it);
+			else ++it;
+		}
+
+		return dispatched;
+	}
+
+	void BriandIDFSocketReactor::Run(const unsigned long& tickMs /* = 100 */) {
+		this->running = true;
+
+		while (this->running && this->entries.size() > 0) {
+			if (this->RunOnce(tickMs) < 0) {
+				if (this->VERBOSE) printf("[REACTOR] Loop terminated on error.\n");
+				break;
+			}
+		}
+
+		this->running = false;
+	}
+
+	void BriandIDFSocketReactor::Stop() {
+		this->running = false;
+	}
+
+	size_t BriandIDFSocketReactor::GetClientsCount() {
+		return this->entries.size();
+	}
+
+	size_t BriandIDFSocketReactor::GetObjectSize() {
+		size_t oSize = 0;
+
+		oSize += sizeof(*this);
+		for (auto& it : this->entries) {
+			oSize += sizeof(it.first) + sizeof(it.second);
+			if (it.second.client != nullptr) oSize += it.second.client->GetObjectSize();
+		}
+
+		return oSize;
+	}
+
+	void BriandIDFSocketReactor::PrintObjectSizeInfo() {
+		printf("sizeof(*this) = %zu\n", sizeof(*this));
+		printf("this->entries (%zu clients) = %zu\n", this->entries.size(), this->GetObjectSize() - sizeof(*this));
+
+		printf("TOTAL = %zu\n", this->GetObjectSize());
+	}
+}
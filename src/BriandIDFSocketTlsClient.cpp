@@ -17,6 +17,13 @@
 
 #include <iostream>
 #include <memory>
+#include <cstring>
+
+#include <mbedtls/version.h>
+// Record buffer lengths (MBEDTLS_SSL_IN_BUFFER_LEN/MBEDTLS_SSL_OUT_BUFFER_LEN), public up to mbedtls 2.x
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+	#include <mbedtls/ssl_internal.h>
+#endif
 
 using namespace std;
 
@@ -24,9 +31,18 @@ namespace Briand {
 
 	BriandIDFSocketTlsClient::BriandIDFSocketTlsClient() : BriandIDFSocketClient() {
 		this->CLIENT_NAME = string("BriandIDFSocketTlsClient");
-		this->caChainLoaded = false;
-		this->caChainFailed = true;
-		this->min_rsa_key_size = 2048;
+		this->tlsContext = nullptr;
+		this->privateContext = false;
+		this->SESSION_RESUMPTION = false;
+		this->RELEASE_AFTER_HANDSHAKE = false;
+		this->lastHandshakeTimeMs = 0;
+		this->HANDSHAKING = false;
+		this->sessionOffered = false;
+		this->handshakeDeadline = 0;
+		this->handshakeStart = 0;
+		this->handshakeWaitEvents = 0;
+		this->connectPort = 0;
+		this->transport = nullptr;
 
 		// Setup resources
 		this->SetupResources();
@@ -39,10 +55,10 @@ namespace Briand {
 	void BriandIDFSocketTlsClient::SetDefaultSocketOptions() {
 		if (this->CONNECTED) {
 			// Set read and write timeout if requested
-			if (this->IO_TIMEOUT_S > 0) {
+			if (this->IO_TIMEOUT_MS > 0) {
 				struct timeval receiving_timeout;
-				receiving_timeout.tv_sec = this->IO_TIMEOUT_S;
-				receiving_timeout.tv_usec = 0;
+				receiving_timeout.tv_sec = this->IO_TIMEOUT_MS / 1000;
+				receiving_timeout.tv_usec = (this->IO_TIMEOUT_MS % 1000) * 1000;
 				
 				// Set timeout for socket read
 				if (setsockopt(this->_socket, SOL_SOCKET, SO_RCVTIMEO, &receiving_timeout, sizeof(receiving_timeout)) < 0) {
@@ -75,216 +91,437 @@ namespace Briand {
 	}
 
 	void BriandIDFSocketTlsClient::SetupResources() {
-		this->resourcesReady = false;
-
-		// Error checking
-		int ret;
-
-		// Initialize resources needed
+		// Initialize resources needed, RNG and configuration are held by the TLS context
 		mbedtls_net_init( &this->tls_socket );
 		mbedtls_ssl_init( &this->ssl );
-		mbedtls_ssl_config_init( &this->conf );
-		mbedtls_x509_crt_init( &this->cacert );
-		mbedtls_ctr_drbg_init( &this->ctr_drbg );
-
-		// Set a random personalization string
-		for (unsigned char i=0; i<16; i++)
-			personalization_string[i] = static_cast<unsigned char>( esp_random() % 0x100 );
-
-		if (this->VERBOSE) printf("[%s] Initializaing RNG.\n", this->CLIENT_NAME.c_str());
-
-		// Initialize the RNG
-		mbedtls_entropy_init( &entropy );
-		ret = mbedtls_ctr_drbg_seed( &this->ctr_drbg, mbedtls_entropy_func, &this->entropy, const_cast<const unsigned char*>(this->personalization_string), 16);
-		if( ret != 0 )
-		{
-			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
-			if (this->VERBOSE) printf("[%s] Error, failed RNG init: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
-			errBuf.reset();
-			this->ReleaseResources();
-			return;
-		}
-
-		// Certificates will be set by the other methods.
 
 		this->resourcesReady = true;
 	}
 
 	void BriandIDFSocketTlsClient::ReleaseResources() {
-		if (this->CONNECTED) this->Disconnect();
-		this->caChainLoaded = false;
-		this->caChainFailed = true;
+		if (this->CONNECTED || this->HANDSHAKING) this->Disconnect();
 		if (this->resourcesReady) {
 			this->resourcesReady = false;
 			mbedtls_net_free(&this->tls_socket);
 			mbedtls_ssl_free(&this->ssl);
-			mbedtls_ssl_config_free(&this->conf);
-			mbedtls_x509_crt_free(&this->cacert);
-			mbedtls_ctr_drbg_free(&this->ctr_drbg);
-			mbedtls_entropy_free(&this->entropy);
-		}	
+		}
+		this->setupContext.reset();
+		// A private context is dropped (as its CA chain), a shared one stays attached
+		if (this->privateContext) {
+			this->privateContext = false;
+			this->tlsContext.reset();
+		}
 		this->_socket = -1;
 	}
 
+	BriandIDFTlsContext* BriandIDFSocketTlsClient::GetPrivateContext(const bool& keepCAChain /* = true */) {
+		// A context already used by a connection cannot change: configuration changes start a new one
+		if (this->tlsContext == nullptr || !this->privateContext || this->tlsContext->IsLocked()) {
+			if (this->VERBOSE) printf("[%s] Initializaing RNG.\n", this->CLIENT_NAME.c_str());
+			shared_ptr<BriandIDFTlsContext> previous = this->tlsContext;
+			this->tlsContext = make_shared<BriandIDFTlsContext>();
+			this->tlsContext->SetVerbose(this->VERBOSE);
+			this->privateContext = true;
+
+			// Same configuration as before (CA chain, pins, profile...), otherwise the next connection could be INSECURE
+			if (previous != nullptr) {
+				bool copied = this->tlsContext->CopyConfiguration(*previous, keepCAChain);
+				if (keepCAChain && previous->IsVerifying() && (!copied || !this->tlsContext->IsVerifying() || this->tlsContext->IsCAChainFailed())) {
+					if (this->VERBOSE) printf("[%s] Error! TLS configuration not copied to the new context, connections will fail.\n", this->CLIENT_NAME.c_str());
+				}
+			}
+		}
+
+		return this->tlsContext.get();
+	}
+
+	void BriandIDFSocketTlsClient::SetTlsContext(const shared_ptr<BriandIDFTlsContext>& context) {
+		if (context == this->tlsContext) return;
+		if (this->CONNECTED || this->HANDSHAKING) this->Disconnect();
+		this->tlsContext = context;
+		this->privateContext = false;
+	}
+
+	shared_ptr<BriandIDFTlsContext> BriandIDFSocketTlsClient::GetTlsContext() {
+		return this->tlsContext;
+	}
+
 	void BriandIDFSocketTlsClient::SetTimeout(const unsigned short& connectTimeout_s, const unsigned short& ioTimeout_s) {
-		this->CONNECT_TIMEOUT_S = connectTimeout_s;
-		this->IO_TIMEOUT_S = ioTimeout_s;
+		// Timeouts are applied by BioSend()/BioRecv() with poll()
+		this->SetTimeoutMs(static_cast<unsigned long>(connectTimeout_s) * 1000, static_cast<unsigned long>(ioTimeout_s) * 1000);
+	}
+
+	int BriandIDFSocketTlsClient::WaitSocket(const short& events) {
+		if (this->transport == nullptr) return BriandIDFSocketClient::WaitSocket(events);
+
+		// Same timeout and deadline as the socket
+		uint64_t waitMs = (this->IO_TIMEOUT_MS > 0 ? this->IO_TIMEOUT_MS : this->poll_default_timeout_ms);
+		if (this->ioDeadline > 0) {
+			uint64_t now = esp_timer_get_time();
+			if (now >= this->ioDeadline) {
+				if (this->VERBOSE) printf("[%s] Deadline reached.\n", this->CLIENT_NAME.c_str());
+				return 0;
+			}
+			uint64_t remainingMs = (this->ioDeadline - now + 999) / 1000;
+			if (remainingMs < waitMs) waitMs = remainingMs;
+		}
+
+		int ret = this->transport->Wait(events, static_cast<unsigned long>(waitMs));
+		if (ret == 0 && this->VERBOSE) printf("[%s] Transport wait timed out.\n", this->CLIENT_NAME.c_str());
 
-		// Better implementation with SetDefaultSocketOptions()
-		// if (this->resourcesReady && this-IO_TIMEOUT_S > 0) {
-		// 	mbedtls_ssl_conf_read_timeout(&this->conf, this->IO_TIMEOUT_S*1000);
-		// }
+		return ret;
+	}
+
+	int BriandIDFSocketTlsClient::BioSend(void* ctx, const unsigned char* buf, size_t len) {
+		auto client = reinterpret_cast<BriandIDFSocketTlsClient*>(ctx);
+
+		if (client->transport != nullptr) {
+			while (true) {
+				int ret = client->transport->Send(buf, len);
+				if (ret >= 0) return ret;
+				if (ret != BriandIDFTlsTransport::WOULD_BLOCK) return MBEDTLS_ERR_NET_SEND_FAILED;
+				// During the handshake the caller waits
+				if (client->HANDSHAKING) return MBEDTLS_ERR_SSL_WANT_WRITE;
+				int ready = client->WaitSocket(POLLOUT);
+				if (ready == 0) return MBEDTLS_ERR_SSL_TIMEOUT;
+				if (ready < 0) return MBEDTLS_ERR_NET_SEND_FAILED;
+			}
+		}
+
+		if (client->_socket < 0) return MBEDTLS_ERR_NET_INVALID_CONTEXT;
+
+		// With a deadline, do not block in send() beyond it (during the handshake the socket is non-blocking)
+		if (client->ioDeadline > 0 && !client->HANDSHAKING) {
+			int ready = client->WaitSocket(POLLOUT);
+			if (ready == 0) return MBEDTLS_ERR_SSL_TIMEOUT;
+			if (ready < 0) return MBEDTLS_ERR_NET_SEND_FAILED;
+		}
+
+		int ret;
+		do {
+			ret = send(client->_socket, buf, len, MSG_NOSIGNAL);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return MBEDTLS_ERR_SSL_WANT_WRITE;
+			if (errno == EPIPE || errno == ECONNRESET) return MBEDTLS_ERR_NET_CONN_RESET;
+			return MBEDTLS_ERR_NET_SEND_FAILED;
+		}
+
+		return ret;
+	}
+
+	int BriandIDFSocketTlsClient::BioRecv(void* ctx, unsigned char* buf, size_t len) {
+		auto client = reinterpret_cast<BriandIDFSocketTlsClient*>(ctx);
+
+		if (client->transport == nullptr && client->_socket < 0) return MBEDTLS_ERR_NET_INVALID_CONTEXT;
+
+		// During the handshake the socket is non-blocking, the caller waits
+		if (!client->HANDSHAKING) {
+			int ready = client->WaitSocket(POLLIN);
+			if (ready == 0) return MBEDTLS_ERR_SSL_TIMEOUT;
+			if (ready < 0) return MBEDTLS_ERR_NET_RECV_FAILED;
+		}
+
+		if (client->transport != nullptr) {
+			int ret = client->transport->Recv(buf, len);
+			if (ret == BriandIDFTlsTransport::WOULD_BLOCK) return MBEDTLS_ERR_SSL_WANT_READ;
+			return (ret < 0 ? MBEDTLS_ERR_NET_RECV_FAILED : ret);
+		}
+
+		int ret;
+		do {
+			ret = recv(client->_socket, buf, len, 0);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return MBEDTLS_ERR_SSL_WANT_READ;
+			if (errno == EPIPE || errno == ECONNRESET) return MBEDTLS_ERR_NET_CONN_RESET;
+			return MBEDTLS_ERR_NET_RECV_FAILED;
+		}
+
+		return ret;
+	}
+
+	void BriandIDFSocketTlsClient::SetSessionResumption(const bool& enable) {
+		this->SESSION_RESUMPTION = enable;
+	}
+
+	void BriandIDFSocketTlsClient::SetTlsProfile(const string& profile) {
+		if (!this->GetPrivateContext()->SetProfile(profile)) {
+			if (this->VERBOSE) printf("[%s] Warning! Failed to set TLS profile %s.\n", this->CLIENT_NAME.c_str(), profile.c_str());
+		}
+	}
+
+	string BriandIDFSocketTlsClient::GetCipherSuite() {
+		if (!this->CONNECTED) return string("");
+		return string(mbedtls_ssl_get_ciphersuite(&this->ssl));
+	}
+
+	void BriandIDFSocketTlsClient::SetReleaseAfterHandshake(const bool& enable) {
+		this->RELEASE_AFTER_HANDSHAKE = enable;
+	}
+
+	unsigned long BriandIDFSocketTlsClient::GetLastHandshakeTimeMs() {
+		return this->lastHandshakeTimeMs;
 	}
 
 	void BriandIDFSocketTlsClient::SetMinRsaKeySize(const unsigned short& keySize) {
-		this->min_rsa_key_size = keySize;
+		this->GetPrivateContext()->SetMinRsaKeySize(keySize);
 	}
 
 	void BriandIDFSocketTlsClient::SetCACertificateChainPEM(const string& pemCAcertificate) {
-		if (!this->resourcesReady) SetupResources();
-		this->caChainLoaded = true;
-
-		// PEM: must be null terminated, could be multiple at once
-		// The size passed must include the null-terminating char
-		unsigned long int CERT_SIZE = pemCAcertificate.length() + 1;
-		int ret = mbedtls_x509_crt_parse(&this->cacert, reinterpret_cast<const unsigned char*>(pemCAcertificate.c_str()), CERT_SIZE);
-		if( ret < 0 )
-		{
-			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
-			if (this->VERBOSE) printf("[%s] Warning! Failed to parse CA chain PEM certificate: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
-			errBuf.reset();
-			//if (this->VERBOSE) printf("[%s] Warning! INSECURE mode (no verify) will be used.\n", this->CLIENT_NAME.c_str());
-			this->caChainFailed = true;
-		}
-		else {
-			this->caChainFailed = false;
+		if (!this->GetPrivateContext(false)->SetCACertificateChainPEM(pemCAcertificate)) {
+			if (this->VERBOSE) printf("[%s] Warning! Failed to set CA chain PEM certificate.\n", this->CLIENT_NAME.c_str());
 		}
 	}
 
 	void BriandIDFSocketTlsClient::AddCACertificateToChainDER(const vector<unsigned char>& derCAcertificate) {
-		if (!this->resourcesReady) SetupResources();
-		this->caChainLoaded = true;
+		if (!this->GetPrivateContext(false)->AddCACertificateToChainDER(derCAcertificate)) {
+			if (this->VERBOSE) printf("[%s] Warning! Failed to add CA chain DER certificate.\n", this->CLIENT_NAME.c_str());
+		}
+	}
 
-		// DER: must be JUST ONE!
+	void BriandIDFSocketTlsClient::AddCACertificateToChainDERNoCopy(const unsigned char* derCAcertificate, const size_t& size) {
+		if (!this->GetPrivateContext(false)->AddCACertificateToChainDERNoCopy(derCAcertificate, size)) {
+			if (this->VERBOSE) printf("[%s] Warning! Failed to add CA chain DER certificate (no copy).\n", this->CLIENT_NAME.c_str());
+		}
+	}
 
-		int ret = mbedtls_x509_crt_parse(&this->cacert, reinterpret_cast<const unsigned char*>(derCAcertificate.data()), derCAcertificate.size());
-		if( ret < 0 )
-		{
-			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
-			if (this->VERBOSE) printf("[%s] Warning! Failed to parse CA chain DER certificate: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
-			errBuf.reset();
-			//if (this->VERBOSE) printf("[%s] Warning! INSECURE mode (no verify) will be used.\n", this->CLIENT_NAME.c_str());
-			this->caChainFailed = true;
+	void BriandIDFSocketTlsClient::AddPublicKeyPin(const vector<unsigned char>& spkiSha256) {
+		if (!this->GetPrivateContext()->AddPublicKeyPin(spkiSha256)) {
+			if (this->VERBOSE) printf("[%s] Warning! Failed to add public key pin.\n", this->CLIENT_NAME.c_str());
 		}
-		else {
-			this->caChainFailed = false;
+	}
+
+	void BriandIDFSocketTlsClient::AddPublicKeyPinBase64(const string& spkiSha256Base64) {
+		if (!this->GetPrivateContext()->AddPublicKeyPinBase64(spkiSha256Base64)) {
+			if (this->VERBOSE) printf("[%s] Warning! Failed to add public key pin.\n", this->CLIENT_NAME.c_str());
+		}
+	}
+
+	void BriandIDFSocketTlsClient::ReleaseVerificationMaterial() {
+		// Before mbedtls 2.18 (ESP-IDF 4.x ships 2.16) there is no MBEDTLS_SSL_KEEP_PEER_CERTIFICATE option, the chain is always kept
+		#if defined(MBEDTLS_SSL_KEEP_PEER_CERTIFICATE) || (defined(MBEDTLS_X509_CRT_PARSE_C) && MBEDTLS_VERSION_NUMBER < 0x02120000)
+		// The session keeps the whole parsed server chain, only needed by mbedtls_ssl_get_peer_cert() and renegotiation
+		if (this->ssl.session != NULL && this->ssl.session->peer_cert != NULL) {
+			mbedtls_x509_crt_free(this->ssl.session->peer_cert);
+			mbedtls_free(this->ssl.session->peer_cert);
+			this->ssl.session->peer_cert = NULL;
+		}
+		#endif
+
+		// A shared context could be in use by other handshakes
+		if (this->privateContext && this->tlsContext->IsVerifying()) {
+			if (!this->tlsContext->ReleaseCAChain() && this->VERBOSE) printf("[%s] CA chain kept (not parsed with no copy).\n", this->CLIENT_NAME.c_str());
 		}
 	}
 
 	bool BriandIDFSocketTlsClient::Connect(const struct addrinfo& address, const short& port) {
-		string hostIp("");
-
-		// Using mbedtls_net_connect ip or address does not matter. So translate the struct to IP and go.
-		unique_ptr<char[]> ipBuf = nullptr;
-		switch (address.ai_addr->sa_family) {
-			case AF_INET:
-				ipBuf = make_unique<char[]>(INET_ADDRSTRLEN);
-				inet_ntop(AF_INET, &(((struct sockaddr_in *)address.ai_addr)->sin_addr), ipBuf.get(), INET_ADDRSTRLEN);
-				hostIp = string(ipBuf.get());
-				ipBuf.reset();
-				break;
-			case AF_INET6:
-				ipBuf = make_unique<char[]>(INET6_ADDRSTRLEN);
-				inet_ntop(AF_INET, &(((struct sockaddr_in *)address.ai_addr)->sin_addr), ipBuf.get(), INET6_ADDRSTRLEN);
-				hostIp = string(ipBuf.get());
-				ipBuf.reset();
-				break;
-			default:
-				break;
+		return this->Connect(address, port, string(""));
+	}
+
+	bool BriandIDFSocketTlsClient::Connect(const struct addrinfo& address, const short& port, const string& serverName) {
+		return this->ConnectStart(address, port, serverName) && this->CompleteHandshake();
+	}
+
+	bool BriandIDFSocketTlsClient::Connect(const string& host, const short& port) {
+		return this->ConnectStart(host, port) && this->CompleteHandshake();
+	}
+
+	bool BriandIDFSocketTlsClient::Connect(unique_ptr<BriandIDFTlsTransport>& transport, const string& serverName) {
+		return this->ConnectStart(transport, serverName) && this->CompleteHandshake();
+	}
+
+	bool BriandIDFSocketTlsClient::CompleteHandshake() {
+		// Drive the handshake, waiting on the socket until the connection deadline
+		int ret;
+		while ((ret = this->ConnectStep()) == 0) {
+			uint64_t now = esp_timer_get_time();
+			int waitMs = (this->handshakeDeadline > now ? static_cast<int>((this->handshakeDeadline - now + 999) / 1000) : 0);
+
+			if (this->transport != nullptr) {
+				if (this->transport->Wait(this->ConnectWaitEvents(), static_cast<unsigned long>(waitMs)) < 0) {
+					if (this->VERBOSE) printf("[%s] Transport failed during handshake.\n", this->CLIENT_NAME.c_str());
+					this->Disconnect();
+					return false;
+				}
+				continue;
+			}
+
+			struct pollfd pfd;
+			pfd.fd = this->_socket;
+			pfd.events = this->ConnectWaitEvents();
+			pfd.revents = 0;
+
+			if (poll(&pfd, 1, waitMs) < 0 && errno != EINTR) {
+				if (this->VERBOSE) printf("[%s] poll() failed during handshake, errno = %d\n", this->CLIENT_NAME.c_str(), errno);
+				this->Disconnect();
+				return false;
+			}
 		}
 
-		if (hostIp.length() == 0) {
-			if (this->VERBOSE) printf("[%s] Failed to convert IP to string (invalid INET?).\n", this->CLIENT_NAME.c_str());
-			if (this->resourcesReady) this->ReleaseResources();
+		return (ret > 0);
+	}
+
+	bool BriandIDFSocketTlsClient::ConnectStart(const string& host, const short& port) {
+		if (!this->PrepareConnect()) return false;
+
+		if (this->VERBOSE) printf("[%s] Opening connection.\n", this->CLIENT_NAME.c_str());
+
+		// Open socket connection (DNS cache and happy eyeballs from base class), the hostname is kept for SNI
+		if (!this->OpenSocket(host, port)) {
+			if (this->VERBOSE) printf("[%s] Failed to connect socket.\n", this->CLIENT_NAME.c_str());
+			this->Disconnect();
 			return false;
 		}
 
-		return this->Connect(hostIp, port);
+		return this->StartHandshake(host, port);
 	}
 
-	bool BriandIDFSocketTlsClient::Connect(const string& host, const short& port) {
+	bool BriandIDFSocketTlsClient::ConnectStart(const struct addrinfo& address, const short& port, const string& serverName) {
+		if (address.ai_addr == NULL || (address.ai_family != AF_INET && address.ai_family != AF_INET6) || address.ai_addrlen > sizeof(struct sockaddr_storage)) {
+			if (this->VERBOSE) printf("[%s] Invalid address (AF_INET or AF_INET6 required).\n", this->CLIENT_NAME.c_str());
+			if (this->CONNECTED || this->HANDSHAKING) this->Disconnect();
+			return false;
+		}
+
+		// Copy the address to set the port, no name resolution
+		struct sockaddr_storage sockAddress;
+		memcpy(&sockAddress, address.ai_addr, address.ai_addrlen);
+		if (address.ai_family == AF_INET6)
+			reinterpret_cast<struct sockaddr_in6*>(&sockAddress)->sin6_port = htons(port);
+		else
+			reinterpret_cast<struct sockaddr_in*>(&sockAddress)->sin_port = htons(port);
+
+		struct addrinfo info;
+		bzero(&info, sizeof(info));
+		info.ai_family = address.ai_family;
+		info.ai_socktype = SOCK_STREAM;
+		info.ai_addrlen = address.ai_addrlen;
+		info.ai_addr = reinterpret_cast<struct sockaddr*>(&sockAddress);
+
+		// Without a server name the address itself is used (certificate must be issued for the IP)
+		string hostName(serverName);
+		if (hostName.length() == 0) {
+			char ipBuf[INET6_ADDRSTRLEN] = { 0 };
+			if (address.ai_family == AF_INET6)
+				inet_ntop(AF_INET6, &(reinterpret_cast<struct sockaddr_in6*>(&sockAddress)->sin6_addr), ipBuf, INET6_ADDRSTRLEN);
+			else
+				inet_ntop(AF_INET, &(reinterpret_cast<struct sockaddr_in*>(&sockAddress)->sin_addr), ipBuf, INET6_ADDRSTRLEN);
+			hostName = string(ipBuf);
+		}
+
+		if (!this->PrepareConnect()) return false;
+
+		if (this->VERBOSE) printf("[%s] Opening connection to %s.\n", this->CLIENT_NAME.c_str(), hostName.c_str());
+
+		if (!this->OpenSocket(vector<const struct addrinfo*>(1, &info))) {
+			if (this->VERBOSE) printf("[%s] Failed to connect socket.\n", this->CLIENT_NAME.c_str());
+			this->Disconnect();
+			return false;
+		}
+
+		return this->StartHandshake(hostName, port);
+	}
+
+	bool BriandIDFSocketTlsClient::ConnectStart(unique_ptr<BriandIDFTlsTransport>& transport, const string& serverName) {
+		// Ownership is taken in any case, the transport is closed on failure
+		unique_ptr<BriandIDFTlsTransport> newTransport = std::move(transport);
+
+		if (newTransport == nullptr || !newTransport->IsOpen()) {
+			if (this->VERBOSE) printf("[%s] Transport not open.\n", this->CLIENT_NAME.c_str());
+			if (this->CONNECTED || this->HANDSHAKING) this->Disconnect();
+			return false;
+		}
+
+		if (!this->PrepareConnect()) return false;
+
+		if (this->VERBOSE) printf("[%s] Opening connection to %s over transport.\n", this->CLIENT_NAME.c_str(), serverName.c_str());
+
+		this->transport = std::move(newTransport);
+		this->_socket = this->transport->GetDescriptor();
+		this->connectGeneration++;
+
+		return this->StartHandshake(serverName, 0);
+	}
+
+	uint64_t BriandIDFSocketTlsClient::GetConnectDeadline(const uint64_t& startTime) {
+		// Time spent in DNS lookup and TCP connect is taken out of the handshake
+		if (this->handshakeDeadline > 0) return this->handshakeDeadline;
+		return BriandIDFSocketClient::GetConnectDeadline(startTime);
+	}
+
+	bool BriandIDFSocketTlsClient::PrepareConnect() {
 		// If previous connection is in progress, close it.
-		if (this->CONNECTED) {
+		if (this->CONNECTED || this->HANDSHAKING) {
 			this->Disconnect();
 		}
 
+		// Private context (RNG seeding) if none attached
+		if (this->tlsContext == nullptr) this->GetPrivateContext();
+
 		// If CA chain loaded but failed, return false.
-		if (this->caChainLoaded && this->caChainFailed) {
+		if (this->tlsContext->IsCAChainFailed()) {
 			if (this->VERBOSE) printf("[%s] SSL certificate chain loaded but FAILED.\n", this->CLIENT_NAME.c_str());
-			this->ReleaseResources();
+			return false;
+		}
+
+		// Configuration (locks the context)
+		if (this->tlsContext->GetConfig() == nullptr) {
+			if (this->VERBOSE) printf("[%s] TLS context not usable (RNG init failed).\n", this->CLIENT_NAME.c_str());
 			return false;
 		}
 
 		if (!this->resourcesReady) SetupResources();
 
+		// Discard any byte left from a previous connection
+		this->readAheadStart = 0;
+		this->readAheadEnd = 0;
+
+		// Hard deadline for the whole connection (TCP connect and handshake), never beyond the I/O deadline if set
+		uint64_t connectStart = esp_timer_get_time();
+		this->handshakeDeadline = connectStart + static_cast<uint64_t>(this->CONNECT_TIMEOUT_MS > 0 ? this->CONNECT_TIMEOUT_MS : this->poll_default_timeout_ms) * 1000;
+		if (this->ioDeadline > 0 && this->ioDeadline < this->handshakeDeadline) this->handshakeDeadline = this->ioDeadline;
+
+		return true;
+	}
+
+	bool BriandIDFSocketTlsClient::StartHandshake(const string& host, const short& port) {
 		// Error management
 		int ret;
 
-		if (this->VERBOSE) printf("[%s] Opening connection.\n", this->CLIENT_NAME.c_str());
-
-		// Open socket connection
-		ret = mbedtls_net_connect(&this->tls_socket, host.c_str(), std::to_string(port).c_str(), MBEDTLS_NET_PROTO_TCP); 
-		if (ret != 0) {
-			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
-			if (this->VERBOSE) printf("[%s] Failed to allocate socket: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
-			errBuf.reset();
-			this->ReleaseResources();
-			return false;
-		}
+		const mbedtls_ssl_config* conf = this->tlsContext->GetConfig();
+		// With a transport, the descriptor (if any) belongs to the transport
+		this->tls_socket.fd = (this->transport != nullptr ? -1 : this->_socket);
 
 		if (this->VERBOSE) printf("[%s] Socket ready, configuring SSL.\n", this->CLIENT_NAME.c_str());
 
-		// Default configuration
-		ret = mbedtls_ssl_config_defaults(&this->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
-		if (ret != 0) {
-			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
-			if (this->VERBOSE) printf("[%s] Failed to setup SSL socket: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
-			errBuf.reset();
-			this->ReleaseResources();
-			return false;
-		}
+		// Configuration defaults, security mode and RNG come with the TLS context
+		if (this->VERBOSE) printf("[%s] %s\n", this->CLIENT_NAME.c_str(), (this->tlsContext->IsVerifying() ? "SSL peer verification set." : "SSL with INSECURE mode set."));
 
-		// Handshake timeout
-		// Not working, gives linker error!
-		// mbedtls_ssl_conf_handshake_timeout(&this->conf, 1000, this->CONNECT_TIMEOUT_S*1000);
-
-		// Set the security mode
-		if (this->caChainLoaded && !this->caChainFailed) {
-			mbedtls_ssl_conf_authmode(&this->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-			mbedtls_ssl_conf_ca_chain(&this->conf, &this->cacert, NULL);
-			mbedtls_ssl_conf_rng(&this->conf, mbedtls_ctr_drbg_random, &this->ctr_drbg );
-			if (this->VERBOSE) printf("[%s] SSL certificate chain loaded.\n", this->CLIENT_NAME.c_str());
+		// Setup. With the same TLS context (warm reconnect) the SSL context and its buffers are just reset.
+		if (this->setupContext != nullptr && this->setupContext == this->tlsContext) {
+			ret = mbedtls_ssl_session_reset(&this->ssl);
 		}
 		else {
-			mbedtls_ssl_conf_authmode(&this->conf, MBEDTLS_SSL_VERIFY_NONE);
-			//mbedtls_ssl_conf_ca_chain(&this->conf, &this->cacert, NULL);
-			mbedtls_ssl_conf_rng(&this->conf, mbedtls_ctr_drbg_random, &this->ctr_drbg );
-			if (this->VERBOSE) printf("[%s] SSL with INSECURE mode set.\n", this->CLIENT_NAME.c_str());
+			if (this->setupContext != nullptr) {
+				mbedtls_ssl_free(&this->ssl);
+				mbedtls_ssl_init(&this->ssl);
+			}
+			ret = mbedtls_ssl_setup(&this->ssl, conf);
+			this->setupContext = this->tlsContext;
 		}
-
-		// Setup 
-		ret = mbedtls_ssl_setup(&this->ssl, &this->conf);
 		if (ret != 0) {
 			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
 			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
 			if (this->VERBOSE) printf("[%s] Failed to setup SSL configuration: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
 			errBuf.reset();
-			this->ReleaseResources();
+			// Start from scratch next time
+			mbedtls_ssl_free(&this->ssl);
+			mbedtls_ssl_init(&this->ssl);
+			this->setupContext.reset();
+			this->Disconnect();
 			return false;
 		}
 		ret = mbedtls_ssl_set_hostname(&this->ssl, host.c_str());
@@ -293,50 +530,100 @@ namespace Briand {
 			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
 			if (this->VERBOSE) printf("[%s] Failed to setup SSL hostname: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
 			errBuf.reset();
-			this->ReleaseResources();
+			this->Disconnect();
 			return false;
 		}
 
+		// Offer a previous session to skip the full handshake
+		this->sessionOffered = false;
+		if (this->SESSION_RESUMPTION) {
+			this->sessionOffered = BriandIDFTlsSessionCache::GetInstance()->Load(host, port, &this->ssl, this->tlsContext->GetTrustId());
+		}
+
 		if (this->VERBOSE) printf("[%s] SSL setup done.\n", this->CLIENT_NAME.c_str());
 
 		// Setup the functions that will be used for data read/write. 
-		// Added also timeout with mbedtls_net_recv_timeout
-		if (this->IO_TIMEOUT_S > 0)
-			mbedtls_ssl_set_bio(&this->ssl, &this->tls_socket, mbedtls_net_send, mbedtls_net_recv, mbedtls_net_recv_timeout);
-		else 
-			mbedtls_ssl_set_bio(&this->ssl, &this->tls_socket, mbedtls_net_send, mbedtls_net_recv, NULL);
+		// Timeouts and deadline are handled there with poll() (mbedtls_net_recv_timeout uses select(), limited to FD_SETSIZE)
+		mbedtls_ssl_set_bio(&this->ssl, this, BriandIDFSocketTlsClient::BioSend, BriandIDFSocketTlsClient::BioRecv, NULL);
+
+		// The handshake runs over a non-blocking socket, one step for each ConnectStep() call
+		// (mbedtls_ssl_conf_handshake_timeout() applies to DTLS only, the deadline is checked by ConnectStep())
+		// A transport never blocks in Send()/Recv().
+		int flags = (this->transport != nullptr ? 0 : fcntl(this->_socket, F_GETFL, 0));
+		if (this->transport == nullptr && (flags < 0 || fcntl(this->_socket, F_SETFL, flags | O_NONBLOCK) < 0)) {
+			if (this->VERBOSE) printf("[%s] Failed to set non-blocking socket, errno = %d\n", this->CLIENT_NAME.c_str(), errno);
+			this->Disconnect();
+			return false;
+		}
 
-		// Set timeout (works only with mbedtls_net_recv_timeout on BIO setup!)
-		if (this->IO_TIMEOUT_S > 0)
-			mbedtls_ssl_conf_read_timeout(&this->conf, this->IO_TIMEOUT_S*1000);
+		this->connectHost = host;
+		this->connectPort = port;
+		this->handshakeStart = esp_timer_get_time();
+		this->handshakeWaitEvents = POLLOUT;
+		this->HANDSHAKING = true;
 
 		if (this->VERBOSE) printf("[%s] Performing handshake.\n", this->CLIENT_NAME.c_str());
 
-		// Handshake
-		ret = mbedtls_ssl_handshake(&this->ssl);
-		//if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+		return true;
+	}
+
+	int BriandIDFSocketTlsClient::ConnectStep() {
+		if (this->CONNECTED) return 1;
+		if (!this->HANDSHAKING) return -1;
+
+		if (esp_timer_get_time() >= this->handshakeDeadline) {
+			if (this->VERBOSE) printf("[%s] SSL handshake timed out.\n", this->CLIENT_NAME.c_str());
+			this->HANDSHAKING = false;
+			this->Disconnect();
+			return -1;
+		}
+
+		this->NotifyTraffic();
+
+		// Handshake (goes on as far as possible without blocking)
+		int ret = mbedtls_ssl_handshake(&this->ssl);
+
+		if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+			this->handshakeWaitEvents = POLLIN;
+			return 0;
+		}
+		if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+			this->handshakeWaitEvents = POLLOUT;
+			return 0;
+		}
+
+		this->HANDSHAKING = false;
+		this->lastHandshakeTimeMs = (esp_timer_get_time() - this->handshakeStart) / 1000;
+
 		if (ret != 0) {
 			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
 			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
 			if (this->VERBOSE) printf("[%s] Failed SSL handshake, returned %d: %s\n", this->CLIENT_NAME.c_str(), ret, errBuf.get());
 			errBuf.reset();
-			this->ReleaseResources();
-			return false;
+			// Do not offer again a session that could be the cause
+			if (this->sessionOffered) BriandIDFTlsSessionCache::GetInstance()->Invalidate(this->connectHost, this->connectPort);
+			this->Disconnect();
+			return -1;
 		}
 
-		if (this->VERBOSE) printf("[%s] SSL handshake done.\n", this->CLIENT_NAME.c_str());
+		if (this->VERBOSE) printf("[%s] SSL handshake done in %lu ms%s.\n", this->CLIENT_NAME.c_str(), this->lastHandshakeTimeMs, (this->sessionOffered ? " (session offered)" : ""));
+
+		// Back to blocking mode, reads and writes wait with poll()
+		if (this->transport == nullptr) {
+			int flags = fcntl(this->_socket, F_GETFL, 0);
+			if (flags >= 0) fcntl(this->_socket, F_SETFL, flags & ~O_NONBLOCK);
+		}
 		
 		// Verify certificates, if loaded
-		if (this->caChainLoaded && !this->caChainFailed) {
+		if (this->tlsContext->IsVerifying()) {
 			unsigned long int flags = mbedtls_ssl_get_verify_result(&this->ssl);
 			if (flags != 0) {
 				auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-				mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
 				mbedtls_x509_crt_verify_info(errBuf.get(), this->ERR_BUF_SIZE - 1, "", flags);
 				if (this->VERBOSE) printf("[%s] Certificate validation failed: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
 				errBuf.reset();
-				this->ReleaseResources();
-				return false;
+				this->Disconnect();
+				return -1;
 			}
 			if (this->VERBOSE) printf("[%s] Certificate validation success.\n", this->CLIENT_NAME.c_str());
 		}
@@ -344,43 +631,60 @@ namespace Briand {
 			if (this->VERBOSE) printf("[%s] Certificate are not validated (INSECURE MODE).\n", this->CLIENT_NAME.c_str());
 		}
 
-		if (this->VERBOSE) printf("[%s] SSL connection ready.\n", this->CLIENT_NAME.c_str());
+		// Save the session (new ticket/session ID) for the next connection
+		if (this->SESSION_RESUMPTION) {
+			BriandIDFTlsSessionCache::GetInstance()->Save(this->connectHost, this->connectPort, &this->ssl, this->tlsContext->GetTrustId());
+		}
 
-		this->CONNECTED = true;
+		// Verification done (and session saved with its peer certificate): free what is not needed anymore
+		if (this->RELEASE_AFTER_HANDSHAKE) this->ReleaseVerificationMaterial();
 
-		// Save underlying socket if needed
-		this->_socket = this->tls_socket.fd;
+		if (this->VERBOSE) printf("[%s] SSL connection ready.\n", this->CLIENT_NAME.c_str());
 
 		// Now connected!
 		this->CONNECTED = true;
 
-		// Set socket options
-		this->SetDefaultSocketOptions();
+		// Set socket options (a transport keeps its own)
+		if (this->transport == nullptr) {
+			// Save underlying socket if needed
+			this->_socket = this->tls_socket.fd;
+			this->SetDefaultSocketOptions();
+		}
 
-		return true;
+		return 1;
+	}
+
+	bool BriandIDFSocketTlsClient::IsConnecting() {
+		return this->HANDSHAKING;
+	}
+
+	short BriandIDFSocketTlsClient::ConnectWaitEvents() {
+		return (this->HANDSHAKING ? this->handshakeWaitEvents : 0);
 	}
 
 	void BriandIDFSocketTlsClient::Disconnect() {
+		this->HANDSHAKING = false;
 		if (this->CONNECTED) {
 			this->CONNECTED = false;
 			mbedtls_ssl_close_notify(&this->ssl);
-			this->_socket = -1;
+			this->readAheadStart = 0;
+			this->readAheadEnd = 0;
 			if (this->VERBOSE) printf("[%s] Disconnected.\n", this->CLIENT_NAME.c_str());
 		}
-		// in each case...
-		this->ReleaseResources();
+		// in each case close the socket (or the transport). RNG, configuration and SSL context are kept for the next connection.
+		if (this->transport != nullptr) {
+			this->transport->Close();
+			this->transport.reset();
+		}
+		if (this->resourcesReady) mbedtls_net_free(&this->tls_socket);
+		this->_socket = -1;
 	}
 
-	bool BriandIDFSocketTlsClient::WriteData(const unique_ptr<vector<unsigned char>>& data) {
-		if (!this->CONNECTED) return false;
-
+	int BriandIDFSocketTlsClient::WriteRaw(const unsigned char* buffer, const size_t& size) {
 		// Error management
 		int ret;
 
-		if (data == nullptr || data->size() == 0) {
-			if (this->VERBOSE) printf("[%s] WriteData: no bytes! (nullptr or zero size!).\n", this->CLIENT_NAME.c_str());
-			return false;
-		}
+		this->NotifyTraffic();
 
 		// Poll the connection for writing (NOT NECESSARY)
 		// if (this->VERBOSE) printf("[%s] Polling for write\n", this->CLIENT_NAME.c_str()); 
@@ -389,146 +693,139 @@ namespace Briand {
 		// if (this->VERBOSE) printf("[%s] Poll result: %d\n", this->CLIENT_NAME.c_str(), ret);
 
 		do {
-			ret = mbedtls_ssl_write(&this->ssl, data->data(), data->size());
+			ret = mbedtls_ssl_write(&this->ssl, buffer, size);
+		}
+		while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
 
-			if(ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE ) {
-				auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-				mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
-				if (this->VERBOSE) printf("[%s] Failed to write: %d %x %s\n", this->CLIENT_NAME.c_str(), ret, ret, errBuf.get());
-				errBuf.reset();
-				// Connection must be closed!
-				this->Disconnect();
-				return false;
-			}
+		if (ret < 0) {
+			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
+			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
+			if (this->VERBOSE) printf("[%s] Failed to write: %d %x %s\n", this->CLIENT_NAME.c_str(), ret, ret, errBuf.get());
+			errBuf.reset();
+			// Connection must be closed!
+			this->Disconnect();
+			return -1;
+		}
+
+		return ret;
+	}
+
+	bool BriandIDFSocketTlsClient::WriteV(const struct iovec* iov, const int& iovcnt) {
+		if (!this->CONNECTED) return false;
+
+		if (iov == nullptr || iovcnt <= 0) {
+			if (this->VERBOSE) printf("[%s] WriteV: no buffers! (nullptr or zero count!).\n", this->CLIENT_NAME.c_str());
+			return false;
+		}
+
+		for (int i = 0; i < iovcnt; i++) {
+			if (iov[i].iov_len == 0) continue;
+			if (!this->WriteData(static_cast<const unsigned char*>(iov[i].iov_base), iov[i].iov_len)) return false;
 		}
-		while (ret <= 0);
-			
-		if (this->VERBOSE) printf("[%s] %d bytes written.\n", this->CLIENT_NAME.c_str(), ret);
 
 		return true;
 	}
 
+	int BriandIDFSocketTlsClient::ReadRaw(unsigned char* buffer, const size_t& size) {
+		if (!this->CONNECTED || buffer == nullptr || size == 0) return 0;
+
+		this->NotifyTraffic();
+
+		// Error management
+		int ret;
+
+		do {
+			ret = mbedtls_ssl_read(&this->ssl, buffer, size);
+		} while (ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+		// DEBUG if (this->VERBOSE) printf("[%s] Called ret = %d size to read=%d\n", this->CLIENT_NAME.c_str(), ret, size); 
+
+		if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_WANT_READ) {
+			// Finish because server wants to close or pass to the read (has finished writing us)
+			return 0;
+		}
+		else if (ret == MBEDTLS_ERR_SSL_TIMEOUT) {
+			// Timeout or deadline reached, connection still usable
+			return 0;
+		}
+		else if (ret < 0) {
+			// Error
+			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
+			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
+			if (this->VERBOSE) printf("[%s] Failed to read: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
+			errBuf.reset();
+			// Connection must be closed!
+			this->Disconnect();
+			return -1;
+		}
+
+		// if ret is zero is EOF
+		// if > 0 then bytes!
+		return ret;
+	}
+
 	unique_ptr<vector<unsigned char>> BriandIDFSocketTlsClient::ReadData(bool oneChunk /* = false*/) {
 		auto data = make_unique<vector<unsigned char>>();
 
 		if (!this->CONNECTED) return std::move(data);
 
+		// The receiving buffer is allocated once and then reused
+		if (this->recvBuffer == nullptr) this->recvBuffer = MakeCapsBuffer(this->RECV_BUF_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+		if (this->recvBuffer == nullptr) return std::move(data);
+
 		// Error management
 		int ret;
 
-		// Poll the connection for reading - NOT SOLVING PROBLEM
-		//if (this->VERBOSE) printf("[%s] Polling for read\n", this->CLIENT_NAME.c_str()); 
-		// gives linker undefined reference error
-		//ret = mbedtls_net_poll(&this->tls_socket, MBEDTLS_NET_POLL_READ, this->IO_TIMEOUT_S*1000);
-
-		// polling not solving problem for long delays
-		// pollfd fds;
-		// memset(&fds, 0, sizeof(fds));
-		// fds.fd = this->_socket;
-		// fds.events = POLLRDNORM;
-		// poll(&fds, 1, this->poll_timeout_s*1000);
-		// if (this->VERBOSE) printf("[%s] Poll result: %d flags: %d Bytes avail: %d\n", this->CLIENT_NAME.c_str(), ret, fds.revents, this->AvailableBytes());
-
 		// Read until bytes received or jsut one chunk requested
 		do {
 			// The following seems to resolve the long delay. 
 			// The blocking request for always RECV_BUF_SIZE seems to keep socket blocked until exactly recv_buf_size at most is read.
 			size_t remainingBytes = this->AvailableBytes();
-			int READ_SIZE = this->RECV_BUF_SIZE;
+			size_t READ_SIZE = this->RECV_BUF_SIZE;
 			if (remainingBytes > 0 && remainingBytes < READ_SIZE)
 				READ_SIZE = remainingBytes;
 
-			auto recvBuffer = make_unique<unsigned char[]>(READ_SIZE);
-			ret = mbedtls_ssl_read(&this->ssl, recvBuffer.get(), READ_SIZE);
+			ret = this->ReadInto(this->recvBuffer.get(), READ_SIZE);
 
-			// DEBUG if (this->VERBOSE) printf("[%s] Called ret = %d size to read=%d\n", this->CLIENT_NAME.c_str(), ret, READ_SIZE); 
-			
-			if(ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-				// Wait
-				continue;
-			}
-			else if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_WANT_READ) {
-				// Finish because server wants to close or pass to the read (has finished writing us)
-				break;
-			}
-			else if (ret < 0) {
-				// Error
-				auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-				mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
-				if (this->VERBOSE) printf("[%s] Failed to read: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
-				errBuf.reset();
-				// Connection must be closed!
-				this->Disconnect();
-				return std::move(data);
-			}
+			// Stop on EOF, close notify or error (connection already closed)
+			if (ret <= 0) break;
 
-			// if ret is zero is EOF
-			// if > 0 then bytes!
-			if (ret > 0) data->insert(data->end(), recvBuffer.get(), recvBuffer.get() + ret);
+			data->insert(data->end(), this->recvBuffer.get(), this->recvBuffer.get() + ret);
 
 			// Check if the remainingBytes were less  than or equal the receiving buffer size. If so, we finished.
 			// The condition is good there because MbedTLS has internal buffer!
 			if (remainingBytes > 0 && remainingBytes <= this->RECV_BUF_SIZE)
 				break;
 
-		} while(ret != 0 && !oneChunk);
+		} while(!oneChunk);
 
 		if (this->VERBOSE) printf("[%s] Received %d bytes. %s\n", this->CLIENT_NAME.c_str(), data->size(), ((this->AvailableBytes() > 0) ? "More bytes are available." : "No more bytes available."));
 
 		return std::move(data);
 	}
 
-	unique_ptr<vector<unsigned char>> BriandIDFSocketTlsClient::ReadDataUntil(const unsigned char& stop, const size_t& limit, bool& found) {
-		auto data = make_unique<vector<unsigned char>>();
-
-		if (!this->CONNECTED) return std::move(data);
-
-		// Read until bytes received or stop char is found, 1 byte per cycle.
-		int ret;
-		found = false;
+	bool BriandIDFSocketTlsClient::IsAlive() {
+		if (!this->CONNECTED || (this->transport == nullptr && this->_socket < 0)) return false;
 
-		do {
-			size_t remainingBytes = this->AvailableBytes();
-
-			if (remainingBytes <= 0) {
-				// Error, stop char not found before EOF. 
-				return std::move(data);
-			}
+		// Decrypted bytes already buffered
+		if (this->readAheadStart < this->readAheadEnd || mbedtls_ssl_get_bytes_avail(&this->ssl) > 0) return true;
 
-			unsigned char buffer = 0x00;
-			ret = mbedtls_ssl_read(&this->ssl, &buffer, 1);
-
-			if(ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-				// Wait
-				continue;
-			}
-			else if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_WANT_READ) {
-				// Finish because server wants to close or pass to the read (has finished writing us)
-				break;
-			}
-			else if (ret < 0) {
-				// Error
-				auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
-				mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
-				if (this->VERBOSE) printf("[%s] Failed to read: %s\n", this->CLIENT_NAME.c_str(), errBuf.get());
-				errBuf.reset();
-				// Connection must be closed!
-				this->Disconnect();
-				return std::move(data);
-			}
+		if (this->transport != nullptr) return this->transport->IsOpen();
 
-			// If stop char found, stop.
-			if (buffer == stop) {
-				found = true;
-			}
+		int socketError = 0;
+		socklen_t len = sizeof(socketError);
+		if (getsockopt(this->_socket, SOL_SOCKET, SO_ERROR, &socketError, &len) != 0 || socketError != 0) return false;
 
-			if (ret > 0) {
-				data->push_back(buffer);
-			}
+		// Nothing is expected on an idle connection: a pending record is most likely a close notify
+		unsigned char b;
+		int received = recv(this->_socket, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (received >= 0) return false;
 
-		} while(ret > 0 && !found && data->size() < limit);
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+	}
 
-		return std::move(data);
+	bool BriandIDFSocketTlsClient::IsEncrypted() {
+		return true;
 	}
 
 	size_t BriandIDFSocketTlsClient::AvailableBytes() {
@@ -558,7 +855,33 @@ namespace Briand {
 			bytes_avail = mbedtls_ssl_get_bytes_avail(&this->ssl);
 		}
 		
-		return bytes_avail;
+		return bytes_avail + (this->readAheadEnd - this->readAheadStart);
+	}
+
+	size_t BriandIDFSocketTlsClient::BufferedBytes() {
+		size_t bytes_avail = 0;
+		if (this->CONNECTED) bytes_avail = mbedtls_ssl_get_bytes_avail(&this->ssl);
+		return bytes_avail + (this->readAheadEnd - this->readAheadStart);
+	}
+
+	size_t BriandIDFSocketTlsClient::GetTlsBuffersSize() {
+		// Buffers are allocated by mbedtls_ssl_setup() and kept until the SSL context is freed
+		if (this->setupContext == nullptr) return 0;
+
+		#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+		return this->ssl.in_buf_len + this->ssl.out_buf_len;
+		#else
+		return BriandIDFSocketTlsClient::GetMaxTlsBuffersSize();
+		#endif
+	}
+
+	size_t BriandIDFSocketTlsClient::GetMaxTlsBuffersSize() {
+		#if defined(MBEDTLS_SSL_IN_BUFFER_LEN) && defined(MBEDTLS_SSL_OUT_BUFFER_LEN)
+		return MBEDTLS_SSL_IN_BUFFER_LEN + MBEDTLS_SSL_OUT_BUFFER_LEN;
+		#else
+		// Internal in mbedtls 3.x: record header (13), IV (16), MAC (48) and padding (256) around each content buffer
+		return MBEDTLS_SSL_IN_CONTENT_LEN + MBEDTLS_SSL_OUT_CONTENT_LEN + 2*(13 + 16 + 48 + 256);
+		#endif
 	}
 
 	size_t BriandIDFSocketTlsClient::GetObjectSize() {
@@ -566,7 +889,11 @@ namespace Briand {
 
 		oSize += sizeof(*this);
 		oSize += sizeof(this->CLIENT_NAME) + sizeof(char)*this->CLIENT_NAME.size();
-		oSize += sizeof(this->personalization_string) + sizeof(unsigned char)*16;
+		oSize += (this->privateContext ? this->tlsContext->GetObjectSize() : 0);
+		oSize += this->GetTlsBuffersSize();
+		oSize += (this->transport != nullptr ? this->transport->GetObjectSize() : 0);
+		oSize += (this->recvBuffer != nullptr ? sizeof(unsigned char)*this->RECV_BUF_SIZE : 0);
+		oSize += sizeof(unsigned char)*this->readAheadSize;
 
 		return oSize;
 	}
@@ -574,7 +901,11 @@ namespace Briand {
 	void BriandIDFSocketTlsClient::PrintObjectSizeInfo() {
 		printf("sizeof(*this) = %zu\n", sizeof(*this));
 		printf("sizeof(this->CLIENT_NAME) + sizeof(char)*this->CLIENT_NAME.size() = %zu\n", sizeof(this->CLIENT_NAME) + sizeof(char)*this->CLIENT_NAME.size());
-		printf("sizeof(this->personalization_string) + sizeof(unsigned char)*16 = %zu\n", sizeof(this->personalization_string) + sizeof(unsigned char)*16);
+		printf("this->tlsContext->GetObjectSize() (if private) = %zu\n", (this->privateContext ? this->tlsContext->GetObjectSize() : 0));
+		printf("this->GetTlsBuffersSize() (in + out records) = %zu\n", this->GetTlsBuffersSize());
+		printf("this->transport->GetObjectSize() (if any) = %zu\n", (this->transport != nullptr ? this->transport->GetObjectSize() : 0));
+		printf("sizeof(unsigned char)*this->RECV_BUF_SIZE (if allocated) = %zu\n", (this->recvBuffer != nullptr ? sizeof(unsigned char)*this->RECV_BUF_SIZE : 0));
+		printf("sizeof(unsigned char)*this->readAheadSize = %zu\n", sizeof(unsigned char)*this->readAheadSize);
 
 		printf("TOTAL = %zu\n", this->GetObjectSize());
 	}
@@ -0,0 +1,554 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "BriandIDFTlsContext.hxx"
+
+#include <iostream>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+namespace Briand {
+
+	// Cipher suite and curve profiles. Lists are referenced by the configuration, so they must be static.
+
+	static const int LOW_LATENCY_SUITES[] = {
+		MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+		#if defined(MBEDTLS_CHACHAPOLY_C)
+		MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+		#endif
+		0
+	};
+
+	static const int HW_AES_SUITES[] = {
+		MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+		MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+		MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+		0
+	};
+
+	static const int CHACHA20_SUITES[] = {
+		#if defined(MBEDTLS_CHACHAPOLY_C)
+		MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+		MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+		#endif
+		0
+	};
+
+	// Curves not built into mbedtls would make the handshake fail: only enabled ones are listed
+
+	static const mbedtls_ecp_group_id X25519_FIRST_CURVES[] = {
+		#if defined(MBEDTLS_ECP_DP_CURVE25519_ENABLED)
+		MBEDTLS_ECP_DP_CURVE25519,
+		#endif
+		#if defined(MBEDTLS_ECP_DP_SECP256R1_ENABLED)
+		MBEDTLS_ECP_DP_SECP256R1,
+		#endif
+		MBEDTLS_ECP_DP_NONE
+	};
+
+	static const mbedtls_ecp_group_id P256_FIRST_CURVES[] = {
+		#if defined(MBEDTLS_ECP_DP_SECP256R1_ENABLED)
+		MBEDTLS_ECP_DP_SECP256R1,
+		#endif
+		#if defined(MBEDTLS_ECP_DP_CURVE25519_ENABLED)
+		MBEDTLS_ECP_DP_CURVE25519,
+		#endif
+		#if defined(MBEDTLS_ECP_DP_SECP384R1_ENABLED)
+		MBEDTLS_ECP_DP_SECP384R1,
+		#endif
+		MBEDTLS_ECP_DP_NONE
+	};
+
+	BriandIDFTlsContext::BriandIDFTlsContext() {
+		this->VERBOSE = false;
+		this->caChainLoaded = false;
+		this->caChainFailed = true;
+		this->caChainCopied = false;
+		this->caChainReleased = false;
+		this->ready = false;
+		this->locked = false;
+		this->trustId.fill(0);
+		this->maxFragmentLength = 0;
+		this->profile = string("default");
+
+		// Error checking
+		int ret;
+
+		mbedtls_ssl_config_init( &this->conf );
+		mbedtls_x509_crt_init( &this->cacert );
+		mbedtls_ctr_drbg_init( &this->ctr_drbg );
+		mbedtls_entropy_init( &this->entropy );
+
+		// Default certificate profile, minimum RSA key size 2048 bits
+		this->certProfile = mbedtls_x509_crt_profile_default;
+		this->certProfile.rsa_min_bitlen = 2048;
+
+		// Set a random personalization string
+		for (unsigned char i=0; i<16; i++)
+			personalization_string[i] = static_cast<unsigned char>( esp_random() % 0x100 );
+
+		// Initialize the RNG
+		ret = mbedtls_ctr_drbg_seed( &this->ctr_drbg, mbedtls_entropy_func, &this->entropy, const_cast<const unsigned char*>(this->personalization_string), 16);
+		if (ret != 0) {
+			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
+			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
+			printf("[TLS CONTEXT] Error, failed RNG init: %s\n", errBuf.get());
+			errBuf.reset();
+			return;
+		}
+
+		// Default configuration, done once for every client
+		ret = mbedtls_ssl_config_defaults(&this->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+		if (ret != 0) {
+			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
+			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
+			printf("[TLS CONTEXT] Error, failed SSL configuration defaults: %s\n", errBuf.get());
+			errBuf.reset();
+			return;
+		}
+
+		mbedtls_ssl_conf_rng(&this->conf, BriandIDFTlsContext::Random, this);
+		mbedtls_ssl_conf_cert_profile(&this->conf, &this->certProfile);
+		mbedtls_ssl_conf_authmode(&this->conf, MBEDTLS_SSL_VERIFY_NONE);
+
+		this->ready = true;
+	}
+
+	BriandIDFTlsContext::~BriandIDFTlsContext() {
+		mbedtls_ssl_config_free(&this->conf);
+		mbedtls_x509_crt_free(&this->cacert);
+		mbedtls_ctr_drbg_free(&this->ctr_drbg);
+		mbedtls_entropy_free(&this->entropy);
+	}
+
+	void BriandIDFTlsContext::SetVerbose(const bool& verbose) {
+		this->VERBOSE = verbose;
+	}
+
+	int BriandIDFTlsContext::Random(void* ctx, unsigned char* output, size_t len) {
+		auto context = reinterpret_cast<BriandIDFTlsContext*>(ctx);
+		lock_guard<mutex> lock(context->rngMutex);
+		return mbedtls_ctr_drbg_random(&context->ctr_drbg, output, len);
+	}
+
+	int BriandIDFTlsContext::VerifyPins(void* ctx, mbedtls_x509_crt* crt, int depth, uint32_t* flags) {
+		auto context = reinterpret_cast<BriandIDFTlsContext*>(ctx);
+		bool pinOnly = !context->caChainLoaded;
+
+		// Without CA chain the issuers cannot be trusted anyway: the server key decides, validity (dates...) is still checked
+		if (depth > 0) {
+			if (pinOnly) *flags &= ~static_cast<uint32_t>(MBEDTLS_X509_BADCERT_NOT_TRUSTED);
+			return 0;
+		}
+
+		unsigned char hash[32];
+		if (mbedtls_sha256_ret(crt->pk_raw.p, crt->pk_raw.len, hash, 0) != 0) {
+			*flags |= MBEDTLS_X509_BADCERT_NOT_TRUSTED;
+			return 0;
+		}
+
+		bool found = false;
+		for (const auto& pin : context->publicKeyPins) {
+			if (memcmp(pin.data(), hash, 32) == 0) {
+				found = true;
+				break;
+			}
+		}
+
+		if (!found) {
+			if (context->VERBOSE) printf("[TLS CONTEXT] Server public key not pinned.\n");
+			*flags |= MBEDTLS_X509_BADCERT_NOT_TRUSTED;
+		}
+		else if (pinOnly) {
+			// Trusted by its key: hostname, dates and the other checks still apply
+			*flags &= ~static_cast<uint32_t>(MBEDTLS_X509_BADCERT_NOT_TRUSTED);
+		}
+
+		return 0;
+	}
+
+	bool BriandIDFTlsContext::CheckUnlocked() {
+		lock_guard<mutex> lock(this->configMutex);
+		if (this->locked) {
+			if (this->VERBOSE) printf("[TLS CONTEXT] Context already in use, cannot be changed.\n");
+			return false;
+		}
+
+		return true;
+	}
+
+	bool BriandIDFTlsContext::SetMinRsaKeySize(const unsigned short& keySize) {
+		if (!this->CheckUnlocked()) return false;
+		this->certProfile.rsa_min_bitlen = keySize;
+		return true;
+	}
+
+	bool BriandIDFTlsContext::SetMaxFragmentLength(const unsigned short& length) {
+		if (!this->CheckUnlocked()) return false;
+
+		#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+		unsigned char mfl;
+		switch (length) {
+			case 0: mfl = MBEDTLS_SSL_MAX_FRAG_LEN_NONE; break;
+			case 512: mfl = MBEDTLS_SSL_MAX_FRAG_LEN_512; break;
+			case 1024: mfl = MBEDTLS_SSL_MAX_FRAG_LEN_1024; break;
+			case 2048: mfl = MBEDTLS_SSL_MAX_FRAG_LEN_2048; break;
+			case 4096: mfl = MBEDTLS_SSL_MAX_FRAG_LEN_4096; break;
+			default:
+				if (this->VERBOSE) printf("[TLS CONTEXT] Invalid maximum fragment length %hu (512, 1024, 2048, 4096 or 0).\n", length);
+				return false;
+		}
+
+		if (mbedtls_ssl_conf_max_frag_len(&this->conf, mfl) != 0) return false;
+		this->maxFragmentLength = length;
+
+		return true;
+		#else
+		if (this->VERBOSE) printf("[TLS CONTEXT] Maximum fragment length not supported (MBEDTLS_SSL_MAX_FRAGMENT_LENGTH not defined).\n");
+		return false;
+		#endif
+	}
+
+	unsigned short BriandIDFTlsContext::GetMaxFragmentLength() {
+		return this->maxFragmentLength;
+	}
+
+	bool BriandIDFTlsContext::SetProfile(const string& profile) {
+		if (!this->CheckUnlocked()) return false;
+
+		const int* suites = nullptr;
+		const mbedtls_ecp_group_id* curves = nullptr;
+
+		if (profile.compare("default") == 0) {
+			suites = mbedtls_ssl_list_ciphersuites();
+			curves = mbedtls_ecp_grp_id_list();
+		}
+		else if (profile.compare("low-latency-ecdhe-x25519") == 0) {
+			suites = LOW_LATENCY_SUITES;
+			curves = X25519_FIRST_CURVES;
+		}
+		else if (profile.compare("hw-aes") == 0) {
+			suites = HW_AES_SUITES;
+			curves = P256_FIRST_CURVES;
+		}
+		else if (profile.compare("chacha20") == 0) {
+			suites = CHACHA20_SUITES;
+			curves = X25519_FIRST_CURVES;
+		}
+		else {
+			if (this->VERBOSE) printf("[TLS CONTEXT] Unknown profile %s.\n", profile.c_str());
+			return false;
+		}
+
+		if (suites[0] == 0 || curves[0] == MBEDTLS_ECP_DP_NONE) {
+			if (this->VERBOSE) printf("[TLS CONTEXT] Profile %s not available in this mbedtls build.\n", profile.c_str());
+			return false;
+		}
+
+		mbedtls_ssl_conf_ciphersuites(&this->conf, suites);
+		mbedtls_ssl_conf_curves(&this->conf, curves);
+		this->profile = profile;
+
+		return true;
+	}
+
+	string BriandIDFTlsContext::GetProfile() {
+		return this->profile;
+	}
+
+	vector<string> BriandIDFTlsContext::GetProfileNames() {
+		return vector<string>({ "default", "low-latency-ecdhe-x25519", "hw-aes", "chacha20" });
+	}
+
+	bool BriandIDFTlsContext::SetCACertificateChainPEM(const string& pemCAcertificate) {
+		if (!this->CheckUnlocked()) return false;
+		this->caChainLoaded = true;
+
+		// PEM: must be null terminated, could be multiple at once
+		// The size passed must include the null-terminating char
+		unsigned long int CERT_SIZE = pemCAcertificate.length() + 1;
+		int ret = mbedtls_x509_crt_parse(&this->cacert, reinterpret_cast<const unsigned char*>(pemCAcertificate.c_str()), CERT_SIZE);
+		if (ret < 0) {
+			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
+			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
+			if (this->VERBOSE) printf("[TLS CONTEXT] Warning! Failed to parse CA chain PEM certificate: %s\n", errBuf.get());
+			errBuf.reset();
+			this->caChainFailed = true;
+		}
+		else {
+			this->caChainFailed = false;
+			this->caChainCopied = true;
+		}
+
+		return !this->caChainFailed;
+	}
+
+	bool BriandIDFTlsContext::AddCACertificateToChainDER(const vector<unsigned char>& derCAcertificate) {
+		if (!this->CheckUnlocked()) return false;
+		this->caChainLoaded = true;
+
+		// DER: must be JUST ONE!
+
+		int ret = mbedtls_x509_crt_parse(&this->cacert, reinterpret_cast<const unsigned char*>(derCAcertificate.data()), derCAcertificate.size());
+		if (ret < 0) {
+			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
+			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
+			if (this->VERBOSE) printf("[TLS CONTEXT] Warning! Failed to parse CA chain DER certificate: %s\n", errBuf.get());
+			errBuf.reset();
+			this->caChainFailed = true;
+		}
+		else {
+			this->caChainFailed = false;
+			this->caChainCopied = true;
+		}
+
+		return !this->caChainFailed;
+	}
+
+	bool BriandIDFTlsContext::AddCACertificateToChainDERNoCopy(const unsigned char* derCAcertificate, const size_t& size) {
+		if (!this->CheckUnlocked()) return false;
+		this->caChainLoaded = true;
+
+		// DER: must be JUST ONE! Bytes are referenced, not copied.
+
+		int ret = mbedtls_x509_crt_parse_der_nocopy(&this->cacert, derCAcertificate, size);
+		if (ret < 0) {
+			auto errBuf = make_unique<char[]>(this->ERR_BUF_SIZE);
+			mbedtls_strerror(ret, errBuf.get(), this->ERR_BUF_SIZE - 1);
+			if (this->VERBOSE) printf("[TLS CONTEXT] Warning! Failed to parse CA chain DER certificate (no copy): %s\n", errBuf.get());
+			errBuf.reset();
+			this->caChainFailed = true;
+		}
+		else {
+			this->caChainFailed = false;
+			this->noCopyCertificates.push_back(make_pair(derCAcertificate, size));
+		}
+
+		return !this->caChainFailed;
+	}
+
+	bool BriandIDFTlsContext::AddPublicKeyPin(const vector<unsigned char>& spkiSha256) {
+		if (!this->CheckUnlocked()) return false;
+
+		if (spkiSha256.size() != 32) {
+			if (this->VERBOSE) printf("[TLS CONTEXT] Invalid public key pin: %zu bytes (SHA-256, 32 bytes).\n", spkiSha256.size());
+			return false;
+		}
+
+		array<unsigned char, 32> pin;
+		std::copy(spkiSha256.begin(), spkiSha256.end(), pin.begin());
+		this->publicKeyPins.push_back(pin);
+
+		return true;
+	}
+
+	bool BriandIDFTlsContext::AddPublicKeyPinBase64(const string& spkiSha256Base64) {
+		// 32 bytes, with some room for the decoder
+		vector<unsigned char> pin(48);
+		size_t pinLength = 0;
+
+		int ret = mbedtls_base64_decode(pin.data(), pin.size(), &pinLength, reinterpret_cast<const unsigned char*>(spkiSha256Base64.c_str()), spkiSha256Base64.length());
+		if (ret != 0) {
+			if (this->VERBOSE) printf("[TLS CONTEXT] Invalid public key pin (base64 decode returned %d).\n", ret);
+			return false;
+		}
+		pin.resize(pinLength);
+
+		return this->AddPublicKeyPin(pin);
+	}
+
+	bool BriandIDFTlsContext::CopyConfiguration(BriandIDFTlsContext& source, const bool& withCAChain) {
+		if (!this->CheckUnlocked()) return false;
+
+		bool copied = true;
+
+		this->certProfile.rsa_min_bitlen = source.certProfile.rsa_min_bitlen;
+		if (source.profile.compare(this->profile) != 0) copied = this->SetProfile(source.profile) && copied;
+		if (source.maxFragmentLength != 0) copied = this->SetMaxFragmentLength(source.maxFragmentLength) && copied;
+		this->publicKeyPins.insert(this->publicKeyPins.end(), source.publicKeyPins.begin(), source.publicKeyPins.end());
+
+		if (withCAChain && source.caChainLoaded) {
+			this->caChainLoaded = true;
+			bool chainCopied = true;
+
+			// Certificates without copy from their buffers (the parsed chain could be released), the others from their DER
+			for (const auto& certificate : source.noCopyCertificates) {
+				if (!this->AddCACertificateToChainDERNoCopy(certificate.first, certificate.second)) chainCopied = false;
+			}
+			if (!source.caChainReleased) {
+				for (mbedtls_x509_crt* crt = &source.cacert; crt != NULL; crt = crt->next) {
+					if (crt->raw.p == NULL || !crt->own_buffer) continue;
+					if (!this->AddCACertificateToChainDER(vector<unsigned char>(crt->raw.p, crt->raw.p + crt->raw.len))) chainCopied = false;
+				}
+			}
+
+			// Never less secure than the source: any failure (or a failed source chain) makes the context unusable
+			if (!chainCopied || source.caChainFailed) this->caChainFailed = true;
+			copied = copied && chainCopied;
+		}
+
+		if (!copied && this->VERBOSE) printf("[TLS CONTEXT] Warning! Configuration not completely copied.\n");
+
+		return copied;
+	}
+
+	bool BriandIDFTlsContext::ReleaseCAChain() {
+		lock_guard<mutex> lock(this->configMutex);
+		if (!this->locked) return false;
+		if (this->caChainReleased || !this->caChainLoaded || this->caChainFailed) return true;
+
+		if (this->caChainCopied) {
+			if (this->VERBOSE) printf("[TLS CONTEXT] CA chain has copied certificates, cannot be parsed again: not released.\n");
+			return false;
+		}
+
+		mbedtls_ssl_conf_ca_chain(&this->conf, NULL, NULL);
+		mbedtls_x509_crt_free(&this->cacert);
+		mbedtls_x509_crt_init(&this->cacert);
+		this->caChainReleased = true;
+
+		if (this->VERBOSE) printf("[TLS CONTEXT] CA chain released.\n");
+
+		return true;
+	}
+
+	bool BriandIDFTlsContext::IsUsable() {
+		return this->ready && !this->IsCAChainFailed();
+	}
+
+	bool BriandIDFTlsContext::IsCAChainFailed() {
+		return this->caChainLoaded && this->caChainFailed;
+	}
+
+	bool BriandIDFTlsContext::IsVerifying() {
+		return (this->caChainLoaded && !this->caChainFailed) || !this->publicKeyPins.empty();
+	}
+
+	bool BriandIDFTlsContext::IsLocked() {
+		lock_guard<mutex> lock(this->configMutex);
+		return this->locked;
+	}
+
+	const mbedtls_ssl_config* BriandIDFTlsContext::GetConfig() {
+		// Clients of different tasks could connect at the same time through a shared context: one locks it, the others wait
+		lock_guard<mutex> lock(this->configMutex);
+		if (!this->IsUsable()) return nullptr;
+
+		// Parse again a released chain, from the same buffers
+		if (this->caChainReleased) {
+			for (const auto& certificate : this->noCopyCertificates) {
+				int ret = mbedtls_x509_crt_parse_der_nocopy(&this->cacert, certificate.first, certificate.second);
+				if (ret < 0) {
+					if (this->VERBOSE) printf("[TLS CONTEXT] Failed to parse again the CA chain, returned %d\n", ret);
+					mbedtls_x509_crt_free(&this->cacert);
+					mbedtls_x509_crt_init(&this->cacert);
+					this->caChainFailed = true;
+					return nullptr;
+				}
+			}
+			mbedtls_ssl_conf_ca_chain(&this->conf, &this->cacert, NULL);
+			this->caChainReleased = false;
+		}
+
+		if (!this->locked) {
+			// Set the security mode, once
+			if (this->IsVerifying()) {
+				if (this->caChainLoaded) {
+					mbedtls_ssl_conf_authmode(&this->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+					mbedtls_ssl_conf_ca_chain(&this->conf, &this->cacert, NULL);
+					if (this->VERBOSE) printf("[TLS CONTEXT] SSL certificate chain loaded.\n");
+				}
+				else {
+					// mbedtls requires a CA chain with VERIFY_REQUIRED: the result is checked by the client after the handshake
+					mbedtls_ssl_conf_authmode(&this->conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
+				}
+				if (!this->publicKeyPins.empty()) {
+					mbedtls_ssl_conf_verify(&this->conf, BriandIDFTlsContext::VerifyPins, this);
+					if (this->VERBOSE) printf("[TLS CONTEXT] %zu public key pin(s) set.\n", this->publicKeyPins.size());
+				}
+			}
+			else {
+				mbedtls_ssl_conf_authmode(&this->conf, MBEDTLS_SSL_VERIFY_NONE);
+				if (this->VERBOSE) printf("[TLS CONTEXT] SSL with INSECURE mode set.\n");
+			}
+
+			this->ComputeTrustId();
+			this->locked = true;
+		}
+
+		return &this->conf;
+	}
+
+	void BriandIDFTlsContext::ComputeTrustId() {
+		// Verification mode and minimum RSA key size, then every CA certificate (length and DER) and every pin
+		vector<unsigned char> data;
+		data.push_back(this->IsVerifying() ? 1 : 0);
+		data.push_back(this->caChainLoaded ? 1 : 0);
+		for (int i = 3; i >= 0; i--) data.push_back(static_cast<unsigned char>((this->certProfile.rsa_min_bitlen >> (i*8)) & 0xFF));
+
+		if (this->caChainLoaded) {
+			for (mbedtls_x509_crt* crt = &this->cacert; crt != NULL; crt = crt->next) {
+				if (crt->raw.p == NULL) continue;
+				for (int i = 3; i >= 0; i--) data.push_back(static_cast<unsigned char>((crt->raw.len >> (i*8)) & 0xFF));
+				data.insert(data.end(), crt->raw.p, crt->raw.p + crt->raw.len);
+			}
+		}
+
+		for (const auto& pin : this->publicKeyPins) data.insert(data.end(), pin.begin(), pin.end());
+
+		if (mbedtls_sha256_ret(data.data(), data.size(), this->trustId.data(), 0) != 0) {
+			// Unique anyway: no session will be shared with other contexts
+			this->trustId.fill(0);
+			uintptr_t self = reinterpret_cast<uintptr_t>(this);
+			memcpy(this->trustId.data(), &self, sizeof(self));
+		}
+	}
+
+	const array<unsigned char, 32>& BriandIDFTlsContext::GetTrustId() {
+		return this->trustId;
+	}
+
+	size_t BriandIDFTlsContext::GetObjectSize() {
+		size_t oSize = 0;
+
+		oSize += sizeof(*this);
+		oSize += sizeof(char)*this->profile.size();
+		// Parsed certificates (the raw DER is copied by mbedtls, unless parsed with no copy)
+		if (this->caChainLoaded) {
+			for (mbedtls_x509_crt* crt = &this->cacert; crt != NULL; crt = crt->next) {
+				oSize += (crt != &this->cacert ? sizeof(mbedtls_x509_crt) : 0) + (crt->own_buffer ? crt->raw.len : 0);
+			}
+		}
+		oSize += sizeof(pair<const unsigned char*, size_t>)*this->noCopyCertificates.capacity();
+		oSize += sizeof(array<unsigned char, 32>)*this->publicKeyPins.capacity();
+
+		return oSize;
+	}
+
+	void BriandIDFTlsContext::PrintObjectSizeInfo() {
+		printf("sizeof(*this) = %zu\n", sizeof(*this));
+		printf("CA chain (certificates + copied DER)%s and pins = %zu\n", (this->caChainReleased ? " (released)" : ""), this->GetObjectSize() - sizeof(*this));
+
+		printf("TOTAL = %zu\n", this->GetObjectSize());
+	}
+}
@@ -0,0 +1,186 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "BriandIDFTlsSessionCache.hxx"
+
+#include <iostream>
+#include <memory>
+
+using namespace std;
+
+namespace Briand {
+
+	// Define so it can be initialized with first call to GetInstance()
+	BriandIDFTlsSessionCache* BriandIDFTlsSessionCache::Instance = NULL;
+
+	BriandIDFTlsSessionCache* BriandIDFTlsSessionCache::GetInstance() {
+		// Singleton pattern
+		if (BriandIDFTlsSessionCache::Instance == NULL) {
+			BriandIDFTlsSessionCache::Instance = new BriandIDFTlsSessionCache();
+		}
+
+		return Instance;
+	}
+
+	BriandIDFTlsSessionCache::BriandIDFTlsSessionCache() {
+		this->VERBOSE = false;
+		this->TTL_S = 3600;
+		this->MAX_ENTRIES = 8;
+		this->hits = 0;
+		this->misses = 0;
+	}
+
+	BriandIDFTlsSessionCache::~BriandIDFTlsSessionCache() {
+		this->Clear();
+	}
+
+	void BriandIDFTlsSessionCache::SetVerbose(const bool& verbose) {
+		this->VERBOSE = verbose;
+	}
+
+	void BriandIDFTlsSessionCache::SetTTL(const unsigned long& ttl_s) {
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		this->TTL_S = ttl_s;
+	}
+
+	void BriandIDFTlsSessionCache::SetMaxEntries(const unsigned short& maxEntries) {
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		this->MAX_ENTRIES = (maxEntries > 0 ? maxEntries : 1);
+		while (this->entries.size() > this->MAX_ENTRIES) this->entries.pop_back();
+	}
+
+	string BriandIDFTlsSessionCache::MakeKey(const string& host, const short& port) {
+		return host + ":" + std::to_string(static_cast<unsigned short>(port));
+	}
+
+	bool BriandIDFTlsSessionCache::Load(const string& host, const short& port, mbedtls_ssl_context* ssl, const array<unsigned char, 32>& trustId) {
+		string key = MakeKey(host, port);
+
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		uint64_t now = esp_timer_get_time();
+
+		for (auto it = this->entries.begin(); it != this->entries.end(); ++it) {
+			// Sessions verified with a different CA chain or pins are not resumed (the pin check would be skipped)
+			if (it->key.compare(key) != 0 || it->trustId != trustId) continue;
+
+			if (it->expiresAt <= now) {
+				this->entries.erase(it);
+				break;
+			}
+
+			// The session is copied into the SSL context
+			int ret = mbedtls_ssl_set_session(ssl, it->session.get());
+			if (ret != 0) {
+				if (this->VERBOSE) printf("[TLS SESSION CACHE] Failed to set session for %s, returned %d\n", key.c_str(), ret);
+				this->entries.erase(it);
+				break;
+			}
+
+			// Most recently used goes first
+			this->entries.splice(this->entries.begin(), this->entries, it);
+			this->hits++;
+			if (this->VERBOSE) printf("[TLS SESSION CACHE] Session for %s found in cache.\n", key.c_str());
+			return true;
+		}
+
+		this->misses++;
+		return false;
+	}
+
+	bool BriandIDFTlsSessionCache::Save(const string& host, const short& port, const mbedtls_ssl_context* ssl, const array<unsigned char, 32>& trustId) {
+		string key = MakeKey(host, port);
+
+		// Deep copy (ticket and peer certificate included), freed when the entry is removed
+		shared_ptr<mbedtls_ssl_session> session(new mbedtls_ssl_session, [](mbedtls_ssl_session* s) {
+			mbedtls_ssl_session_free(s);
+			delete s;
+		});
+		mbedtls_ssl_session_init(session.get());
+
+		int ret = mbedtls_ssl_get_session(ssl, session.get());
+		if (ret != 0) {
+			if (this->VERBOSE) printf("[TLS SESSION CACHE] Failed to get session for %s, returned %d\n", key.c_str(), ret);
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+
+		// Remove any previous entry
+		for (auto it = this->entries.begin(); it != this->entries.end(); ++it) {
+			if (it->key.compare(key) == 0 && it->trustId == trustId) {
+				this->entries.erase(it);
+				break;
+			}
+		}
+
+		if (this->TTL_S == 0) return false;
+
+		// Evict the least recently used
+		while (this->entries.size() >= this->MAX_ENTRIES) this->entries.pop_back();
+
+		CacheEntry entry;
+		entry.key = key;
+		entry.session = session;
+		entry.trustId = trustId;
+		entry.expiresAt = esp_timer_get_time() + static_cast<uint64_t>(this->TTL_S) * 1000000;
+		this->entries.push_front(std::move(entry));
+
+		if (this->VERBOSE) printf("[TLS SESSION CACHE] Session for %s saved.\n", key.c_str());
+
+		return true;
+	}
+
+	void BriandIDFTlsSessionCache::Invalidate(const string& host, const short& port) {
+		string key = MakeKey(host, port);
+
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		for (auto it = this->entries.begin(); it != this->entries.end(); ) {
+			if (it->key.compare(key) == 0) it = this->entries.erase(it);
+			else ++it;
+		}
+	}
+
+	void BriandIDFTlsSessionCache::Clear() {
+		std::lock_guard<std::mutex> lock(this->cacheMutex);
+		this->entries.clear();
+	}
+
+	unsigned long BriandIDFTlsSessionCache::GetHits() {
+		return this->hits;
+	}
+
+	unsigned long BriandIDFTlsSessionCache::GetMisses() {
+		return this->misses;
+	}
+
+	size_t BriandIDFTlsSessionCache::GetObjectSize() {
+		size_t oSize = 0;
+
+		oSize += sizeof(*this);
+		for (const CacheEntry& entry : this->entries) {
+			oSize += sizeof(entry) + sizeof(char)*entry.key.size();
+			oSize += sizeof(mbedtls_ssl_session);
+		}
+
+		return oSize;
+	}
+
+	void BriandIDFTlsSessionCache::PrintObjectSizeInfo() {
+		printf("sizeof(*this) = %zu\n", sizeof(*this));
+		printf("this->entries (%zu entries) = %zu\n", this->entries.size(), this->GetObjectSize() - sizeof(*this));
+
+		printf("TOTAL = %zu\n", this->GetObjectSize());
+	}
+}
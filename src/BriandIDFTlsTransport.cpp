@@ -0,0 +1,351 @@
+/*
+    Briand IDF Library https://github.com/briand-hub/LibBriandIDF
+    Copyright (C) 2021 Author: briand (https://github.com/briand-hub)
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "BriandIDFTlsTransport.hxx"
+
+#include <iostream>
+#include <memory>
+#include <cstring>
+#include <chrono>
+#include <climits>
+
+// Writes up to this size never block once poll() reports POLLOUT on a pipe
+#ifndef PIPE_BUF
+	#define PIPE_BUF 512
+#endif
+
+using namespace std;
+
+namespace Briand {
+
+	/* ------------------------------------------------------------------ */
+	/* Raw descriptor                                                      */
+	/* ------------------------------------------------------------------ */
+
+	BriandIDFTlsFdTransport::BriandIDFTlsFdTransport(const int& fd, const bool& owned /* = true */) {
+		this->fd = fd;
+		this->owned = owned;
+	}
+
+	BriandIDFTlsFdTransport::~BriandIDFTlsFdTransport() {
+		this->Close();
+	}
+
+	int BriandIDFTlsFdTransport::Send(const unsigned char* buffer, const size_t& size) {
+		if (this->fd < 0) return -1;
+		if (this->Wait(POLLOUT, 0) == 0) return WOULD_BLOCK;
+
+		int ret;
+		do {
+			ret = send(this->fd, buffer, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+
+		// Not a socket: plain write(), the descriptor could be blocking so at most PIPE_BUF bytes (partial write)
+		if (ret < 0 && errno == ENOTSOCK) {
+			size_t chunk = (size < PIPE_BUF ? size : PIPE_BUF);
+			do {
+				ret = write(this->fd, buffer, chunk);
+			} while (ret < 0 && errno == EINTR);
+		}
+
+		if (ret < 0) return (errno == EAGAIN || errno == EWOULDBLOCK ? WOULD_BLOCK : -1);
+
+		return ret;
+	}
+
+	int BriandIDFTlsFdTransport::Recv(unsigned char* buffer, const size_t& size) {
+		if (this->fd < 0) return -1;
+		if (this->Wait(POLLIN, 0) == 0) return WOULD_BLOCK;
+
+		int ret;
+		do {
+			ret = read(this->fd, buffer, size);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) return (errno == EAGAIN || errno == EWOULDBLOCK ? WOULD_BLOCK : -1);
+
+		return ret;
+	}
+
+	int BriandIDFTlsFdTransport::Wait(const short& events, const unsigned long& timeoutMs) {
+		if (this->fd < 0) return -1;
+
+		struct pollfd pfd;
+		pfd.fd = this->fd;
+		pfd.events = events;
+		pfd.revents = 0;
+
+		int ret;
+		do {
+			ret = poll(&pfd, 1, static_cast<int>(timeoutMs));
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) return -1;
+		// POLLHUP/POLLERR: let the following Send()/Recv() report the condition
+		return (ret > 0 ? 1 : 0);
+	}
+
+	bool BriandIDFTlsFdTransport::IsOpen() {
+		return this->fd >= 0;
+	}
+
+	void BriandIDFTlsFdTransport::Close() {
+		if (this->fd >= 0 && this->owned) close(this->fd);
+		this->fd = -1;
+	}
+
+	int BriandIDFTlsFdTransport::GetDescriptor() {
+		return this->fd;
+	}
+
+	size_t BriandIDFTlsFdTransport::GetObjectSize() {
+		return sizeof(*this);
+	}
+
+	void BriandIDFTlsFdTransport::PrintObjectSizeInfo() {
+		printf("sizeof(*this) = %zu\n", sizeof(*this));
+
+		printf("TOTAL = %zu\n", this->GetObjectSize());
+	}
+
+	/* ------------------------------------------------------------------ */
+	/* Socket client                                                       */
+	/* ------------------------------------------------------------------ */
+
+	BriandIDFTlsClientTransport::BriandIDFTlsClientTransport(unique_ptr<BriandIDFSocketClient>& client) {
+		this->client = std::move(client);
+
+		// Raw socket I/O would bypass the records of an encrypted client: refused, IsOpen() will be false
+		if (this->client != nullptr && this->client->IsEncrypted()) this->Close();
+	}
+
+	BriandIDFTlsClientTransport::~BriandIDFTlsClientTransport() {
+		this->Close();
+	}
+
+	int BriandIDFTlsClientTransport::Send(const unsigned char* buffer, const size_t& size) {
+		if (this->client == nullptr || !this->client->IsConnected()) return -1;
+		if (this->Wait(POLLOUT, 0) == 0) return WOULD_BLOCK;
+
+		// Plain client: write straight to its socket, partial writes are returned as they are
+		int ret;
+		do {
+			ret = send(this->client->GetSocketDescriptor(), buffer, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) return (errno == EAGAIN || errno == EWOULDBLOCK ? WOULD_BLOCK : -1);
+
+		return ret;
+	}
+
+	int BriandIDFTlsClientTransport::Recv(unsigned char* buffer, const size_t& size) {
+		if (this->client == nullptr || !this->client->IsConnected()) return -1;
+
+		// Bytes already read ahead by the client come first, the client returns them without waiting
+		if (this->client->BufferedBytes() > 0) {
+			int ret = this->client->ReadInto(buffer, size);
+			return (ret < 0 ? -1 : ret);
+		}
+
+		// Zero bytes means peer closed
+		int ret;
+		do {
+			ret = recv(this->client->GetSocketDescriptor(), buffer, size, MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) return (errno == EAGAIN || errno == EWOULDBLOCK ? WOULD_BLOCK : -1);
+
+		return ret;
+	}
+
+	int BriandIDFTlsClientTransport::Wait(const short& events, const unsigned long& timeoutMs) {
+		if (this->client == nullptr || !this->client->IsConnected()) return -1;
+
+		// Bytes already buffered by the client will not wake up poll()
+		if ((events & POLLIN) && this->client->BufferedBytes() > 0) return 1;
+
+		struct pollfd pfd;
+		pfd.fd = this->client->GetSocketDescriptor();
+		pfd.events = events;
+		pfd.revents = 0;
+
+		int ret;
+		do {
+			ret = poll(&pfd, 1, static_cast<int>(timeoutMs));
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) return -1;
+		return (ret > 0 ? 1 : 0);
+	}
+
+	bool BriandIDFTlsClientTransport::IsOpen() {
+		return this->client != nullptr && this->client->IsAlive();
+	}
+
+	void BriandIDFTlsClientTransport::Close() {
+		if (this->client != nullptr) {
+			this->client->Disconnect();
+			this->client.reset();
+		}
+	}
+
+	int BriandIDFTlsClientTransport::GetDescriptor() {
+		return (this->client != nullptr ? this->client->GetSocketDescriptor() : -1);
+	}
+
+	size_t BriandIDFTlsClientTransport::GetObjectSize() {
+		return sizeof(*this) + (this->client != nullptr ? this->client->GetObjectSize() : 0);
+	}
+
+	void BriandIDFTlsClientTransport::PrintObjectSizeInfo() {
+		printf("sizeof(*this) = %zu\n", sizeof(*this));
+		printf("this->client->GetObjectSize() = %zu\n", (this->client != nullptr ? this->client->GetObjectSize() : 0));
+
+		printf("TOTAL = %zu\n", this->GetObjectSize());
+	}
+
+	/* ------------------------------------------------------------------ */
+	/* In-memory pipe                                                      */
+	/* ------------------------------------------------------------------ */
+
+	BriandIDFTlsPipeTransport::BriandIDFTlsPipeTransport(const shared_ptr<PipeState>& state, const unsigned char& side) {
+		this->state = state;
+		this->side = side;
+	}
+
+	BriandIDFTlsPipeTransport::~BriandIDFTlsPipeTransport() {
+		this->Close();
+	}
+
+	void BriandIDFTlsPipeTransport::CreatePipe(unique_ptr<BriandIDFTlsTransport>& first, unique_ptr<BriandIDFTlsTransport>& second, const size_t& capacity /* = 16384 */) {
+		auto state = make_shared<PipeState>();
+		for (unsigned char i = 0; i < 2; i++) {
+			state->readPos[i] = 0;
+			state->closed[i] = false;
+			state->queue[i].reserve(capacity);
+		}
+		state->capacity = (capacity > 0 ? capacity : 1);
+
+		// Private constructor
+		first = unique_ptr<BriandIDFTlsTransport>(new BriandIDFTlsPipeTransport(state, 0));
+		second = unique_ptr<BriandIDFTlsTransport>(new BriandIDFTlsPipeTransport(state, 1));
+	}
+
+	int BriandIDFTlsPipeTransport::Send(const unsigned char* buffer, const size_t& size) {
+		std::unique_lock<std::mutex> lock(this->state->pipeMutex);
+
+		if (this->state->closed[this->side] || this->state->closed[1 - this->side]) return -1;
+
+		// This end writes queue[side]
+		auto& queue = this->state->queue[this->side];
+		size_t& readPos = this->state->readPos[this->side];
+
+		// Compact when everything has been read
+		if (readPos > 0 && readPos == queue.size()) {
+			queue.clear();
+			readPos = 0;
+		}
+
+		size_t waiting = queue.size() - readPos;
+		if (waiting >= this->state->capacity) return WOULD_BLOCK;
+
+		size_t n = this->state->capacity - waiting;
+		if (n > size) n = size;
+
+		// Make room moving unread bytes to the front
+		if (readPos > 0 && queue.size() + n > this->state->capacity) {
+			queue.erase(queue.begin(), queue.begin() + readPos);
+			readPos = 0;
+		}
+
+		queue.insert(queue.end(), buffer, buffer + n);
+
+		lock.unlock();
+		this->state->changed.notify_all();
+
+		return static_cast<int>(n);
+	}
+
+	int BriandIDFTlsPipeTransport::Recv(unsigned char* buffer, const size_t& size) {
+		std::unique_lock<std::mutex> lock(this->state->pipeMutex);
+
+		if (this->state->closed[this->side]) return -1;
+
+		// This end reads what the other end wrote
+		auto& queue = this->state->queue[1 - this->side];
+		size_t& readPos = this->state->readPos[1 - this->side];
+
+		size_t waiting = queue.size() - readPos;
+		if (waiting == 0) return (this->state->closed[1 - this->side] ? 0 : WOULD_BLOCK);
+
+		size_t n = (waiting < size ? waiting : size);
+		memcpy(buffer, queue.data() + readPos, n);
+		readPos += n;
+
+		lock.unlock();
+		this->state->changed.notify_all();
+
+		return static_cast<int>(n);
+	}
+
+	int BriandIDFTlsPipeTransport::Wait(const short& events, const unsigned long& timeoutMs) {
+		std::unique_lock<std::mutex> lock(this->state->pipeMutex);
+
+		auto ready = [this, &events]() {
+			if (this->state->closed[0] || this->state->closed[1]) return true;
+			if ((events & POLLIN) && this->state->queue[1 - this->side].size() > this->state->readPos[1 - this->side]) return true;
+			if ((events & POLLOUT) && this->state->queue[this->side].size() - this->state->readPos[this->side] < this->state->capacity) return true;
+			return false;
+		};
+
+		if (this->state->closed[this->side]) return -1;
+
+		return (this->state->changed.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready) ? 1 : 0);
+	}
+
+	bool BriandIDFTlsPipeTransport::IsOpen() {
+		std::lock_guard<std::mutex> lock(this->state->pipeMutex);
+		return !this->state->closed[0] && !this->state->closed[1];
+	}
+
+	void BriandIDFTlsPipeTransport::Close() {
+		{
+			std::lock_guard<std::mutex> lock(this->state->pipeMutex);
+			if (this->state->closed[this->side]) return;
+			this->state->closed[this->side] = true;
+		}
+		this->state->changed.notify_all();
+	}
+
+	size_t BriandIDFTlsPipeTransport::GetObjectSize() {
+		size_t oSize = 0;
+
+		oSize += sizeof(*this);
+		// The shared state is counted by the first end only
+		if (this->side == 0) {
+			oSize += sizeof(PipeState);
+			oSize += sizeof(unsigned char)*(this->state->queue[0].capacity() + this->state->queue[1].capacity());
+		}
+
+		return oSize;
+	}
+
+	void BriandIDFTlsPipeTransport::PrintObjectSizeInfo() {
+		printf("sizeof(*this) = %zu\n", sizeof(*this));
+		printf("shared state and queues (first end only) = %zu\n", this->GetObjectSize() - sizeof(*this));
+
+		printf("TOTAL = %zu\n", this->GetObjectSize());
+	}
+}
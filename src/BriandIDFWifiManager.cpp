@@ -20,12 +20,14 @@
 #include <sstream>
 #include <iomanip>
 #include <string.h>
+#include <algorithm>
 
 /* Framework libraries */
 #if defined(ESP_PLATFORM)
 	#include <esp_wifi.h>
 	#include <esp_netif.h>
 	#include <esp_log.h>
+	#include <nvs.h>
 #elif defined(__linux__)
 	#include "BriandEspLinuxPorting.hxx"
 	#include <mbedtls/ssl.h>
@@ -37,9 +39,39 @@ using namespace std;
 
 namespace Briand {
 
+	/** NVS namespace and key of the last network (max 15 chars) */
+	static const char* STA_CACHE_NAMESPACE = "briandwifi";
+	static const char* STA_CACHE_KEY = "sta_cache";
+	/** Format version of the last network blob, change if StaCache changes */
+	static const uint8_t STA_CACHE_VERSION = 1;
+
+	/** Power save profiles, in the GetPowerProfileNames() order (listen interval 0 means driver default, 3 beacons) */
+	static const wifi_ps_type_t POWER_PROFILE_PS[] = { WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM };
+	static const uint16_t POWER_PROFILE_LISTEN_INTERVAL[] = { 0, 3, 10 };
+
 	// Define so it can be initialized with first call to GetInstance()
 	BriandIDFWifiManager* BriandIDFWifiManager::Instance = NULL;
 
+	const EventBits_t BriandIDFWifiManager::STA_STARTED_BIT;
+	const EventBits_t BriandIDFWifiManager::STA_GOT_IP_BIT;
+	const EventBits_t BriandIDFWifiManager::STA_DISCONNECTED_BIT;
+	const EventBits_t BriandIDFWifiManager::STA_RECONNECT_BIT;
+	const EventBits_t BriandIDFWifiManager::RECONNECT_STOP_BIT;
+	const EventBits_t BriandIDFWifiManager::STA_SCAN_DONE_BIT;
+	const uint16_t BriandIDFWifiManager::MAX_SCAN_RESULTS;
+	const unsigned long BriandIDFWifiManager::RECONNECT_ATTEMPT_TIMEOUT_MS;
+	const unsigned char BriandIDFWifiManager::STA_STATE_IDLE;
+	const unsigned char BriandIDFWifiManager::STA_STATE_STARTED;
+	const unsigned char BriandIDFWifiManager::STA_STATE_CONNECTING;
+	const unsigned char BriandIDFWifiManager::STA_STATE_CONNECTED;
+	const unsigned char BriandIDFWifiManager::STA_STATE_DISCONNECTED;
+	const unsigned char BriandIDFWifiManager::CONNECT_PATH_NONE;
+	const unsigned char BriandIDFWifiManager::CONNECT_PATH_FULL;
+	const unsigned char BriandIDFWifiManager::CONNECT_PATH_CACHED;
+	const unsigned char BriandIDFWifiManager::CONNECT_PATH_CACHED_LEASE;
+	const unsigned char BriandIDFWifiManager::CONNECT_PATH_SCAN;
+	const unsigned char BriandIDFWifiManager::POWER_PROFILES;
+
 	BriandIDFWifiManager* BriandIDFWifiManager::GetInstance() {
 		// Singleton pattern
 		if (BriandIDFWifiManager::Instance == NULL) {
@@ -52,9 +84,36 @@ namespace Briand {
 	BriandIDFWifiManager::BriandIDFWifiManager() {
 		this->VERBOSE = false;
 		this->INITIALIZED = false;
-		this->STA_CONNECTED = false;
 		this->AP_READY = false;
-		this->STA_IF_READY = false;
+		this->staState = STA_STATE_IDLE;
+		this->staEvents = xEventGroupCreate();
+		this->staStartEvent = NULL;
+		this->staDisconnectedEvent = NULL;
+		this->staGotIpEvent = NULL;
+		this->staLostIpEvent = NULL;
+		this->staScanDoneEvent = NULL;
+		this->scanning = false;
+		this->scanTime = 0;
+		this->scanCacheMs = 10000;
+		this->AUTO_RECONNECT = false;
+		this->staWanted = false;
+		this->reconnectTaskRunning = false;
+		this->reconnectAttempt = 0;
+		this->reconnectMinDelayMs = 1000;
+		this->reconnectMaxDelayMs = 60000;
+		this->nextCallbackId = 1;
+		memset(&this->outageStats, 0, sizeof(this->outageStats));
+		this->outageStart = 0;
+		this->FAST_RECONNECT = true;
+		this->REUSE_LEASE = false;
+		this->fastPathTimeoutMs = 5000;
+		this->staticLeaseApplied = false;
+		memset(&this->lastConnectReport, 0, sizeof(this->lastConnectReport));
+		this->powerProfile = 0;
+		this->powerBurst = false;
+		this->lastTrafficTime = 0;
+		this->burstHoldMs = 500;
+		memset(this->rttStats, 0, sizeof(this->rttStats));
 		this->interfaceAP = NULL;
 		this->interfaceSTA = NULL;
 
@@ -71,6 +130,18 @@ namespace Briand {
 	BriandIDFWifiManager::~BriandIDFWifiManager() {
 		// Stop wifi
 		this->StopWIFI();
+		// Stop the reconnect task (uses the event group)
+		if (this->reconnectTaskRunning && this->staEvents != NULL) {
+			xEventGroupSetBits(this->staEvents, RECONNECT_STOP_BIT);
+			while (this->reconnectTaskRunning) vTaskDelay(10/portTICK_PERIOD_MS);
+		}
+		// Remove event handlers
+		if (this->staStartEvent != NULL) esp_event_handler_instance_unregister(WIFI_EVENT, WIFI_EVENT_STA_START, this->staStartEvent);
+		if (this->staDisconnectedEvent != NULL) esp_event_handler_instance_unregister(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, this->staDisconnectedEvent);
+		if (this->staGotIpEvent != NULL) esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, this->staGotIpEvent);
+		if (this->staLostIpEvent != NULL) esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_LOST_IP, this->staLostIpEvent);
+		if (this->staScanDoneEvent != NULL) esp_event_handler_instance_unregister(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, this->staScanDoneEvent);
+		if (this->staEvents != NULL) vEventGroupDelete(this->staEvents);
 		// Clean
 		delete Instance;
 	}
@@ -125,7 +196,11 @@ namespace Briand {
 	}
 
 	bool BriandIDFWifiManager::IsConnected() {
-		return this->STA_CONNECTED;
+		return this->staState == STA_STATE_CONNECTED;
+	}
+
+	unsigned char BriandIDFWifiManager::GetStaState() {
+		return this->staState;
 	}
 
 	bool BriandIDFWifiManager::IsAPReady() {
@@ -170,49 +245,84 @@ namespace Briand {
 		// Set zeros to the current wifi ap/sta configuration
 		memset(&this->currentConfig, 0, sizeof(this->currentConfig));
 
+		// Station events, handlers stay registered so the state is always up to date. Pass this object as argument.
+		err = esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_STA_START, &BriandIDFWifiManager::WiFiEventHandler, this, &this->staStartEvent);
+		if (err == ESP_OK) err = esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &BriandIDFWifiManager::WiFiEventHandler, this, &this->staDisconnectedEvent);
+		if (err == ESP_OK) err = esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &BriandIDFWifiManager::WiFiEventHandler, this, &this->staGotIpEvent);
+		if (err == ESP_OK) err = esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_LOST_IP, &BriandIDFWifiManager::WiFiEventHandler, this, &this->staLostIpEvent);
+		if (err == ESP_OK) err = esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &BriandIDFWifiManager::WiFiEventHandler, this, &this->staScanDoneEvent);
+		if (err != ESP_OK || this->staEvents == NULL) {
+			if (this->VERBOSE) cout << "[WIFI MANAGER] Error occoured during event handlers registration: " << esp_err_to_name(err) << endl;
+			return;
+		}
+
 		this->INITIALIZED = true;
 	}
 
 	void BriandIDFWifiManager::WiFiEventHandler(void* evtArg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
 		// First argument passed to handler is the BriandIDFWifiManager instance (this)
-		if (event_id == IP_EVENT_STA_GOT_IP) {
+		// The state is written first, then statistics and callbacks, then the bits are set: a waiter woken by the bits always reads the new state.
+		// Ids are per base (WIFI_EVENT_SCAN_DONE and IP_EVENT_STA_LOST_IP are both 1), so the base is always checked.
+		if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
 			// Set success on connection
 			auto wifiManagerInstance = ((BriandIDFWifiManager*)evtArg);
 			if (wifiManagerInstance != nullptr) {
-				wifiManagerInstance->STA_CONNECTED = true;
+				unsigned char previous = wifiManagerInstance->staState.exchange(STA_STATE_CONNECTED);
+				wifiManagerInstance->reconnectAttempt = 0;
+				if (previous != STA_STATE_CONNECTED) wifiManagerInstance->NotifyStateChange(true);
+				xEventGroupClearBits(wifiManagerInstance->staEvents, STA_DISCONNECTED_BIT);
+				xEventGroupSetBits(wifiManagerInstance->staEvents, STA_GOT_IP_BIT);
 			}
 		}
-		if (event_id == WIFI_EVENT_STA_START) {
+		if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
 			// Set interface ready (ex. for setting hostname)
 			auto wifiManagerInstance = ((BriandIDFWifiManager*)evtArg);
 			if (wifiManagerInstance != nullptr) {
-				wifiManagerInstance->STA_IF_READY = true;
+				unsigned char idle = STA_STATE_IDLE;
+				wifiManagerInstance->staState.compare_exchange_strong(idle, STA_STATE_STARTED);
+				xEventGroupSetBits(wifiManagerInstance->staEvents, STA_STARTED_BIT);
 			}
 		}
-		if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
-			// Set interface ready (ex. for setting hostname)
+		if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+			// Connection lost or connection attempt failed
 			auto wifiManagerInstance = ((BriandIDFWifiManager*)evtArg);
 			if (wifiManagerInstance != nullptr) {
-				wifiManagerInstance->STA_CONNECTED = false;
-				printf("[WIFI MANAGER] STA DISCONNECTED event.\n");
+				unsigned char previous = wifiManagerInstance->staState.exchange(STA_STATE_DISCONNECTED);
+				if (wifiManagerInstance->VERBOSE) printf("[WIFI MANAGER] STA DISCONNECTED event.\n");
+				if (previous == STA_STATE_CONNECTED) wifiManagerInstance->NotifyStateChange(false);
+				xEventGroupClearBits(wifiManagerInstance->staEvents, STA_GOT_IP_BIT);
+				xEventGroupSetBits(wifiManagerInstance->staEvents, STA_DISCONNECTED_BIT);
+				// Lost connection or failed reconnection attempt: wake up the reconnect task
+				if (wifiManagerInstance->AUTO_RECONNECT && wifiManagerInstance->staWanted)
+					xEventGroupSetBits(wifiManagerInstance->staEvents, STA_RECONNECT_BIT);
 			}
 		}
-		if (event_id == IP_EVENT_STA_LOST_IP) {
-			// Set interface ready (ex. for setting hostname)
+		if (event_base == IP_EVENT && event_id == IP_EVENT_STA_LOST_IP) {
+			// Still associated, waiting for a new IP
+			auto wifiManagerInstance = ((BriandIDFWifiManager*)evtArg);
+			if (wifiManagerInstance != nullptr) {
+				unsigned char connected = STA_STATE_CONNECTED;
+				bool wasConnected = wifiManagerInstance->staState.compare_exchange_strong(connected, STA_STATE_CONNECTING);
+				xEventGroupClearBits(wifiManagerInstance->staEvents, STA_GOT_IP_BIT);
+				if (wifiManagerInstance->VERBOSE) printf("[WIFI MANAGER] STA LOST IP event.\n");
+				if (wasConnected) wifiManagerInstance->NotifyStateChange(false);
+			}
+		}
+		if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
 			auto wifiManagerInstance = ((BriandIDFWifiManager*)evtArg);
+			auto event = (wifi_event_sta_scan_done_t*) event_data;
 			if (wifiManagerInstance != nullptr) {
-				wifiManagerInstance->STA_CONNECTED = false;
-				printf("[WIFI MANAGER] STA LOST IP event.\n");
+				wifiManagerInstance->OnScanDone(event != NULL && event->status != 0);
 			}
 		}
-		if (event_id == WIFI_EVENT_AP_STACONNECTED) {
+		if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STACONNECTED) {
 			auto wifiManagerInstance = ((BriandIDFWifiManager*)evtArg);
 			auto event = (wifi_event_ap_staconnected_t*) event_data;
 			if (wifiManagerInstance != nullptr && wifiManagerInstance->VERBOSE) {
 				printf("[WIFI MANAGER] station with mac " MACSTR " connected to AP.", MAC2STR(event->mac));
 			}
 		}
-		if (event_id == WIFI_EVENT_AP_STADISCONNECTED) {
+		if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STADISCONNECTED) {
 			auto wifiManagerInstance = ((BriandIDFWifiManager*)evtArg);
 			auto event = (wifi_event_ap_stadisconnected_t*) event_data;
 			if (wifiManagerInstance != nullptr && wifiManagerInstance->VERBOSE) {
@@ -291,6 +401,63 @@ namespace Briand {
 	}
 
 	bool BriandIDFWifiManager::ConnectStation(const string& essid, const string& password, const int& timeoutSeconds, const string& ovverrideHostname /*= ""*/, const bool& changeMacToRandom/*= true*/) {
+		// For the connection report
+		uint64_t startTime = esp_timer_get_time();
+		memset(&this->lastConnectReport, 0, sizeof(this->lastConnectReport));
+
+		uint64_t deadline = startTime + static_cast<uint64_t>(timeoutSeconds)*1000000;
+
+		if (!this->StartStation(ovverrideHostname, changeMacToRandom, deadline)) return false;
+
+		return this->ConnectNetwork(essid, password, NULL, startTime, deadline);
+	}
+
+	bool BriandIDFWifiManager::ConnectStation(const vector<BriandIDFWifiCredentials>& networks, const int& timeoutSeconds, const string& ovverrideHostname /*= ""*/, const bool& changeMacToRandom/*= true*/) {
+		// For the connection report
+		uint64_t startTime = esp_timer_get_time();
+		memset(&this->lastConnectReport, 0, sizeof(this->lastConnectReport));
+
+		uint64_t deadline = startTime + static_cast<uint64_t>(timeoutSeconds)*1000000;
+
+		if (networks.size() == 0) return false;
+		if (!this->StartStation(ovverrideHostname, changeMacToRandom, deadline)) return false;
+
+		// Available APs (strongest first)
+		vector<BriandIDFWifiScanResult> results;
+		uint64_t now = esp_timer_get_time();
+		bool scanned = this->Scan(results, (deadline > now ? (deadline - now) / 1000 : 0));
+		if (!scanned && this->VERBOSE) cout << "[WIFI MANAGER] (STA) Scan failed, trying networks the usual way." << endl;
+
+		bool hiddenFound = false;
+		for (auto& ap : results) if (ap.ssid[0] == 0) hiddenFound = true;
+
+		// One pass: networks by priority, each one with its APs by signal
+		vector<bool> found(networks.size(), false);
+		for (size_t i = 0; i < networks.size(); i++) {
+			for (auto& ap : results) {
+				if (networks[i].essid.compare(ap.ssid) != 0) continue;
+				found[i] = true;
+				if (esp_timer_get_time() >= deadline) return false;
+				if (this->VERBOSE) printf("[WIFI MANAGER] (STA) Trying %s on channel %u (%d dBm).\n", ap.ssid, ap.channel, ap.rssi);
+				if (this->ConnectNetwork(networks[i].essid, networks[i].password, &ap, startTime, deadline)) return true;
+			}
+		}
+
+		// Networks not found could be hidden (worth only if the scan failed or found hidden networks)
+		if (!scanned || hiddenFound) {
+			for (size_t i = 0; i < networks.size(); i++) {
+				if (found[i]) continue;
+				if (esp_timer_get_time() >= deadline) return false;
+				if (this->ConnectNetwork(networks[i].essid, networks[i].password, NULL, startTime, deadline)) return true;
+			}
+		}
+
+		if (this->VERBOSE) cout << "[WIFI MANAGER] STA Connect failed, no network available" << endl;
+
+		return false;
+	}
+
+	bool BriandIDFWifiManager::StartStation(const string& ovverrideHostname, const bool& changeMacToRandom, const uint64_t& deadline) {
 		// Temp for error management
 		esp_err_t err;
 		
@@ -309,11 +476,56 @@ namespace Briand {
 			return false;
 		}
 
+		if (ovverrideHostname.length() > 32) {
+			if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Hostname too long! (max 32 chars)." << endl;
+			return false;
+		}
+
 		// Change mac if required
 		if (changeMacToRandom) {
 			this->SetRandomMAC(WIFI_IF_STA);
 		}
 
+		// Always stop & restart
+		err = esp_wifi_start();		
+		if (err != ESP_OK) {
+			if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Error occoured during esp_wifi_start: " << esp_err_to_name(err) << endl;
+			return false;
+		}
+
+		// Power save of the current profile
+		{
+			std::lock_guard<std::mutex> lock(this->powerMutex);
+			this->ApplyPowerSave();
+		}
+
+		// Wait for the interface (hostname must be set before DHCP starts)
+		if (!(this->WaitBits(STA_STARTED_BIT, deadline) & STA_STARTED_BIT)) {
+			if (this->VERBOSE) cout << "[WIFI MANAGER] STA interface start timed out" << endl;
+			return false;
+		}
+
+		// Set hostname if needed
+		if (ovverrideHostname.length() > 0) {
+			this->SetHostname(ovverrideHostname);
+		}
+
+		return true;
+	}
+
+	bool BriandIDFWifiManager::ConnectNetwork(const string& essid, const string& password, const BriandIDFWifiScanResult* target, const uint64_t& startTime, const uint64_t& deadline) {
+		// Temp for error management
+		esp_err_t err;
+
+		// A failure of this connection must not be retried by the reconnect task
+		this->staWanted = false;
+
+		// Previous static lease: back to DHCP
+		if (this->staticLeaseApplied) {
+			esp_netif_dhcpc_start(this->interfaceSTA);
+			this->staticLeaseApplied = false;
+		}
+
 		// Configure the connection
 		strcpy((char*)this->currentConfig.sta.ssid, essid.c_str());
 		strcpy((char*)this->currentConfig.sta.password, password.c_str());
@@ -323,116 +535,617 @@ namespace Briand {
 		this->currentConfig.sta.pmf_cfg.capable = true;
 		this->currentConfig.sta.pmf_cfg.required = false;
 
+		// Listen interval of the power save profile (sent to the AP on association)
+		this->currentConfig.sta.listen_interval = POWER_PROFILE_LISTEN_INTERVAL[this->powerProfile];
+
+		// Fast path: the given AP or the last network of this essid (no all-channel scan)
+		StaCache cache;
+		bool cached = this->FAST_RECONNECT && this->LoadStaCache(cache) && strcmp((const char*)cache.ssid, essid.c_str()) == 0;
+		bool fastPath = (target != NULL || cached);
+		// The cached lease belongs to the cached AP network
+		bool leaseUsable = cached && (target == NULL || memcmp(cache.bssid, target->bssid, 6) == 0);
+
+		this->currentConfig.sta.bssid_set = fastPath;
+		if (target != NULL) memcpy(this->currentConfig.sta.bssid, target->bssid, 6);
+		else if (cached) memcpy(this->currentConfig.sta.bssid, cache.bssid, 6);
+		this->currentConfig.sta.channel = (target != NULL ? target->channel : (cached ? cache.channel : 0));
+
 		err = esp_wifi_set_config(WIFI_IF_STA, &this->currentConfig);
 		if (err != ESP_OK) {
 			if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Error occoured during esp_wifi_set_config: " << esp_err_to_name(err) << endl;
 			return false;
 		}
 
-		// Connect and wait for failure or timeout
+		// Old results must not wake up the waits below (STA_STARTED_BIT is kept: no new event if already started)
+		xEventGroupClearBits(this->staEvents, STA_GOT_IP_BIT | STA_DISCONNECTED_BIT | STA_RECONNECT_BIT);
+
+		EventBits_t bits = 0;
+		uint64_t connectStart;
+
+		if (fastPath) {
+			// Last lease as static configuration (no DHCP exchange)
+			if (this->REUSE_LEASE && leaseUsable && cache.lease.ip != 0) {
+				esp_netif_dhcpc_stop(this->interfaceSTA);
+				if (esp_netif_set_ip_info(this->interfaceSTA, &cache.lease) == ESP_OK) {
+					esp_netif_set_dns_info(this->interfaceSTA, ESP_NETIF_DNS_MAIN, &cache.dns);
+					this->staticLeaseApplied = true;
+				}
+				else {
+					esp_netif_dhcpc_start(this->interfaceSTA);
+				}
+			}
 
-		long int timeout, now;
+			uint64_t fastDeadline = esp_timer_get_time() + static_cast<uint64_t>(this->fastPathTimeoutMs)*1000;
+			connectStart = esp_timer_get_time();
+			bits = this->StartConnection(fastDeadline < deadline ? fastDeadline : deadline);
 
-		esp_event_handler_instance_t got_ip_event;
+			if (bits & STA_GOT_IP_BIT) {
+				this->lastConnectReport.path = (this->staticLeaseApplied ? CONNECT_PATH_CACHED_LEASE : (target != NULL ? CONNECT_PATH_SCAN : CONNECT_PATH_CACHED));
+			}
+			else {
+				if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Fast connection failed" << (target == NULL ? ", scanning." : ".") << endl;
+				this->lastConnectReport.fastPathFailed = true;
+
+				// Abort the attempt (wait the event, a late one would fail the next attempt) and forget the network
+				if (!(bits & STA_DISCONNECTED_BIT) && esp_wifi_disconnect() == ESP_OK) 
+					this->WaitBits(STA_DISCONNECTED_BIT, esp_timer_get_time() + 1000000);
+				this->ClearCachedNetwork();
+				xEventGroupClearBits(this->staEvents, STA_GOT_IP_BIT | STA_DISCONNECTED_BIT);
+
+				// Given AP: the caller tries the next one
+				if (target != NULL) return false;
+			}
+		}
 
-/* LINUX PORTING REQUIRES LITTLE MOD HERE */
-#if defined(ESP_PLATFORM)
+		if (!(bits & STA_GOT_IP_BIT)) {
+			// Full path: all-channel scan and DHCP
+			connectStart = esp_timer_get_time();
+			bits = this->StartConnection(deadline);
+			if (bits & STA_GOT_IP_BIT) this->lastConnectReport.path = CONNECT_PATH_FULL;
+		}
 
-		// Pass this object as argument to event manager
-		esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &BriandIDFWifiManager::WiFiEventHandler, this, &got_ip_event);
+		if (!(bits & STA_GOT_IP_BIT)) {
+			if (this->VERBOSE) cout << "[WIFI MANAGER] STA Connect " << (bits & STA_DISCONNECTED_BIT ? "failed" : "timed out") << endl;
+			return false;
+		}
 
-		// Start interface, attach event handler for interface ready.
-		esp_event_handler_instance_t if_ready_change_hostname_event;
-		this->STA_IF_READY = false;
-		// Pass this object as argument to event manager
-		esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_STA_START, &BriandIDFWifiManager::WiFiEventHandler, this, &if_ready_change_hostname_event);
+		this->lastConnectReport.totalUs = esp_timer_get_time() - startTime;
+		this->lastConnectReport.connectUs = esp_timer_get_time() - connectStart;
 
-#elif defined(__linux__)
+		// Get IP info
+		esp_netif_ip_info_t ipInfo;
+		err = esp_netif_get_ip_info(this->interfaceSTA, &ipInfo);
+		if (err != ESP_OK) {
+			if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Error occoured during esp_netif_get_ip_info: " << esp_err_to_name(err) << endl;
+			return false;
+		}
 
-		this->STA_IF_READY = true;
-		this->STA_CONNECTED = true;
+		auto buf = make_unique<char[]>(16);
+		esp_ip4addr_ntoa(&ipInfo.ip, buf.get(), 15);
+		if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Connected! Your IP: " << buf.get() << endl;
+		if (this->VERBOSE) printf("[WIFI MANAGER] (STA) Connected with %s path in %llu ms (connect to GOT_IP: %llu ms).\n", 
+			(this->lastConnectReport.path == CONNECT_PATH_FULL ? "full" : 
+				(this->lastConnectReport.path == CONNECT_PATH_CACHED ? "cached network" : 
+				(this->lastConnectReport.path == CONNECT_PATH_SCAN ? "scanned network" : "cached network and lease"))),
+			static_cast<unsigned long long>(this->lastConnectReport.totalUs / 1000), static_cast<unsigned long long>(this->lastConnectReport.connectUs / 1000));
 
-#endif
+		// Remember the network for the next time
+		if (this->FAST_RECONNECT) this->SaveStaCache(essid, (cached ? &cache : NULL));
+
+		// From now on, a lost connection is an outage (and is reconnected if AUTO_RECONNECT)
+		this->staWanted = true;
+
+		return this->IsConnected();
+	}
+
+	bool BriandIDFWifiManager::StartScan(const BriandIDFWifiScanCallback& callback /* = nullptr */) {
+		if (!this->INITIALIZED) return false;
+
+		{
+			std::unique_lock<std::mutex> lock(this->eventMutex);
+
+			// Valid cached results
+			if (!this->scanning && this->scanTime != 0 && esp_timer_get_time() - this->scanTime < static_cast<uint64_t>(this->scanCacheMs)*1000) {
+				vector<BriandIDFWifiScanResult> results = this->scanResults;
+				lock.unlock();
+				if (callback != nullptr) callback(results);
+				return true;
+			}
+
+			if (callback != nullptr) this->scanCallbacks.push_back(callback);
+
+			// Running scan: the callback will be called when done
+			if (this->scanning) return true;
+			this->scanning = true;
+		}
+
+		// Scan needs the STA interface
+		if (this->GetWifiMode() == WIFI_MODE_AP)
+			this->SetWifiMode(WIFI_MODE_APSTA);
+		else if (this->GetWifiMode() != WIFI_MODE_APSTA)
+			this->SetWifiMode(WIFI_MODE_STA);
+
+		xEventGroupClearBits(this->staEvents, STA_SCAN_DONE_BIT);
+
+		esp_err_t err = esp_wifi_start();
+		// Hidden networks are returned too, with empty ssid
+		wifi_scan_config_t scanConfig;
+		memset(&scanConfig, 0, sizeof(scanConfig));
+		scanConfig.show_hidden = true;
+		if (err == ESP_OK) err = esp_wifi_scan_start(&scanConfig, false);
 
-		// Always stop & restart
-		err = esp_wifi_start();		
 		if (err != ESP_OK) {
-			if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Error occoured during esp_wifi_start: " << esp_err_to_name(err) << endl;
+			if (this->VERBOSE) cout << "[WIFI MANAGER] Error occoured during scan start: " << esp_err_to_name(err) << endl;
+			std::lock_guard<std::mutex> lock(this->eventMutex);
+			this->scanCallbacks.clear();
+			this->scanning = false;
 			return false;
 		}
 
-		// Disable powersave
-		esp_wifi_set_ps(WIFI_PS_NONE); 
-
-		// Set hostname if needed
+		return true;
+	}
 
-		if (ovverrideHostname.length() > 0) {
-			if (ovverrideHostname.length() > 32) {
-				if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Hostname too long! (max 32 chars)." << endl;
-				return false;
+	void BriandIDFWifiManager::OnScanDone(const bool& failed) {
+		vector<BriandIDFWifiScanResult> results;
+		vector<BriandIDFWifiScanCallback> callbacks;
+
+		uint16_t number = 0;
+		esp_wifi_scan_get_ap_num(&number);
+		if (number > MAX_SCAN_RESULTS) number = MAX_SCAN_RESULTS;
+
+		if (number > 0) {
+			// Frees the driver list too
+			auto records = make_unique<wifi_ap_record_t[]>(number);
+			if (esp_wifi_scan_get_ap_records(&number, records.get()) == ESP_OK) {
+				results.reserve(number);
+				for (uint16_t i = 0; i < number; i++) {
+					BriandIDFWifiScanResult result;
+					memset(&result, 0, sizeof(result));
+					strncpy(result.ssid, (const char*)records[i].ssid, sizeof(result.ssid) - 1);
+					memcpy(result.bssid, records[i].bssid, 6);
+					result.channel = records[i].primary;
+					result.rssi = records[i].rssi;
+					result.authmode = static_cast<uint8_t>(records[i].authmode);
+					results.push_back(result);
+				}
 			}
+		}
 
-			// Wait for event
-			
-			while (!this->STA_IF_READY) vTaskDelay(10/portTICK_PERIOD_MS);
+		std::stable_sort(results.begin(), results.end(), [](const BriandIDFWifiScanResult& a, const BriandIDFWifiScanResult& b) { return a.rssi > b.rssi; });
 
-			this->SetHostname(ovverrideHostname);
+		{
+			std::lock_guard<std::mutex> lock(this->eventMutex);
+			if (!failed) {
+				this->scanResults = results;
+				this->scanTime = esp_timer_get_time();
+			}
+			callbacks.swap(this->scanCallbacks);
+			this->scanning = false;
 		}
 
-/* LINUX PORTING REQUIRES LITTLE MOD HERE */
-#if defined(ESP_PLATFORM)
+		xEventGroupSetBits(this->staEvents, STA_SCAN_DONE_BIT);
 
-		// Delete the associated event
-		esp_event_handler_instance_unregister(WIFI_EVENT, WIFI_EVENT_WIFI_READY, &if_ready_change_hostname_event);
+		if (this->VERBOSE) printf("[WIFI MANAGER] Scan %s, %zu APs found.\n", (failed ? "failed" : "done"), results.size());
 
-#endif
+		for (auto& callback : callbacks) callback(results);
+	}
 
-		time(&timeout);
-		time(&now);
-		timeout += timeoutSeconds;
-		
-		// Connect
-		esp_wifi_connect();
+	bool BriandIDFWifiManager::Scan(vector<BriandIDFWifiScanResult>& results, const unsigned long& timeoutMs) {
+		uint64_t startTime = esp_timer_get_time();
+		uint64_t deadline = startTime + static_cast<uint64_t>(timeoutMs)*1000;
+
+		if (!this->StartScan()) return false;
+		if (this->scanning) this->WaitBits(STA_SCAN_DONE_BIT, deadline);
 
-		while ( !this->STA_CONNECTED && (now < timeout) ) {
-			if (this->VERBOSE) cout << ".";
-			time(&now);
-			vTaskDelay(1000/portTICK_PERIOD_MS);
+		{
+			// Results of a scan completed during this call are returned even if not cached (cache time 0)
+			std::lock_guard<std::mutex> lock(this->eventMutex);
+			if (this->scanTime != 0 && this->scanTime >= startTime) {
+				results = this->scanResults;
+				return true;
+			}
 		}
-		if (this->VERBOSE) cout << endl;
 
-		if (!this->STA_CONNECTED) {
-			if (this->VERBOSE) cout << "[WIFI MANAGER] STA Connect timed out" << endl;
+		return this->GetScanResults(results);
+	}
+
+	bool BriandIDFWifiManager::GetScanResults(vector<BriandIDFWifiScanResult>& results) {
+		std::lock_guard<std::mutex> lock(this->eventMutex);
+
+		if (this->scanTime == 0 || esp_timer_get_time() - this->scanTime >= static_cast<uint64_t>(this->scanCacheMs)*1000) return false;
+
+		results = this->scanResults;
+		return true;
+	}
+
+	void BriandIDFWifiManager::SetScanCacheTime(const unsigned long& cacheMs) {
+		std::lock_guard<std::mutex> lock(this->eventMutex);
+		this->scanCacheMs = cacheMs;
+	}
+
+	bool BriandIDFWifiManager::IsScanning() {
+		return this->scanning;
+	}
+
+	bool BriandIDFWifiManager::SetPowerProfile(const string& profile) {
+		auto names = GetPowerProfileNames();
+		auto found = std::find(names.begin(), names.end(), profile);
+		if (found == names.end()) {
+			if (this->VERBOSE) printf("[WIFI MANAGER] Power profile %s not found.\n", profile.c_str());
 			return false;
 		}
 
-/* LINUX PORTING REQUIRES LITTLE MOD HERE */
-#if defined(ESP_PLATFORM)
+		std::lock_guard<std::mutex> lock(this->powerMutex);
+		this->powerProfile = static_cast<unsigned char>(found - names.begin());
+		this->ApplyPowerSave();
 
-		// Delete the associated event
-		esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip_event);
+		return true;
+	}
 
-#endif
+	string BriandIDFWifiManager::GetPowerProfile() {
+		return GetPowerProfileNames()[this->powerProfile];
+	}
 
-		// Get IP info
-		esp_netif_ip_info_t ipInfo;
-		err = esp_netif_get_ip_info(this->interfaceSTA, &ipInfo);
+	vector<string> BriandIDFWifiManager::GetPowerProfileNames() {
+		return vector<string>({ "latency", "balanced", "battery" });
+	}
+
+	void BriandIDFWifiManager::SetBurstHoldTime(const unsigned long& holdMs) {
+		this->burstHoldMs = holdMs;
+	}
+
+	unsigned char BriandIDFWifiManager::GetEffectivePowerProfile() {
+		return ((this->powerBurst || this->AP_READY) ? 0 : this->powerProfile.load());
+	}
+
+	void BriandIDFWifiManager::ApplyPowerSave() {
+		if (!this->INITIALIZED) return;
+
+		esp_err_t err = esp_wifi_set_ps(POWER_PROFILE_PS[this->GetEffectivePowerProfile()]);
+		if (err != ESP_OK && this->VERBOSE) printf("[WIFI MANAGER] Error occoured during esp_wifi_set_ps: %s\n", esp_err_to_name(err));
+	}
+
+	void BriandIDFWifiManager::NotifyTraffic() {
+		this->lastTrafficTime = esp_timer_get_time();
+
+		// Called on every socket operation: nothing to do if power save is already off
+		if (this->powerBurst || this->powerProfile == 0 || this->AP_READY) return;
+
+		std::lock_guard<std::mutex> lock(this->powerMutex);
+		if (this->powerBurst || this->powerProfile == 0) return;
+
+		this->powerBurst = true;
+		if (xTaskCreate(&BriandIDFWifiManager::PowerBurstTask, "WifiPowerBurst", 2048, this, 5, NULL) != pdPASS) {
+			this->powerBurst = false;
+			if (this->VERBOSE) cout << "[WIFI MANAGER] Error, power burst task not started." << endl;
+			return;
+		}
+
+		this->ApplyPowerSave();
+	}
+
+	void BriandIDFWifiManager::PowerBurstTask(void* arg) {
+		auto wifiManagerInstance = ((BriandIDFWifiManager*)arg);
+
+		while (true) {
+			uint64_t holdUs = static_cast<uint64_t>(wifiManagerInstance->burstHoldMs) * 1000;
+			uint64_t now = esp_timer_get_time();
+			uint64_t last = wifiManagerInstance->lastTrafficTime;
+			uint64_t idleUs = (now > last ? now - last : 0);
+
+			if (idleUs >= holdUs) {
+				// Traffic could be notified meanwhile: check again with the lock
+				std::lock_guard<std::mutex> lock(wifiManagerInstance->powerMutex);
+				now = esp_timer_get_time();
+				last = wifiManagerInstance->lastTrafficTime;
+				if (now < last || now - last < holdUs) continue;
+
+				wifiManagerInstance->powerBurst = false;
+				wifiManagerInstance->ApplyPowerSave();
+				break;
+			}
+
+			// Sleep until the hold time could be over
+			TickType_t ticks = static_cast<TickType_t>((holdUs - idleUs) / 1000 / portTICK_PERIOD_MS);
+			vTaskDelay(ticks > 0 ? ticks : 1);
+		}
+
+		vTaskDelete(NULL);
+	}
+
+	void BriandIDFWifiManager::AddRttSample(const uint64_t& rttUs) {
+		std::lock_guard<std::mutex> lock(this->powerMutex);
+		BriandIDFWifiRttStats& stats = this->rttStats[this->GetEffectivePowerProfile()];
+
+		if (stats.samples == 0 || rttUs < stats.minUs) stats.minUs = rttUs;
+		if (rttUs > stats.maxUs) stats.maxUs = rttUs;
+		stats.totalUs += rttUs;
+		stats.samples++;
+	}
+
+	BriandIDFWifiRttStats BriandIDFWifiManager::GetRttStats(const string& profile) {
+		BriandIDFWifiRttStats stats;
+		memset(&stats, 0, sizeof(stats));
+
+		auto names = GetPowerProfileNames();
+		auto found = std::find(names.begin(), names.end(), profile);
+		if (found == names.end()) return stats;
+
+		std::lock_guard<std::mutex> lock(this->powerMutex);
+		return this->rttStats[found - names.begin()];
+	}
+
+	int64_t BriandIDFWifiManager::GetRttPenaltyUs(const string& profile) {
+		BriandIDFWifiRttStats stats = this->GetRttStats(profile);
+		BriandIDFWifiRttStats reference = this->GetRttStats(GetPowerProfileNames()[0]);
+
+		if (stats.samples == 0 || reference.samples == 0) return 0;
+
+		return static_cast<int64_t>(stats.totalUs / stats.samples) - static_cast<int64_t>(reference.totalUs / reference.samples);
+	}
+
+	void BriandIDFWifiManager::ResetRttStats() {
+		std::lock_guard<std::mutex> lock(this->powerMutex);
+		memset(this->rttStats, 0, sizeof(this->rttStats));
+	}
+
+	EventBits_t BriandIDFWifiManager::StartConnection(const uint64_t& deadline) {
+		this->staState = STA_STATE_CONNECTING;
+		esp_err_t err = esp_wifi_connect();
 		if (err != ESP_OK) {
-			if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Error occoured during esp_netif_get_ip_info: " << esp_err_to_name(err) << endl;
-			return false;
+			this->staState = STA_STATE_DISCONNECTED;
+			if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Error occoured during esp_wifi_connect: " << esp_err_to_name(err) << endl;
+			return 0;
 		}
 
-		auto buf = make_unique<char[]>(16);
-		esp_ip4addr_ntoa(&ipInfo.ip, buf.get(), 15);
-		if (this->VERBOSE) cout << "[WIFI MANAGER] (STA) Connected! Your IP: " << buf.get() << endl;
+		// Wakes up exactly on GOT_IP or DISCONNECTED
+		return this->WaitBits(STA_GOT_IP_BIT | STA_DISCONNECTED_BIT, deadline);
+	}
+
+	void BriandIDFWifiManager::ClearCachedNetwork() {
+		if (this->currentConfig.sta.bssid_set || this->currentConfig.sta.channel != 0) {
+			this->currentConfig.sta.bssid_set = false;
+			memset(this->currentConfig.sta.bssid, 0, sizeof(this->currentConfig.sta.bssid));
+			this->currentConfig.sta.channel = 0;
+			esp_wifi_set_config(WIFI_IF_STA, &this->currentConfig);
+		}
+
+		// Back to DHCP
+		if (this->staticLeaseApplied) {
+			esp_netif_dhcpc_start(this->interfaceSTA);
+			this->staticLeaseApplied = false;
+		}
+	}
+
+	bool BriandIDFWifiManager::LoadStaCache(StaCache& cache) {
+		nvs_handle_t handle;
+		if (nvs_open(STA_CACHE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return false;
+
+		size_t length = sizeof(StaCache);
+		esp_err_t err = nvs_get_blob(handle, STA_CACHE_KEY, &cache, &length);
+		nvs_close(handle);
+
+		return err == ESP_OK && length == sizeof(StaCache) && cache.version == STA_CACHE_VERSION;
+	}
+
+	void BriandIDFWifiManager::SaveStaCache(const string& essid, const StaCache* previous) {
+		StaCache cache;
+		wifi_ap_record_t apInfo;
+
+		memset(&cache, 0, sizeof(cache));
+		cache.version = STA_CACHE_VERSION;
+		strncpy((char*)cache.ssid, essid.c_str(), sizeof(cache.ssid) - 1);
+
+		if (esp_wifi_sta_get_ap_info(&apInfo) != ESP_OK || 
+			esp_netif_get_ip_info(this->interfaceSTA, &cache.lease) != ESP_OK ||
+			esp_netif_get_dns_info(this->interfaceSTA, ESP_NETIF_DNS_MAIN, &cache.dns) != ESP_OK) return;
+
+		memcpy(cache.bssid, apInfo.bssid, 6);
+		cache.channel = apInfo.primary;
+
+		// Unchanged: spare the flash a write
+		if (previous != NULL && memcmp(previous, &cache, sizeof(StaCache)) == 0) return;
+
+		nvs_handle_t handle;
+		esp_err_t err = nvs_open(STA_CACHE_NAMESPACE, NVS_READWRITE, &handle);
+		if (err == ESP_OK) {
+			err = nvs_set_blob(handle, STA_CACHE_KEY, &cache, sizeof(StaCache));
+			if (err == ESP_OK) err = nvs_commit(handle);
+			nvs_close(handle);
+		}
+
+		if (err != ESP_OK && this->VERBOSE) cout << "[WIFI MANAGER] (STA) Error saving the network cache: " << esp_err_to_name(err) << endl;
+	}
+
+	void BriandIDFWifiManager::SetFastReconnect(const bool& enabled, const bool& reuseLease /* = false */, const unsigned long& fastPathTimeoutMs /* = 5000 */) {
+		this->FAST_RECONNECT = enabled;
+		this->REUSE_LEASE = reuseLease;
+		this->fastPathTimeoutMs = (fastPathTimeoutMs > 0 ? fastPathTimeoutMs : 1);
+	}
 
-		return this->STA_CONNECTED;
+	void BriandIDFWifiManager::ClearConnectionCache() {
+		nvs_handle_t handle;
+		if (nvs_open(STA_CACHE_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+			if (nvs_erase_key(handle, STA_CACHE_KEY) == ESP_OK) nvs_commit(handle);
+			nvs_close(handle);
+		}
+	}
+
+	BriandIDFWifiConnectReport BriandIDFWifiManager::GetLastConnectReport() {
+		return this->lastConnectReport;
+	}
+
+	bool BriandIDFWifiManager::SetAutoReconnect(const bool& enabled, const unsigned long& minDelayMs /* = 1000 */, const unsigned long& maxDelayMs /* = 60000 */) {
+		this->reconnectMinDelayMs = (minDelayMs > 0 ? minDelayMs : 1);
+		this->reconnectMaxDelayMs = (maxDelayMs > this->reconnectMinDelayMs ? maxDelayMs : this->reconnectMinDelayMs);
+		this->AUTO_RECONNECT = enabled;
+
+		// The task is started once and then waits for events
+		if (enabled && this->INITIALIZED && !this->reconnectTaskRunning) {
+			this->reconnectTaskRunning = true;
+			if (xTaskCreate(&BriandIDFWifiManager::ReconnectTask, "WifiReconnect", 4096, this, 5, NULL) != pdPASS) {
+				this->reconnectTaskRunning = false;
+				this->AUTO_RECONNECT = false;
+				if (this->VERBOSE) cout << "[WIFI MANAGER] Error, reconnect task not started." << endl;
+				return false;
+			}
+		}
+
+		return !enabled || this->reconnectTaskRunning;
+	}
+
+	unsigned long BriandIDFWifiManager::GetReconnectDelay(const unsigned long& attempt) {
+		unsigned long delay = this->reconnectMinDelayMs;
+		for (unsigned long i = 0; i < attempt && delay < this->reconnectMaxDelayMs; i++) delay *= 2;
+		if (delay > this->reconnectMaxDelayMs) delay = this->reconnectMaxDelayMs;
+
+		// Half fixed, half random
+		return delay/2 + (esp_random() % (delay/2 + 1));
+	}
+
+	void BriandIDFWifiManager::ReconnectTask(void* arg) {
+		auto wifiManagerInstance = ((BriandIDFWifiManager*)arg);
+		bool attemptPending = false;
+
+		while (true) {
+			// Wait for a lost connection or a failed attempt. With an attempt pending, wait only for its result.
+			TickType_t wait = (attemptPending ? RECONNECT_ATTEMPT_TIMEOUT_MS/portTICK_PERIOD_MS : portMAX_DELAY);
+			EventBits_t bits = xEventGroupWaitBits(wifiManagerInstance->staEvents, STA_RECONNECT_BIT | RECONNECT_STOP_BIT, pdTRUE, pdFALSE, wait);
+			if (bits & RECONNECT_STOP_BIT) break;
+
+			if (!(bits & STA_RECONNECT_BIT)) {
+				// No result: abort the attempt, the DISCONNECTED event will start the next one
+				attemptPending = false;
+				if (wifiManagerInstance->staState == STA_STATE_CONNECTING && wifiManagerInstance->staWanted) esp_wifi_disconnect();
+				continue;
+			}
+
+			attemptPending = false;
+			if (!wifiManagerInstance->AUTO_RECONNECT || !wifiManagerInstance->staWanted) continue;
+
+			unsigned long delayMs = wifiManagerInstance->GetReconnectDelay(wifiManagerInstance->reconnectAttempt++);
+			if (wifiManagerInstance->VERBOSE) printf("[WIFI MANAGER] STA reconnecting in %lu ms.\n", delayMs);
+
+			// Backoff, interrupted by stop or by a connection made meanwhile
+			bits = xEventGroupWaitBits(wifiManagerInstance->staEvents, STA_GOT_IP_BIT | RECONNECT_STOP_BIT, pdFALSE, pdFALSE, delayMs/portTICK_PERIOD_MS);
+			if (bits & RECONNECT_STOP_BIT) break;
+			if ((bits & STA_GOT_IP_BIT) || !wifiManagerInstance->AUTO_RECONNECT || !wifiManagerInstance->staWanted) continue;
+
+			{
+				std::lock_guard<std::mutex> lock(wifiManagerInstance->eventMutex);
+				wifiManagerInstance->outageStats.attempts++;
+			}
+
+			// The cached network failed once: could have changed, scan all channels (and use DHCP)
+			if (wifiManagerInstance->reconnectAttempt > 1) wifiManagerInstance->ClearCachedNetwork();
+
+			wifiManagerInstance->staState = STA_STATE_CONNECTING;
+			xEventGroupClearBits(wifiManagerInstance->staEvents, STA_DISCONNECTED_BIT);
+			attemptPending = true;
+
+			esp_err_t err = esp_wifi_connect();
+			if (err != ESP_OK) {
+				if (wifiManagerInstance->VERBOSE) printf("[WIFI MANAGER] STA reconnection error: %s\n", esp_err_to_name(err));
+				// Retry (next backoff)
+				attemptPending = false;
+				wifiManagerInstance->staState = STA_STATE_DISCONNECTED;
+				xEventGroupSetBits(wifiManagerInstance->staEvents, STA_DISCONNECTED_BIT | STA_RECONNECT_BIT);
+			}
+		}
+
+		wifiManagerInstance->reconnectTaskRunning = false;
+		vTaskDelete(NULL);
+	}
+
+	void BriandIDFWifiManager::NotifyStateChange(const bool& connected) {
+		vector<BriandIDFWifiStateCallback> callbacks;
+
+		{
+			std::lock_guard<std::mutex> lock(this->eventMutex);
+
+			uint64_t now = esp_timer_get_time();
+			if (!connected && this->staWanted && this->outageStart == 0) {
+				this->outageStart = now;
+			}
+			else if (connected && this->outageStart != 0) {
+				uint64_t duration = now - this->outageStart;
+				this->outageStats.outages++;
+				this->outageStats.totalUs += duration;
+				this->outageStats.lastUs = duration;
+				if (duration > this->outageStats.longestUs) this->outageStats.longestUs = duration;
+				this->outageStart = 0;
+				if (this->VERBOSE) printf("[WIFI MANAGER] STA outage ended after %llu ms.\n", static_cast<unsigned long long>(duration / 1000));
+			}
+
+			// Copy: a callback could add or remove callbacks
+			for (auto& entry : this->stateCallbacks) callbacks.push_back(entry.second);
+		}
+
+		for (auto& callback : callbacks) callback(connected);
+	}
+
+	int BriandIDFWifiManager::AddStateCallback(const BriandIDFWifiStateCallback& callback) {
+		std::lock_guard<std::mutex> lock(this->eventMutex);
+		int id = this->nextCallbackId++;
+		this->stateCallbacks[id] = callback;
+		return id;
+	}
+
+	void BriandIDFWifiManager::RemoveStateCallback(const int& id) {
+		std::lock_guard<std::mutex> lock(this->eventMutex);
+		this->stateCallbacks.erase(id);
+	}
+
+	BriandIDFWifiOutageStats BriandIDFWifiManager::GetOutageStats() {
+		std::lock_guard<std::mutex> lock(this->eventMutex);
+		BriandIDFWifiOutageStats stats = this->outageStats;
+		stats.currentUs = (this->outageStart != 0 ? esp_timer_get_time() - this->outageStart : 0);
+		return stats;
+	}
+
+	void BriandIDFWifiManager::ResetOutageStats() {
+		std::lock_guard<std::mutex> lock(this->eventMutex);
+		memset(&this->outageStats, 0, sizeof(this->outageStats));
+		// An outage in progress is still measured
+	}
+
+	EventBits_t BriandIDFWifiManager::WaitBits(const EventBits_t& bits, const uint64_t& deadline) {
+		uint64_t now = esp_timer_get_time();
+		TickType_t ticks = (now < deadline ? static_cast<TickType_t>((deadline - now) / 1000 / portTICK_PERIOD_MS) : 0);
+		
+		// Bits are not cleared on exit, they describe the current state
+		return xEventGroupWaitBits(this->staEvents, bits, pdFALSE, pdFALSE, ticks);
+	}
+
+	bool BriandIDFWifiManager::WaitForConnection(const unsigned long& timeoutMs) {
+		if (!this->INITIALIZED) return false;
+
+		uint64_t deadline = esp_timer_get_time() + static_cast<uint64_t>(timeoutMs)*1000;
+
+		// Reconnecting automatically: failed attempts do not end the wait
+		if (this->AUTO_RECONNECT && this->staWanted) {
+			return (this->WaitBits(STA_GOT_IP_BIT, deadline) & STA_GOT_IP_BIT) && this->IsConnected();
+		}
+
+		// Already disconnected: do not wait for an event that will not come
+		if (this->staState == STA_STATE_IDLE || this->staState == STA_STATE_DISCONNECTED) return false;
+
+		EventBits_t bits = this->WaitBits(STA_GOT_IP_BIT | STA_DISCONNECTED_BIT, deadline);
+
+		return (bits & STA_GOT_IP_BIT) && this->IsConnected();
 	}
 
 	void BriandIDFWifiManager::DisconnectStation() {
 		// Temp for error management
 		esp_err_t err;
 
+		// Wanted disconnection: no reconnection, no outage
+		this->staWanted = false;
+		{
+			std::lock_guard<std::mutex> lock(this->eventMutex);
+			this->outageStart = 0;
+		}
+
 		err = esp_wifi_disconnect();
 		if (err != ESP_OK) {
 			if (this->VERBOSE) cout << "[WIFI MANAGER] Station disconnect failed: " << esp_err_to_name(err) << endl;
@@ -441,7 +1154,18 @@ namespace Briand {
 		// Configuration reset, otherwise will not reconnect another time!
 		memset(&this->currentConfig.sta, 0, sizeof(this->currentConfig.sta));
 
-		this->STA_CONNECTED = false;
+		// Back to DHCP
+		if (this->staticLeaseApplied) {
+			esp_netif_dhcpc_start(this->interfaceSTA);
+			this->staticLeaseApplied = false;
+		}
+
+		// Wait (briefly) for the event, so a late one will not fail the next ConnectStation()
+		unsigned char state = this->staState;
+		if (err == ESP_OK && (state == STA_STATE_CONNECTING || state == STA_STATE_CONNECTED))
+			this->WaitBits(STA_DISCONNECTED_BIT, esp_timer_get_time() + 1000000);
+
+		this->staState = STA_STATE_DISCONNECTED;
 	}
 
 	bool BriandIDFWifiManager::StartAP(const string& essid, const string& password, const unsigned char& channel, const unsigned char& maxConnections, const bool& changeMacToRandom /* = true*/) {
@@ -497,6 +1221,12 @@ namespace Briand {
 
 		this->AP_READY = true;
 
+		// AP clients must be served at any time
+		{
+			std::lock_guard<std::mutex> lock(this->powerMutex);
+			this->ApplyPowerSave();
+		}
+
 		if (this->VERBOSE) cout << "[WIFI MANAGER] (AP) Started." << endl;
 
 		return true;
@@ -513,12 +1243,24 @@ namespace Briand {
 		memset(&this->currentConfig.ap, 0, sizeof(this->currentConfig.ap));
 
 		this->AP_READY = false;
+
+		// Station alone: back to the profile power save
+		std::lock_guard<std::mutex> lock(this->powerMutex);
+		this->ApplyPowerSave();
 	}
 
 	void BriandIDFWifiManager::StopWIFI() { 
+		this->staWanted = false;
+		{
+			std::lock_guard<std::mutex> lock(this->eventMutex);
+			this->outageStart = 0;
+		}
 		esp_wifi_stop();
 		// Configuration reset, otherwise will not reconnect another time!
 		memset(&this->currentConfig, 0, sizeof(this->currentConfig));
+		// Station stopped: next start throws a new STA_START event
+		this->staState = STA_STATE_IDLE;
+		if (this->staEvents != NULL) xEventGroupClearBits(this->staEvents, STA_STARTED_BIT | STA_GOT_IP_BIT | STA_DISCONNECTED_BIT | STA_RECONNECT_BIT);
 	}
 
 	string BriandIDFWifiManager::GetApIP() {
@@ -739,6 +1481,8 @@ namespace Briand {
 
 		oSize += sizeof(*this);
 		oSize += sizeof(this->Instance) + (this->Instance != NULL ? sizeof(BriandIDFWifiManager) : 0);
+		oSize += this->stateCallbacks.size() * (sizeof(int) + sizeof(BriandIDFWifiStateCallback));
+		oSize += this->scanResults.capacity() * sizeof(BriandIDFWifiScanResult);
 
 		return oSize;
 	}
@@ -746,6 +1490,8 @@ namespace Briand {
 	void BriandIDFWifiManager::PrintObjectSizeInfo() {
 		printf("sizeof(*this) = %zu\n", sizeof(*this));
 		printf("sizeof(this->Instance) + (this->Instance != NULL ? sizeof(BriandIDFWifiManager) : 0) = %zu\n", sizeof(this->Instance) + (this->Instance != NULL ? sizeof(BriandIDFWifiManager) : 0));
+		printf("this->stateCallbacks = %zu\n", this->stateCallbacks.size() * (sizeof(int) + sizeof(BriandIDFWifiStateCallback)));
+		printf("this->scanResults = %zu\n", this->scanResults.capacity() * sizeof(BriandIDFWifiScanResult));
 
 		printf("TOTAL = %zu\n", this->GetObjectSize());
 	}